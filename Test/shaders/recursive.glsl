@@ -0,0 +1,3 @@
+// Includes itself until the include depth limit is hit
+float recursion_marker;
+#include "recursive.glsl"
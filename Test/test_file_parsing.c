@@ -132,6 +132,624 @@ static bool test_nonexistent_include() {
     return true;
 }
 
+/* Test that runaway recursive includes stop at the depth limit */
+static bool test_include_depth_limit() {
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "shaders/";
+    config.max_include_depth = 64;
+    
+    VglslResult result = vglsl_parse_file_ex("shaders/recursive.glsl", &config);
+    
+    ASSERT_TRUE(!result.success);
+    ASSERT_TRUE(result.error_message != NULL);
+    ASSERT_STR_CONTAINS(result.error_message, "Maximum include depth exceeded");
+    ASSERT_TRUE(result.error_line == 3);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Loader serving a single in-memory "archive entry" */
+static char* test_archive_loader(const char* path, size_t* size, void* user_data) {
+    const char* entry = (const char*)user_data;
+    if (strcmp(path, "pak/lib.glsl") != 0) return NULL;
+    
+    *size = strlen(entry);
+    char* copy = (char*)VGLSL_MALLOC(*size + 1);
+    memcpy(copy, entry, *size + 1);
+    return copy;
+}
+
+/* Test includes served through a custom loader */
+static bool test_custom_loader() {
+    const char* source = 
+        "#include \"lib.glsl\"\n"
+        "void main() { gl_FragColor = LIB_COLOR; }";
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "pak";
+    config.load_file = test_archive_loader;
+    config.load_user_data = (void*)"#define LIB_COLOR vec4(1.0)\nfloat lib_marker;\n";
+    
+    VglslResult result = vglsl_parse_memory_ex(source, "main.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float lib_marker;");
+    ASSERT_STR_CONTAINS(result.output, "gl_FragColor = vec4(1.0);");
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test segmented output matches the contiguous output */
+static bool test_segmented_output() {
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "shaders/";
+    
+    VglslResult flat = vglsl_parse_file_ex("shaders/fragment.vglsl", &config);
+    config.output_segments = true;
+    VglslResult result = vglsl_parse_file_ex("shaders/fragment.vglsl", &config);
+    
+    ASSERT_TRUE(flat.success);
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(result.output == NULL);
+    ASSERT_TRUE(result.segment_count > 0);
+    ASSERT_TRUE(result.output_length == flat.output_length);
+    
+    /* Verbatim lines are coalesced, so there are far fewer segments than lines */
+    int line_count = 0;
+    for (const char* p = flat.output; *p; p++) {
+        if (*p == '\n') line_count++;
+    }
+    ASSERT_TRUE(result.segment_count < line_count);
+    
+    size_t offset = 0;
+    for (int i = 0; i < result.segment_count; i++) {
+        ASSERT_TRUE(offset + result.segments[i].length <= flat.output_length);
+        ASSERT_TRUE(memcmp(flat.output + offset, result.segments[i].data, result.segments[i].length) == 0);
+        offset += result.segments[i].length;
+    }
+    ASSERT_TRUE(offset == flat.output_length);
+    
+    vglsl_free_result(&flat);
+    vglsl_free_result(&result);
+    ASSERT_TRUE(result.segments == NULL);
+    ASSERT_TRUE(result.storage == NULL);
+    return true;
+}
+
+/* Loader over a table of "path", "text" pairs, counting the reads */
+static int test_table_reads = 0;
+
+static char* test_table_loader(const char* path, size_t* size, void* user_data) {
+    const char* const* table = (const char* const*)user_data;
+    for (int i = 0; table[i]; i += 2) {
+        if (strcmp(path, table[i]) != 0) continue;
+        test_table_reads++;
+        *size = strlen(table[i + 1]);
+        char* copy = (char*)VGLSL_MALLOC(*size + 1);
+        memcpy(copy, table[i + 1], *size + 1);
+        return copy;
+    }
+    return NULL;
+}
+
+static const char* const test_once_files[] = {
+    "lib/once.glsl", "#pragma once\nfloat once_marker;\n",
+    "lib/guarded.glsl", "// Guarded header\n#ifndef GUARDED_GLSL\n#define GUARDED_GLSL\nfloat guarded_marker;\n#endif\n",
+    NULL
+};
+
+/* Test #pragma once and include guards skip repeated includes */
+static bool test_include_once() {
+    const char* source = 
+        "#include \"once.glsl\"\n"
+        "#include \"guarded.glsl\"\n"
+        "#include \"once.glsl\"\n"
+        "#include \"guarded.glsl\"\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "lib";
+    config.load_file = test_table_loader;
+    config.load_user_data = (void*)test_once_files;
+    
+    test_table_reads = 0;
+    VglslResult result = vglsl_parse_memory_ex(source, "main.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(strcmp(result.output, "float once_marker;\n\nfloat guarded_marker;\n") == 0);
+    ASSERT_TRUE(test_table_reads == 2);
+    vglsl_free_result(&result);
+    
+    /* A guarded file is read again once its guard is undefined */
+    test_table_reads = 0;
+    result = vglsl_parse_memory_ex("#include \"guarded.glsl\"\n#undef GUARDED_GLSL\n#include \"guarded.glsl\"\n",
+                                   "main.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(test_table_reads == 2);
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test an include a loader found while resolving is not loaded again */
+static bool test_loader_single_read() {
+    static const char* const files[] = {
+        "lib/x.glsl", "float x_marker;\n",
+        NULL
+    };
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "other";
+    config.load_file = test_table_loader;
+    config.load_user_data = (void*)files;
+    
+    test_table_reads = 0;
+    VglslResult result = vglsl_parse_memory_ex("#include \"x.glsl\"\n", "lib/main.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float x_marker;");
+    ASSERT_TRUE(test_table_reads == 1);
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test parses started from a saved prelude snapshot */
+static bool test_prelude_snapshot() {
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "lib";
+    config.load_file = test_table_loader;
+    config.load_user_data = (void*)test_once_files;
+    
+    VglslSnapshot* built = NULL;
+    VglslResult prelude = vglsl_snapshot_create(
+        "#include \"once.glsl\"\n#include \"guarded.glsl\"\n#define SCALE(x) ((x) * 2.0)\n",
+        "prelude.glsl", &config, &built);
+    ASSERT_TRUE(prelude.success && built != NULL);
+    ASSERT_TRUE(vglsl_snapshot_save(built, "prelude_snapshot.bin"));
+    vglsl_free_result(&prelude);
+    vglsl_snapshot_destroy(built);
+    
+    VglslSnapshot* snapshot = vglsl_snapshot_load("prelude_snapshot.bin");
+    remove("prelude_snapshot.bin");
+    ASSERT_TRUE(snapshot != NULL);
+    
+    config.snapshot = snapshot;
+    config.fold_constants = true;
+    test_table_reads = 0;
+    VglslResult result = vglsl_parse_memory_ex(
+        "#include \"guarded.glsl\"\n#include \"once.glsl\"\nfloat s = SCALE(3.0);\n", "main.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(test_table_reads == 0);
+    ASSERT_TRUE(strcmp(result.output, "float once_marker;\n\nfloat guarded_marker;\nfloat s = 6.0;\n") == 0);
+    
+    vglsl_free_result(&result);
+    vglsl_snapshot_destroy(snapshot);
+    ASSERT_TRUE(vglsl_snapshot_load("prelude_snapshot.bin") == NULL);
+    return true;
+}
+
+static void test_write_file(const char* path, const char* text) {
+    FILE* file = fopen(path, "wb");
+    fputs(text, file);
+    fclose(file);
+}
+
+/* Test the shared output cache - hits point into the mapping, a changed
+ * include invalidates the entry */
+static bool test_output_cache() {
+    remove("output_cache.bin");
+    test_write_file("cache_root.glsl", "#include \"cache_lib.glsl\"\nvoid main() { color = LIB_COLOR; }\n");
+    test_write_file("cache_lib.glsl", "#define LIB_COLOR vec4(1.0)\n");
+    
+    VglslCache* cache = vglsl_cache_open("output_cache.bin", 1024 * 1024);
+    VglslCache* other = vglsl_cache_open("output_cache.bin", 1024 * 1024);
+    ASSERT_TRUE(cache != NULL && other != NULL);
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = ".";
+    config.output_segments = true;
+    
+    VglslResult miss = vglsl_parse_file_cached(cache, "cache_root.glsl", &config);
+    VglslResult hit = vglsl_parse_file_cached(other, "cache_root.glsl", &config);
+    ASSERT_TRUE(miss.success && !miss.cache_hit);
+    ASSERT_TRUE(hit.success && hit.cache_hit && hit.segment_count == 1);
+    ASSERT_TRUE(hit.output_hash == miss.output_hash && hit.output_length == miss.output_length);
+    ASSERT_TRUE(strcmp(hit.segments[0].data, "void main() { color = vec4(1.0); }\n") == 0);
+    vglsl_free_result(&miss);
+    vglsl_free_result(&hit);
+    
+    /* Other spellings of the root path share the entry */
+    VglslResult alias = vglsl_parse_file_cached(other, ".//cache_root.glsl", &config);
+    ASSERT_TRUE(alias.success && alias.cache_hit);
+    vglsl_free_result(&alias);
+    
+    /* Contiguous output is copied out of the cache */
+    config.output_segments = false;
+    VglslResult copy = vglsl_parse_file_cached(cache, "cache_root.glsl", &config);
+    config.output_segments = true;
+    ASSERT_TRUE(copy.success && copy.output != NULL);
+    vglsl_free_result(&copy);
+
+    /* Minified parses keep their rename map by skipping the cache */
+    test_write_file("cache_minify.glsl", "float shade(float value) { return value; }\nvoid main() { color = vec4(shade(1.0)); }\n");
+    config.minify = true;
+    for (int i = 0; i < 2; i++) {
+        VglslResult minified = vglsl_parse_file_cached(cache, "cache_minify.glsl", &config);
+        ASSERT_TRUE(minified.success && !minified.cache_hit);
+        ASSERT_TRUE(minified.rename_count > 0);
+        vglsl_free_result(&minified);
+    }
+    config.minify = false;
+    remove("cache_minify.glsl");
+
+    test_write_file("cache_lib.glsl", "#define LIB_COLOR vec4(0.5, 0.5, 0.5, 1.0)\n");
+    VglslResult changed = vglsl_parse_file_cached(cache, "cache_root.glsl", &config);
+    ASSERT_TRUE(changed.success && !changed.cache_hit);
+    vglsl_free_result(&changed);
+    changed = vglsl_parse_file_cached(other, "cache_root.glsl", &config);
+    ASSERT_TRUE(changed.success && changed.cache_hit);
+    ASSERT_TRUE(strcmp(changed.segments[0].data, "void main() { color = vec4(0.5, 0.5, 0.5, 1.0); }\n") == 0);
+    vglsl_free_result(&changed);
+    
+    vglsl_cache_close(cache);
+    vglsl_cache_close(other);
+    remove("output_cache.bin");
+    remove("cache_root.glsl");
+    remove("cache_lib.glsl");
+    return true;
+}
+
+/* Test a cached output misses once a search directory earlier in the
+ * order appears or gains the include */
+static bool test_output_cache_shadowing() {
+    remove("shadow_cache.bin");
+    mkdir("shadow_b", 0755);
+    test_write_file("shadow_b/shadow_inc.glsl", "float from_b;\n");
+    test_write_file("shadow_root.glsl", "#include \"shadow_inc.glsl\"\n");
+    
+    VglslCache* cache = vglsl_cache_open("shadow_cache.bin", 1024 * 1024);
+    ASSERT_TRUE(cache != NULL);
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = ".";
+    const char* search[] = { "shadow_a", "shadow_b" };
+    config.include_paths = search;
+    config.include_path_count = 2;
+    
+    VglslResult result = vglsl_parse_file_cached(cache, "shadow_root.glsl", &config);
+    ASSERT_TRUE(result.success && !result.cache_hit);
+    vglsl_free_result(&result);
+    result = vglsl_parse_file_cached(cache, "shadow_root.glsl", &config);
+    ASSERT_TRUE(result.success && result.cache_hit);
+    vglsl_free_result(&result);
+    
+    /* A directory that was missing when the entry was made */
+    mkdir("shadow_a", 0755);
+    result = vglsl_parse_file_cached(cache, "shadow_root.glsl", &config);
+    ASSERT_TRUE(result.success && !result.cache_hit);
+    ASSERT_STR_CONTAINS(result.output, "float from_b;");
+    vglsl_free_result(&result);
+    
+    test_write_file("shadow_a/shadow_inc.glsl", "float from_a;\n");
+    result = vglsl_parse_file_cached(cache, "shadow_root.glsl", &config);
+    ASSERT_TRUE(result.success && !result.cache_hit);
+    ASSERT_STR_CONTAINS(result.output, "float from_a;");
+    vglsl_free_result(&result);
+    
+    vglsl_cache_close(cache);
+    remove("shadow_cache.bin");
+    remove("shadow_root.glsl");
+    remove("shadow_a/shadow_inc.glsl");
+    remove("shadow_b/shadow_inc.glsl");
+    rmdir("shadow_a");
+    rmdir("shadow_b");
+    return true;
+}
+
+/* Test the cache stays within its capacity, evicting the least recently
+ * used entries while other handles keep working */
+static bool test_output_cache_eviction() {
+    remove("lru_cache.bin");
+    FILE* file = fopen("lru_root.glsl", "wb");
+    for (int i = 0; i < 60; i++) fprintf(file, "const float pad%02d = 0.0; /* padding padding */\n", i);
+    fprintf(file, "float v = VALUE;\n");
+    fclose(file);
+    
+    VglslCache* cache = vglsl_cache_open("lru_cache.bin", 64 * 1024);
+    VglslCache* other = vglsl_cache_open("lru_cache.bin", 64 * 1024);
+    ASSERT_TRUE(cache != NULL && other != NULL);
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = ".";
+    config.output_segments = true;
+    char value[32];
+    const char* defines[] = { value };
+    config.defines = defines;
+    config.define_count = 1;
+    
+    /* Far more outputs than fit, with VALUE=0 used all along */
+    for (int i = 0; i < 60; i++) {
+        for (int j = 0; j < 2; j++) {
+            snprintf(value, sizeof(value), "VALUE=%d", j ? 0 : i);
+            VglslResult result = vglsl_parse_file_cached(cache, "lru_root.glsl", &config);
+            ASSERT_TRUE(result.success);
+            vglsl_free_result(&result);
+        }
+    }
+    
+    snprintf(value, sizeof(value), "VALUE=0");
+    VglslResult hot = vglsl_parse_file_cached(other, "lru_root.glsl", &config);
+    snprintf(value, sizeof(value), "VALUE=59");
+    VglslResult recent = vglsl_parse_file_cached(other, "lru_root.glsl", &config);
+    snprintf(value, sizeof(value), "VALUE=1");
+    VglslResult evicted = vglsl_parse_file_cached(other, "lru_root.glsl", &config);
+    ASSERT_TRUE(hot.success && hot.cache_hit);
+    ASSERT_TRUE(recent.success && recent.cache_hit);
+    ASSERT_TRUE(evicted.success && !evicted.cache_hit);
+    
+    file = fopen("lru_cache.bin", "rb");
+    fseek(file, 0, SEEK_END);
+    ASSERT_TRUE(ftell(file) == 64 * 1024);
+    fclose(file);
+    
+    /* Hits stay readable after their file is compacted away */
+    ASSERT_TRUE(vglsl_cache_compact(cache));
+    VglslResult again = vglsl_parse_file_cached(other, "lru_root.glsl", &config);
+    ASSERT_TRUE(again.success && again.cache_hit);
+    vglsl_free_result(&again);
+    ASSERT_STR_CONTAINS(recent.segments[0].data, "float v = 59;");
+    vglsl_free_result(&hot);
+    vglsl_free_result(&recent);
+    vglsl_free_result(&evicted);
+    
+    vglsl_cache_close(cache);
+    vglsl_cache_close(other);
+    remove("lru_cache.bin");
+    remove("lru_root.glsl");
+    return true;
+}
+
+/* Test the include resolution cache - a miss is remembered until the
+ * cache is cleared, virtual path changes resolve again */
+static bool test_include_cache() {
+    remove("resolve_lib.glsl");
+    VglslIncludeCache* cache = vglsl_include_cache_create();
+    ASSERT_TRUE(cache != NULL);
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = ".";
+    config.include_cache = cache;
+    
+    const char* source = "#include \"resolve_lib.glsl\"\nfloat x = LIB_VALUE;\n";
+    VglslResult result = vglsl_parse_memory_ex(source, "resolve_root.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    ASSERT_STR_CONTAINS(result.error_message, "./resolve_lib.glsl");
+    vglsl_free_result(&result);
+    
+    test_write_file("resolve_lib.glsl", "#define LIB_VALUE 1.0\n");
+    result = vglsl_parse_memory_ex(source, "resolve_root.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    vglsl_free_result(&result);
+    
+    vglsl_include_cache_clear(cache);
+    result = vglsl_parse_memory_ex(source, "resolve_root.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float x = 1.0;");
+    vglsl_free_result(&result);
+    
+    const char* angle = "#include <ResolveLib/resolve_lib.glsl>\nfloat x = LIB_VALUE;\n";
+    vglsl_add_virtual_include_path("ResolveLib", ".");
+    result = vglsl_parse_memory_ex(angle, "resolve_root.glsl", &config);
+    ASSERT_TRUE(result.success);
+    vglsl_free_result(&result);
+    
+    vglsl_add_virtual_include_path("ResolveLib", "./resolve_missing_dir");
+    result = vglsl_parse_memory_ex(angle, "resolve_root.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    vglsl_free_result(&result);
+    
+    vglsl_add_virtual_include_path("ResolveLib", ".");
+    result = vglsl_parse_memory_ex(angle, "resolve_root.glsl", &config);
+    ASSERT_TRUE(result.success);
+    vglsl_free_result(&result);
+    
+    vglsl_remove_virtual_include_path("ResolveLib");
+    
+    /* A resolved include that fails to read once is looked up again */
+    result = vglsl_parse_memory_ex(source, "resolve_root.glsl", &config);
+    ASSERT_TRUE(result.success);
+    vglsl_free_result(&result);
+    remove("resolve_lib.glsl");
+    result = vglsl_parse_memory_ex(source, "resolve_root.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    vglsl_free_result(&result);
+    test_write_file("resolve_lib.glsl", "#define LIB_VALUE 1.0\n");
+    result = vglsl_parse_memory_ex(source, "resolve_root.glsl", &config);
+    ASSERT_TRUE(result.success);
+    vglsl_free_result(&result);
+    
+    vglsl_include_cache_destroy(cache);
+    remove("resolve_lib.glsl");
+    return true;
+}
+
+/* Test nested virtual paths - the longest mounted prefix wins, and there
+ * is no limit on the number of mounts */
+static bool test_virtual_path_trie() {
+    test_write_file("resolve_trie.glsl", "float trie = 1.0;\n");
+    VglslConfig config = vglsl_default_config();
+    
+    vglsl_add_virtual_include_path("TrieEngine", "./trie_missing");
+    vglsl_add_virtual_include_path("TrieEngine/Render/", ".");
+    char name[32];
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "TrieModule%02d", i);
+        vglsl_add_virtual_include_path(name, ".");
+    }
+    
+    VglslResult result = vglsl_parse_memory_ex("#include <TrieEngine/Render/resolve_trie.glsl>\n", "trie.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float trie = 1.0;");
+    vglsl_free_result(&result);
+    
+    result = vglsl_parse_memory_ex("#include <TrieModule39/resolve_trie.glsl>\n", "trie.glsl", &config);
+    ASSERT_TRUE(result.success);
+    vglsl_free_result(&result);
+    
+    result = vglsl_parse_memory_ex("#include <TrieEngine/resolve_trie.glsl>\n", "trie.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    ASSERT_STR_CONTAINS(result.error_message, "./trie_missing/resolve_trie.glsl");
+    vglsl_free_result(&result);
+    
+    /* Unmounting the nested path falls back to its parent */
+    vglsl_remove_virtual_include_path("TrieEngine/Render");
+    result = vglsl_parse_memory_ex("#include <TrieEngine/Render/resolve_trie.glsl>\n", "trie.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    ASSERT_STR_CONTAINS(result.error_message, "./trie_missing/Render/resolve_trie.glsl");
+    vglsl_free_result(&result);
+    
+    vglsl_clear_virtual_include_paths();
+    result = vglsl_parse_memory_ex("#include <TrieModule00/resolve_trie.glsl>\n", "trie.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    vglsl_free_result(&result);
+    remove("resolve_trie.glsl");
+    return true;
+}
+
+/* Test ordered search paths - the first directory holding the file wins,
+ * and a file added later is found once its directory changed */
+static bool test_include_search_paths() {
+    remove("shaders/search_new.glsl");
+    const char* search[] = { "./search_missing_dir", "shaders" };
+    VglslIncludeCache* cache = vglsl_include_cache_create();
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "./search_base_dir";
+    config.include_paths = search;
+    config.include_path_count = 2;
+    config.include_cache = cache;
+    
+    VglslResult result = vglsl_parse_memory_ex("#include \"common.glsl\"\n", "search.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "uniform mat4 u_modelMatrix;");
+    vglsl_free_result(&result);
+    
+    const char* source = "#include \"search_new.glsl\"\n";
+    result = vglsl_parse_memory_ex(source, "search.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    ASSERT_STR_CONTAINS(result.error_message, "./search_base_dir/search_new.glsl");
+    vglsl_free_result(&result);
+    
+    test_write_file("shaders/search_new.glsl", "float added = 1.0;\n");
+    result = vglsl_parse_memory_ex(source, "search.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float added = 1.0;");
+    vglsl_free_result(&result);
+    
+    /* Without a cache the parse lists the directories itself */
+    config.include_cache = NULL;
+    result = vglsl_parse_memory_ex(source, "search.glsl", &config);
+    ASSERT_TRUE(result.success);
+    vglsl_free_result(&result);
+    
+    vglsl_include_cache_destroy(cache);
+    remove("shaders/search_new.glsl");
+    return true;
+}
+
+/* Test quoted includes resolve next to the including file before base_path */
+static bool test_relative_include() {
+    test_write_file("shaders/relative_a.glsl", "#include \"relative_b.glsl\"\n");
+    test_write_file("shaders/relative_b.glsl", "float nested = 1.0;\n");
+    test_write_file("relative_b.glsl", "float base = 1.0;\n");
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = ".";
+    VglslResult result = vglsl_parse_memory_ex("#include \"shaders/relative_a.glsl\"\n#include \"relative_b.glsl\"\n",
+                                               "relative.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float nested = 1.0;");
+    ASSERT_STR_CONTAINS(result.output, "float base = 1.0;");
+    vglsl_free_result(&result);
+    
+    /* Without a sibling it falls back to base_path */
+    remove("shaders/relative_b.glsl");
+    result = vglsl_parse_memory_ex("#include \"shaders/relative_a.glsl\"\n", "relative.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float base = 1.0;");
+    vglsl_free_result(&result);
+    
+    remove("shaders/relative_a.glsl");
+    remove("relative_b.glsl");
+    return true;
+}
+
+/* Test one file reached through several paths counts as one file */
+static bool test_file_identity() {
+    test_write_file("identity_lib.glsl", "#pragma once\nfloat identity = 1.0;\n");
+    vglsl_add_virtual_include_path("IdentityAlias", ".");
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = ".";
+    VglslResult result = vglsl_parse_memory_ex("#include \"identity_lib.glsl\"\n"
+                                               "#include \"./identity_lib.glsl\"\n"
+                                               "#include \"shaders/../identity_lib.glsl\"\n"
+                                               "#include <IdentityAlias/identity_lib.glsl>\n",
+                                               "identity.glsl", &config);
+    ASSERT_TRUE(result.success);
+    const char* first = strstr(result.output, "float identity");
+    ASSERT_TRUE(first != NULL && strstr(first + 1, "float identity") == NULL);
+    vglsl_free_result(&result);
+    
+    vglsl_remove_virtual_include_path("IdentityAlias");
+    remove("identity_lib.glsl");
+    return true;
+}
+
+/* Test includes read ahead on a prefetch pool give the same output, with
+ * the pool kept across parses */
+static bool test_include_prefetch() {
+    test_write_file("shaders/prefetch_a.glsl", "#include \"prefetch_b.glsl\"\nfloat a = 1.0;\n");
+    test_write_file("shaders/prefetch_b.glsl", "#pragma once\nfloat b = 2.0;\n");
+    test_write_file("shaders/prefetch_c.glsl", "#include \"prefetch_b.glsl\"\nfloat c = 3.0;\n");
+    /* Text ahead of the includes gives the workers time to read them */
+    static char source[64 * 1024];
+    size_t length = 0;
+    for (int i = 0; i < 2000; i++) length += sprintf(source + length, "const float pad%d = 0.0;\n", i);
+    sprintf(source + length, "#include \"prefetch_a.glsl\"\n#include \"prefetch_c.glsl\"\n#include \"prefetch_a.glsl\"\n");
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_path = "shaders";
+    VglslResult expected = vglsl_parse_memory_ex(source, "prefetch.glsl", &config);
+    ASSERT_TRUE(expected.success);
+    
+    VglslPrefetchPool* pool = vglsl_prefetch_pool_create(2);
+    ASSERT_TRUE(pool != NULL);
+    config.prefetch = pool;
+    
+    /* The parser reads a file itself when it gets there first */
+    VglslResult result;
+    for (int i = 0; i < 100 && vglsl_prefetch_pool_reads(pool) == 0; i++) {
+        result = vglsl_parse_memory_ex(source, "prefetch.glsl", &config);
+        ASSERT_TRUE(result.success);
+        ASSERT_TRUE(strcmp(result.output, expected.output) == 0);
+        vglsl_free_result(&result);
+    }
+    ASSERT_TRUE(vglsl_prefetch_pool_reads(pool) > 0);
+    vglsl_free_result(&expected);
+    
+    /* A prefetched miss still fails the include */
+    result = vglsl_parse_memory_ex("#include \"prefetch_missing.glsl\"\n", "prefetch.glsl", &config);
+    ASSERT_TRUE(!result.success);
+    ASSERT_STR_CONTAINS(result.error_message, "prefetch_missing.glsl");
+    vglsl_free_result(&result);
+    
+    vglsl_prefetch_pool_destroy(pool);
+    remove("shaders/prefetch_a.glsl");
+    remove("shaders/prefetch_b.glsl");
+    remove("shaders/prefetch_c.glsl");
+    return true;
+}
+
 int main() {
     printf("Running VGLSL file parsing tests...\n\n");
     
@@ -140,6 +758,21 @@ int main() {
     TEST(file_parsing_custom_config);
     TEST(nonexistent_file);
     TEST(nonexistent_include);
+    TEST(include_depth_limit);
+    TEST(custom_loader);
+    TEST(segmented_output);
+    TEST(include_once);
+    TEST(loader_single_read);
+    TEST(prelude_snapshot);
+    TEST(output_cache);
+    TEST(output_cache_shadowing);
+    TEST(output_cache_eviction);
+    TEST(include_cache);
+    TEST(virtual_path_trie);
+    TEST(include_search_paths);
+    TEST(relative_include);
+    TEST(file_identity);
+    TEST(include_prefetch);
     
     printf("\n=== Test Results ===\n");
     printf("Tests run: %d\n", tests_run);
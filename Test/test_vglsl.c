@@ -221,6 +221,31 @@ static bool test_complex_macros() {
     return true;
 }
 
+/* Test a macro is not expanded again inside its own replacement */
+static bool test_self_referential_macros() {
+    const char* source = 
+        "#define X (X + 1)\n"
+        "#define A B\n"
+        "#define B A\n"
+        "#define F(x) (F(x) * 2)\n"
+        "#define INC(x) (x + 1)\n"
+        "int v = X;\n"
+        "int a = A;\n"
+        "int f = F(3);\n"
+        "int n = INC(INC(1));\n";
+    
+    VglslResult result = vglsl_parse_memory(source, "test.glsl");
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "int v = (X + 1);");
+    ASSERT_STR_CONTAINS(result.output, "int a = A;");
+    ASSERT_STR_CONTAINS(result.output, "int f = (F(3) * 2);");
+    ASSERT_STR_CONTAINS(result.output, "int n = ((1 + 1) + 1);");
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
 /* Test error handling - invalid macro */
 static bool test_error_handling() {
     const char* source = 
@@ -289,6 +314,539 @@ static bool test_free_result() {
     return true;
 }
 
+/* Test length-delimited input that is not NUL-terminated */
+static bool test_length_delimited_input() {
+    const char* blob = "float inside = 1.0;\nfloat outside = 2.0;";
+    size_t length = strlen("float inside = 1.0;\n");
+    
+    VglslConfig config = vglsl_default_config();
+    VglslResult result = vglsl_parse_memory_n(blob, length, "blob.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_EQUALS("float inside = 1.0;\n", result.output);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test multi-piece input with a line running across pieces */
+static bool test_multi_piece_input() {
+    const char* pieces[] = {
+        "#define SCALE 2.0\nfloat value",
+        " = SCALE;\nfloat tail = 1.0;ignored",
+        "\n"
+    };
+    int lengths[] = { -1, (int)strlen(" = SCALE;\nfloat tail = 1.0;"), -1 };
+    
+    VglslConfig config = vglsl_default_config();
+    VglslResult result = vglsl_parse_memory_pieces(pieces, lengths, 3, "pieces.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_EQUALS("float value = 2.0;\nfloat tail = 1.0;\n", result.output);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test output hash and change detection */
+static bool test_output_hash() {
+    /* XXH64 reference values */
+    ASSERT_TRUE(vglsl_hash("", 0) == 0xEF46DB3751D8E999ULL);
+    ASSERT_TRUE(vglsl_hash("abc", 3) == 0x44BC2CF5AD770999ULL);
+    
+    const char* source = 
+        "#define COUNT 4\n"
+        "uniform vec4 colors[COUNT];\n"
+        "void main() { gl_FragColor = colors[0] * 0.5 + colors[1] * 0.25 + colors[2]; }";
+    
+    VglslConfig config = vglsl_default_config();
+    VglslResult first = vglsl_parse_memory_ex(source, "test.glsl", &config);
+    ASSERT_TRUE(first.success);
+    ASSERT_TRUE(first.output_hash == vglsl_hash(first.output, first.output_length));
+    ASSERT_TRUE(first.output_changed);
+    
+    /* Same hash when built as segments, and unchanged against the previous run */
+    config.output_segments = true;
+    config.previous_hash = first.output_hash;
+    VglslResult second = vglsl_parse_memory_ex(source, "test.glsl", &config);
+    ASSERT_TRUE(second.success);
+    ASSERT_TRUE(second.output_hash == first.output_hash);
+    ASSERT_TRUE(!second.output_changed);
+    
+    vglsl_free_result(&first);
+    vglsl_free_result(&second);
+    return true;
+}
+
+/* Test predefined macros from the config */
+static bool test_config_defines() {
+    const char* defines[] = { "QUALITY=2", "USE_FOG" };
+    const char* source = 
+        "#ifdef USE_FOG\n"
+        "float fog = 1.0;\n"
+        "#endif\n"
+        "int quality = QUALITY;";
+    
+    VglslConfig config = vglsl_default_config();
+    config.defines = defines;
+    config.define_count = 2;
+    VglslResult result = vglsl_parse_memory_ex(source, "test.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "float fog = 1.0;");
+    ASSERT_STR_CONTAINS(result.output, "int quality = 2;");
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test variants producing identical outputs share one store entry */
+static bool test_variant_dedup() {
+    const char* source = 
+        "#ifdef SHADOWS\n"
+        "uniform sampler2D shadowMap;\n"
+        "#endif\n"
+        "void main() {}";
+    
+    const char* shadows[] = { "SHADOWS" };
+    const char* unused[] = { "UNUSED_FEATURE" };
+    const char* both[] = { "UNUSED_FEATURE", "SHADOWS" };
+    VglslVariant variants[4] = {
+        { NULL, 0 }, { shadows, 1 }, { unused, 1 }, { both, 2 }
+    };
+    int handles[4];
+    
+    VglslStore* store = vglsl_store_create();
+    VglslConfig config = vglsl_default_config();
+    VglslResult result = vglsl_parse_variants(source, "test.glsl", &config, variants, 4, store, handles);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(result.output == NULL);
+    ASSERT_TRUE(vglsl_store_count(store) == 2);
+    ASSERT_TRUE(handles[0] == handles[2]);
+    ASSERT_TRUE(handles[1] == handles[3]);
+    ASSERT_TRUE(handles[0] != handles[1]);
+    
+    size_t length = 0;
+    const char* text = vglsl_store_get(store, handles[1], &length);
+    ASSERT_STR_CONTAINS(text, "uniform sampler2D shadowMap;");
+    ASSERT_TRUE(vglsl_store_hash(store, handles[1]) == vglsl_hash(text, length));
+    
+    /* Results added by hand dedupe against the same entries */
+    VglslResult single = vglsl_parse_memory_ex(source, "test.glsl", &config);
+    ASSERT_TRUE(vglsl_store_add(store, &single) == handles[0]);
+    
+    vglsl_free_result(&single);
+    vglsl_free_result(&result);
+    vglsl_store_destroy(store);
+    return true;
+}
+
+/* Test delta-encoded store round trips and saves space */
+static bool test_delta_store() {
+    /* A long shared body with one small variant-specific region */
+    char source[8192];
+    size_t length = 0;
+    length += sprintf(source + length, "#version 330 core\n");
+    length += sprintf(source + length, "#ifdef RED\nconst vec3 tint = vec3(1.0, 0.0, 0.0);\n#endif\n");
+    length += sprintf(source + length, "#ifdef GREEN\nconst vec3 tint = vec3(0.0, 1.0, 0.0);\n#endif\n");
+    length += sprintf(source + length, "#ifdef BLUE\nconst vec3 tint = vec3(0.0, 0.0, 1.0);\n#endif\n");
+    for (int i = 0; i < 64; i++) {
+        length += sprintf(source + length, "float helper%d(float x) { return x * %d.0 + 0.5; }\n", i, i);
+    }
+    
+    const char* red[] = { "RED" };
+    const char* green[] = { "GREEN" };
+    const char* blue[] = { "BLUE" };
+    VglslVariant variants[3] = { { red, 1 }, { green, 1 }, { blue, 1 } };
+    int plain_handles[3], delta_handles[3];
+    
+    VglslConfig config = vglsl_default_config();
+    VglslStore* plain = vglsl_store_create();
+    VglslStore* delta = vglsl_store_create_ex(VGLSL_STORE_DELTA);
+    VglslResult a = vglsl_parse_variants(source, "uber.glsl", &config, variants, 3, plain, plain_handles);
+    VglslResult b = vglsl_parse_variants(source, "uber.glsl", &config, variants, 3, delta, delta_handles);
+    ASSERT_TRUE(a.success && b.success);
+    ASSERT_TRUE(vglsl_store_count(delta) == 3);
+    
+    /* Only the first output is kept in full */
+    ASSERT_TRUE(vglsl_store_get(delta, delta_handles[0], NULL) != NULL);
+    ASSERT_TRUE(vglsl_store_get(delta, delta_handles[1], NULL) == NULL);
+    ASSERT_TRUE(vglsl_store_bytes(delta) * 2 < vglsl_store_bytes(plain));
+    
+    ASSERT_TRUE(vglsl_store_save(delta, "delta_store.bin"));
+    VglslStore* loaded = vglsl_store_load("delta_store.bin");
+    remove("delta_store.bin");
+    ASSERT_TRUE(loaded != NULL);
+    
+    static char decoded[8192];
+    static char reloaded[8192];
+    for (int i = 0; i < 3; i++) {
+        size_t expected_length = 0;
+        const char* expected = vglsl_store_get(plain, plain_handles[i], &expected_length);
+        ASSERT_TRUE(vglsl_store_decode(delta, delta_handles[i], decoded, sizeof(decoded)) == expected_length);
+        ASSERT_STR_EQUALS(expected, decoded);
+        ASSERT_TRUE(vglsl_store_decode(loaded, delta_handles[i], reloaded, sizeof(reloaded)) == expected_length);
+        ASSERT_STR_EQUALS(expected, reloaded);
+    }
+    
+    /* Sizes past the end of a corrupt file are rejected */
+    FILE* corrupt = fopen("corrupt_store.bin", "wb");
+    ASSERT_TRUE(corrupt != NULL);
+    fwrite("VGLSLST1", 1, 8, corrupt);
+    const unsigned char header[40] = { 0, 0, 0, 0, 0, 0, 0, 0,  1, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0, 0, 0,
+                                       0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                       0, 0, 0, 0, 0, 0, 0, 0 };
+    const unsigned char payload_size[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    fwrite(header, 1, sizeof(header), corrupt);
+    fwrite(payload_size, 1, sizeof(payload_size), corrupt);
+    fwrite("text", 1, 4, corrupt);
+    fclose(corrupt);
+    ASSERT_TRUE(vglsl_store_load("corrupt_store.bin") == NULL);
+    remove("corrupt_store.bin");
+    
+    vglsl_free_result(&a);
+    vglsl_free_result(&b);
+    vglsl_store_destroy(plain);
+    vglsl_store_destroy(delta);
+    vglsl_store_destroy(loaded);
+    return true;
+}
+
+/* Test canonical output is identical for cosmetically different sources */
+static bool test_canonical_output() {
+    const char* tidy = 
+        "#version 330 core\n"
+        "uniform vec4 color;\n"
+        "void main() {\n"
+        "    gl_FragColor = color * 0.5;\n"
+        "}\n";
+    const char* messy = 
+        "#version   330\tcore\r\n"
+        "\r\n"
+        "#line 20\r\n"
+        "uniform  vec4\tcolor;   \r\n"
+        "\n"
+        "void main()   {\r\n"
+        "\t\tgl_FragColor  =  color *\t0.5;\n"
+        "}";
+    
+    VglslConfig config = vglsl_default_config();
+    config.canonicalize_output = true;
+    VglslResult a = vglsl_parse_memory_ex(tidy, "a.glsl", &config);
+    VglslResult b = vglsl_parse_memory_ex(messy, "b.glsl", &config);
+    
+    ASSERT_TRUE(a.success && b.success);
+    ASSERT_STR_EQUALS(a.output, b.output);
+    ASSERT_STR_EQUALS("#version 330 core\nuniform vec4 color;\nvoid main() {\ngl_FragColor = color * 0.5;\n}\n", b.output);
+    ASSERT_TRUE(a.output_hash == b.output_hash);
+    vglsl_free_result(&a);
+    vglsl_free_result(&b);
+    
+    /* Only #line itself is dropped, not directives it is a prefix of */
+    a = vglsl_parse_memory_ex("#line\t7\n#lineX 1\n#lines_foo\n", "c.glsl", &config);
+    ASSERT_TRUE(a.success);
+    ASSERT_STR_EQUALS("#lineX 1\n#lines_foo\n", a.output);
+    vglsl_free_result(&a);
+    return true;
+}
+
+/* Test minified output and the rename map */
+static bool test_minify() {
+    const char* source = 
+        "#version 330 core\n"
+        "uniform vec4 color;\n"
+        "float brighten(float value, float amount) {\n"
+        "    float result = value + amount;\n"
+        "    return result;\n"
+        "}\n"
+        "void main() {\n"
+        "    float level = brighten(color.r, 0.5);\n"
+        "    gl_FragColor = vec4(level) - -color;\n"
+        "}\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.minify = true;
+    VglslResult result = vglsl_parse_memory_ex(source, "minify.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_EQUALS("#version 330 core\n"
+                      "uniform vec4 color;float a(float b,float c){float d=b+c;return d;}"
+                      "void main(){float b=a(color.r,0.5);gl_FragColor=vec4(b)- -color;}\n", result.output);
+    ASSERT_TRUE(result.rename_count == 5);
+    ASSERT_STR_EQUALS("brighten", result.renames[0].original);
+    ASSERT_STR_EQUALS("a", result.renames[0].renamed);
+    ASSERT_TRUE(result.renames[0].scope == NULL);
+    ASSERT_STR_EQUALS("level", result.renames[4].original);
+    ASSERT_STR_EQUALS("main", result.renames[4].scope);
+    vglsl_free_result(&result);
+    
+    /* Members named like a function stay in step with their .member uses */
+    result = vglsl_parse_memory_ex("struct Light { float intensity; };\n"
+                                   "uniform Block { float intensity; } block;\n"
+                                   "float intensity(Light l) { return l.intensity + block.intensity; }\n",
+                                   "members.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_EQUALS("struct Light{float intensity;};uniform Block{float intensity;}block;"
+                      "float a(Light b){return b.intensity+block.intensity;}\n", result.output);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test unreferenced functions and consts are stripped */
+static bool test_strip_unused() {
+    const char* source = 
+        "#version 330 core\n"
+        "const float SCALE = 2.0;\n"
+        "const float UNUSED = 1.0;\n"
+        "uniform vec4 color;\n"
+        "float helper(float x) { return x * SCALE; }\n"
+        "float dead(float y) { return y + UNUSED; }\n"
+        "float chain(float z) { return helper(z); }\n"
+        "void main() {\n"
+        "    gl_FragColor = color * chain(1.0);\n"
+        "}\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.strip_unused = true;
+    VglslResult result = vglsl_parse_memory_ex(source, "strip.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "const float SCALE = 2.0;");
+    ASSERT_STR_CONTAINS(result.output, "float helper(float x)");
+    ASSERT_STR_CONTAINS(result.output, "float chain(float z)");
+    ASSERT_STR_CONTAINS(result.output, "uniform vec4 color;");
+    ASSERT_TRUE(strstr(result.output, "dead") == NULL);
+    ASSERT_TRUE(strstr(result.output, "UNUSED") == NULL);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test literal arithmetic from macro composition is folded */
+static bool test_constant_folding() {
+    const char* source = 
+        "#define TAU (3.14159265359 * 2.0)\n"
+        "#define SIZE (8 * 4 + 1)\n"
+        "const float full = TAU;\n"
+        "const int count = SIZE;\n"
+        "const uint mask = 0xFFFFFFFFu + 2u;\n"
+        "float scaled = speed * (1.0 + 0.5);\n"
+        "float mixed = 1.0 + 2;\n"
+        "int undefined = 5 % -2;\n"
+        "float spaced() { return (1.0 + 2.0); }\n"
+        "float tight() { return(1+2); }\n"
+        "float scale() { return(1+2)*x; }\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.fold_constants = true;
+    VglslResult result = vglsl_parse_memory_ex(source, "fold.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_CONTAINS(result.output, "const float full = 6.2831855;");
+    ASSERT_STR_CONTAINS(result.output, "const int count = 33;");
+    ASSERT_STR_CONTAINS(result.output, "const uint mask = 1u;");
+    ASSERT_STR_CONTAINS(result.output, "float scaled = speed * 1.5;");
+    ASSERT_STR_CONTAINS(result.output, "float mixed = 1.0 + 2;");
+    ASSERT_STR_CONTAINS(result.output, "int undefined = 5 % -2;");
+    ASSERT_STR_CONTAINS(result.output, "float spaced() { return 3.0; }");
+    ASSERT_STR_CONTAINS(result.output, "float tight() { return 3; }");
+    ASSERT_STR_CONTAINS(result.output, "float scale() { return(3)*x; }");
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test #pragma stage splits one source into per-stage outputs */
+static bool test_stage_split() {
+    const char* source = 
+        "#version 330 core\n"
+        "#define SCALE 2.0\n"
+        "uniform mat4 mvp;\n"
+        "#pragma stage vertex\n"
+        "in vec3 pos;\n"
+        "void main() { gl_Position = mvp * vec4(pos * SCALE, 1.0); }\n"
+        "#pragma stage fragment\n"
+        "out vec4 color;\n"
+        "void main() { color = vec4(SCALE); }\n";
+    
+    VglslResult result = vglsl_parse_memory(source, "stages.vglsl");
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(result.stage_count == 2);
+    ASSERT_STR_EQUALS("vertex", result.stages[0].name);
+    ASSERT_STR_EQUALS("#version 330 core\nuniform mat4 mvp;\nin vec3 pos;\n"
+                      "void main() { gl_Position = mvp * vec4(pos * 2.0, 1.0); }\n", result.stages[0].output);
+    ASSERT_STR_EQUALS("fragment", result.stages[1].name);
+    ASSERT_STR_EQUALS("#version 330 core\nuniform mat4 mvp;\nout vec4 color;\n"
+                      "void main() { color = vec4(2.0); }\n", result.stages[1].output);
+    ASSERT_TRUE(result.stages[1].output_hash == vglsl_hash(result.stages[1].output, result.stages[1].output_length));
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test each minified stage lists the renames made in its own output */
+static bool test_stage_minify() {
+    const char* source = 
+        "#pragma stage vertex\n"
+        "float vertOnly() { return 1.0; }\n"
+        "void main() { gl_Position = vec4(vertOnly()); }\n"
+        "#pragma stage fragment\n"
+        "float fragOnly() { return 2.0; }\n"
+        "void main() { color = vec4(fragOnly()); }\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.minify = true;
+    VglslResult result = vglsl_parse_memory_ex(source, "stages.vglsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(result.stage_count == 2);
+    for (int s = 0; s < result.stage_count; s++) {
+        const char* original = s == 0 ? "vertOnly" : "fragOnly";
+        const VglslStage* stage = &result.stages[s];
+        ASSERT_TRUE(stage->rename_count == 1);
+        ASSERT_STR_EQUALS(original, stage->renames[0].original);
+        
+        char call[64];
+        snprintf(call, sizeof(call), "vec4(%s())", stage->renames[0].renamed);
+        ASSERT_STR_CONTAINS(stage->output, call);
+    }
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test interface declarations are reflected into the result */
+static bool test_reflection() {
+    const char* source = 
+        "#version 450\n"
+        "#define LIGHT_COUNT 8\n"
+        "layout(set = 0, binding = 1) uniform sampler2D albedo;\n"
+        "layout(std140, binding = 2) uniform Camera { mat4 view; } camera;\n"
+        "uniform float weights[LIGHT_COUNT], bias;\n"
+        "layout(location = 1) in vec2 uv;\n"
+        "out vec2 v_uv;\n"
+        "void main() { float local = 1.0; v_uv = uv * local; }\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.reflect = true;
+    VglslResult result = vglsl_parse_memory_ex(source, "reflect.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(result.variable_count == 6);
+    ASSERT_STR_EQUALS("albedo", result.variables[0].name);
+    ASSERT_TRUE(result.variables[0].opaque && result.variables[0].binding == 1 && result.variables[0].set == 0);
+    ASSERT_STR_EQUALS("Camera", result.variables[1].type);
+    ASSERT_TRUE(result.variables[1].block && result.variables[1].binding == 2);
+    ASSERT_STR_EQUALS("weights", result.variables[2].name);
+    ASSERT_TRUE(result.variables[2].array_size == 8);
+    ASSERT_STR_EQUALS("bias", result.variables[3].name);
+    ASSERT_TRUE(result.variables[4].kind == VGLSL_VARIABLE_IN && result.variables[4].location == 1);
+    ASSERT_TRUE(result.variables[5].kind == VGLSL_VARIABLE_OUT && result.variables[5].location == -1);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test the final define table is exported */
+static bool test_export_defines() {
+    const char* source = 
+        "#define MAX_LIGHTS 8\n"
+        "#define SCALE(x, y) ((x) * (y))\n"
+        "#define TEMP 1\n"
+        "#undef TEMP\n"
+        "float lights[MAX_LIGHTS];\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.export_defines = true;
+    VglslResult result = vglsl_parse_memory_ex(source, "defines.glsl", &config);
+    
+    ASSERT_TRUE(result.success);
+    ASSERT_TRUE(result.macro_count == 2);
+    
+    const VglslMacro* lights = vglsl_find_macro(&result, "MAX_LIGHTS");
+    ASSERT_TRUE(lights != NULL && !lights->is_function);
+    ASSERT_STR_EQUALS("8", lights->value);
+    
+    const VglslMacro* scale = vglsl_find_macro(&result, "SCALE");
+    ASSERT_TRUE(scale != NULL && scale->is_function && scale->param_count == 2);
+    ASSERT_STR_EQUALS("y", scale->params[1]);
+    ASSERT_STR_EQUALS("((x) * (y))", scale->value);
+    ASSERT_TRUE(vglsl_find_macro(&result, "TEMP") == NULL);
+    
+    vglsl_free_result(&result);
+    return true;
+}
+
+/* Test a frozen base define set shared by several parses */
+static bool test_base_define_set() {
+    const char* engine[] = { "MAX_LIGHTS=8", "USE_FOG", "PLATFORM=1" };
+    VglslDefineSet* base = vglsl_define_set_create(engine, 3);
+    ASSERT_TRUE(base != NULL);
+    
+    const char* overriding = 
+        "#undef USE_FOG\n"
+        "#define MAX_LIGHTS 4\n"
+        "#ifdef USE_FOG\n"
+        "float fog;\n"
+        "#endif\n"
+        "float lights[MAX_LIGHTS];\n";
+    const char* plain = 
+        "#ifdef USE_FOG\n"
+        "float fog;\n"
+        "#endif\n"
+        "float lights[MAX_LIGHTS];\n";
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_defines = base;
+    config.export_defines = true;
+    VglslResult a = vglsl_parse_memory_ex(overriding, "a.glsl", &config);
+    VglslResult b = vglsl_parse_memory_ex(plain, "b.glsl", &config);
+    
+    ASSERT_TRUE(a.success && b.success);
+    ASSERT_STR_EQUALS("float lights[4];\n", a.output);
+    ASSERT_STR_EQUALS("float fog;\nfloat lights[8];\n", b.output);
+    ASSERT_TRUE(a.macro_count == 2 && vglsl_find_macro(&a, "USE_FOG") == NULL);
+    ASSERT_STR_EQUALS("4", vglsl_find_macro(&a, "MAX_LIGHTS")->value);
+    ASSERT_TRUE(b.macro_count == 3 && vglsl_find_macro(&b, "PLATFORM") != NULL);
+    
+    vglsl_free_result(&a);
+    vglsl_free_result(&b);
+    vglsl_define_set_destroy(base);
+    return true;
+}
+
+static bool test_define_set_fork() {
+    /* More defines than a flat table would hold, to exercise deep tries */
+    static char names[600][16];
+    const char* engine[600];
+    for (int i = 0; i < 600; i++) {
+        snprintf(names[i], sizeof(names[i]), "DEF_%d=%d", i, i);
+        engine[i] = names[i];
+    }
+    VglslDefineSet* base = vglsl_define_set_create(engine, 600);
+    const char* high[] = { "QUALITY=2", "DEF_7=70" };
+    VglslDefineSet* quality = vglsl_define_set_fork(base, high, 2);
+    ASSERT_TRUE(base != NULL && quality != NULL);
+    ASSERT_TRUE(vglsl_define_set_count(base) == 600 && vglsl_define_set_count(quality) == 601);
+    
+    /* The fork keeps its shared nodes alive after the base is gone */
+    vglsl_define_set_destroy(base);
+    
+    VglslConfig config = vglsl_default_config();
+    config.base_defines = quality;
+    VglslResult result = vglsl_parse_memory_ex("int a = DEF_7 + DEF_599 + QUALITY;\n", "fork.glsl", &config);
+    ASSERT_TRUE(result.success);
+    ASSERT_STR_EQUALS("int a = 70 + 599 + 2;\n", result.output);
+    
+    vglsl_free_result(&result);
+    vglsl_define_set_destroy(quality);
+    return true;
+}
+
 int main() {
     printf("Running VGLSL tests...\n\n");
     
@@ -302,10 +860,27 @@ int main() {
     TEST(comment_removal);
     TEST(nested_conditionals);
     TEST(complex_macros);
+    TEST(self_referential_macros);
     TEST(error_handling);
     TEST(default_config);
     TEST(custom_config);
     TEST(free_result);
+    TEST(length_delimited_input);
+    TEST(multi_piece_input);
+    TEST(output_hash);
+    TEST(config_defines);
+    TEST(variant_dedup);
+    TEST(delta_store);
+    TEST(canonical_output);
+    TEST(minify);
+    TEST(strip_unused);
+    TEST(constant_folding);
+    TEST(stage_split);
+    TEST(stage_minify);
+    TEST(reflection);
+    TEST(export_defines);
+    TEST(base_define_set);
+    TEST(define_set_fork);
     
     printf("\n=== Test Results ===\n");
     printf("Tests run: %d\n", tests_run);
@@ -37,25 +37,144 @@ extern "C" {
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
+#include <errno.h>
 
 /* ========================================================================= */
 /* API                                                                       */
 /* ========================================================================= */
 
+/* Output segment - a slice of preprocessed text, not NUL-terminated.
+ * Same layout as POSIX struct iovec, so an array can go straight to writev. */
+typedef struct {
+    const char* data;
+    size_t length;
+} VglslSegment;
+
+/* Minifier rename - one identifier shortened by config.minify */
+typedef struct {
+    char* original;
+    char* renamed;
+    char* scope;             /* Enclosing function for locals, NULL for functions */
+} VglslRename;
+
+typedef enum {
+    VGLSL_VARIABLE_UNIFORM,
+    VGLSL_VARIABLE_IN,       /* Also attribute */
+    VGLSL_VARIABLE_OUT,      /* Also varying */
+    VGLSL_VARIABLE_BUFFER
+} VglslVariableKind;
+
+/* Interface declaration found by config.reflect */
+typedef struct {
+    char* name;              /* Variable, or block instance (block name if none) */
+    char* type;              /* GLSL type, or block name */
+    VglslVariableKind kind;
+    bool block;              /* Interface block - members are not listed */
+    bool opaque;             /* Sampler, image or atomic counter */
+    int array_size;          /* 0 if not an array, -1 if unsized or not a literal */
+    int location;            /* layout qualifiers, -1 if absent */
+    int binding;
+    int set;
+} VglslVariable;
+
+/* Macro from the final define table (config.export_defines) */
+typedef struct {
+    char* name;
+    char* value;             /* Replacement text, "" if none */
+    char** params;           /* Parameter names of a function-like macro */
+    int param_count;
+    bool is_function;        /* NAME(...) macro, possibly without parameters */
+} VglslMacro;
+
+/* Stage output - the shared text plus one stage's #pragma stage sections */
+typedef struct {
+    char* name;              /* "vertex", "fragment", "compute", ... */
+    char* output;
+    size_t output_length;
+    uint64_t output_hash;
+    VglslVariable* variables; /* Interface of this stage, with config.reflect */
+    int variable_count;
+    VglslRename* renames;    /* Names shortened in this stage, with config.minify */
+    int rename_count;
+} VglslStage;
+
 typedef struct {
     bool success;
     char* output;
     char* error_message;
     int error_line;
     char* error_file;
+    
+    size_t output_length;    /* Output bytes, contiguous or across segments */
+    VglslSegment* segments;  /* Set instead of output with config.output_segments */
+    int segment_count;
+    void* storage;           /* Internal: buffers backing the segments */
+    
+    uint64_t output_hash;    /* vglsl_hash of the output bytes */
+    bool output_changed;     /* output_hash differs from config.previous_hash */
+    
+    VglslRename* renames;    /* Identifiers shortened by config.minify */
+    int rename_count;
+    
+    VglslStage* stages;      /* One per stage named by #pragma stage, in order of appearance */
+    int stage_count;
+    
+    VglslVariable* variables; /* Interface declarations of output, with config.reflect */
+    int variable_count;
+    
+    VglslMacro* macros;      /* Defines in effect at the end, with config.export_defines */
+    int macro_count;
+    
+    bool cache_hit;          /* Output came from the cache (vglsl_parse_file_cached) */
 } VglslResult;
 
+/* Frozen define set - a read-only base layer shared by any number of
+ * parses (config.base_defines), also from several threads at once. Local
+ * #define and #undef go to a per-parse overlay and never touch the set. */
+typedef struct VglslDefineSet VglslDefineSet;
+
+/* Preprocessed prelude - the state at the end of a parse of the common
+ * headers (defines, #pragma once and include-guarded files, output text),
+ * saved once per build and loaded by later processes (config.snapshot) */
+typedef struct VglslSnapshot VglslSnapshot;
+
+/* Include resolution cache - where each #include resolved to, including
+ * the ones that were not found, kept across parses (config.include_cache) */
+typedef struct VglslIncludeCache VglslIncludeCache;
+
+/* I/O threads reading includes ahead of the parser, kept across parses
+ * (config.prefetch) */
+typedef struct VglslPrefetchPool VglslPrefetchPool;
+
 typedef struct {
     const char* base_path;  /* Base path for #include resolution */
+    const char* const* include_paths; /* Searched in order when base_path has no such file */
+    int include_path_count;
     bool preserve_lines;    /* Keep #line directives for debugging */
     bool remove_comments;   /* Remove // and /* */
     int max_include_depth;  /* Maximum recursive include depth */
     int max_output_size;    /* Maximum output buffer size */
+    bool output_segments;   /* Return output as segments into source buffers */
+    bool canonicalize_output; /* Collapse whitespace, drop blank lines and stray #line */
+    uint64_t previous_hash; /* output_hash of an earlier parse, 0 if none */
+    bool minify;            /* Strip whitespace and shorten local and function names */
+    bool strip_unused;      /* Drop functions and const globals main never reaches */
+    bool fold_constants;    /* Evaluate literal-only arithmetic */
+    bool reflect;           /* List uniforms, inputs, outputs and buffers */
+    bool export_defines;    /* Return the final define table in the result */
+    
+    const char* const* defines; /* Predefined macros, "NAME" or "NAME=VALUE" */
+    int define_count;
+    const VglslDefineSet* base_defines; /* Shared frozen defines, below config.defines */
+    const VglslSnapshot* snapshot; /* Start after a prelude; replaces base_defines */
+    VglslIncludeCache* include_cache; /* Resolve repeated includes without the filesystem */
+    VglslPrefetchPool* prefetch; /* Read includes ahead of the parser on these threads */
+    
+    /* Optional file loader (archives, asset packs). Returns a VGLSL_MALLOC'd
+     * buffer and its size, or NULL to fall back to reading from disk. */
+    char* (*load_file)(const char* path, size_t* size, void* user_data);
+    void* load_user_data;
 } VglslConfig;
 
 /* Parse GLSL from file with preprocessing */
@@ -66,9 +185,141 @@ VglslResult vglsl_parse_file_ex(const char* filename, const VglslConfig* config)
 VglslResult vglsl_parse_memory(const char* source, const char* filename);
 VglslResult vglsl_parse_memory_ex(const char* source, const char* filename, const VglslConfig* config);
 
+/* Parse GLSL from a length-delimited buffer (no NUL terminator needed) */
+VglslResult vglsl_parse_memory_n(const char* source, size_t length, const char* filename, const VglslConfig* config);
+
+/* Parse GLSL from several pieces read back to back as one source, like
+ * glShaderSource. A NULL lengths array or a negative length marks a
+ * NUL-terminated piece. */
+VglslResult vglsl_parse_memory_pieces(const char* const* strings, const int* lengths, int count,
+                                      const char* filename, const VglslConfig* config);
+
 /* Free result memory */
 void vglsl_free_result(VglslResult* result);
 
+/* Look up a macro exported with config.export_defines, NULL if not defined */
+const VglslMacro* vglsl_find_macro(const VglslResult* result, const char* name);
+
+/* Freeze "NAME" / "NAME=VALUE" entries; later entries replace earlier ones */
+VglslDefineSet* vglsl_define_set_create(const char* const* defines, int count);
+
+/* Freeze the define table exported by a parse (config.export_defines) */
+VglslDefineSet* vglsl_define_set_from_result(const VglslResult* result);
+
+/* New set with entries added on top of base. Only the changed paths are
+ * copied, so a tree of layered sets (base, quality, platform, ...) costs
+ * little more than its changes. Destroy sets in any order. */
+VglslDefineSet* vglsl_define_set_fork(const VglslDefineSet* base, const char* const* defines, int count);
+
+/* Number of defines in a set */
+int vglsl_define_set_count(const VglslDefineSet* set);
+
+/* Sets share nodes: create, fork and destroy must not run concurrently with
+ * each other, while any number of parses may read a set at once */
+void vglsl_define_set_destroy(VglslDefineSet* set);
+
+/* Variant - extra defines applied on top of the config for one parse */
+typedef struct {
+    const char* const* defines; /* "NAME" or "NAME=VALUE" */
+    int define_count;
+} VglslVariant;
+
+/* Output store - deduplicates outputs by content. Identical outputs share
+ * one canonical buffer and one handle; handles stay valid until destroy. */
+typedef struct VglslStore VglslStore;
+
+/* Store flags */
+#define VGLSL_STORE_DELTA 1 /* Keep outputs after the first as edit scripts against
+                               the first (base) output or the previous one */
+
+VglslStore* vglsl_store_create(void);
+VglslStore* vglsl_store_create_ex(int flags);
+void vglsl_store_destroy(VglslStore* store);
+int vglsl_store_add(VglslStore* store, const VglslResult* result);  /* Handle, or -1 */
+uint64_t vglsl_store_hash(const VglslStore* store, int handle);
+int vglsl_store_count(const VglslStore* store);                       /* Unique outputs */
+size_t vglsl_store_bytes(const VglslStore* store);                    /* Bytes of text/scripts held */
+
+/* Canonical buffer of a handle; NULL for delta-encoded entries */
+const char* vglsl_store_get(const VglslStore* store, int handle, size_t* length);
+
+/* Output of any entry. Writes it NUL-terminated to buffer when capacity
+ * exceeds its length; returns the length either way (0 on a bad handle). */
+size_t vglsl_store_decode(const VglslStore* store, int handle, char* buffer, size_t capacity);
+
+/* Store serialization (bake output) */
+bool vglsl_store_save(const VglslStore* store, const char* path);
+VglslStore* vglsl_store_load(const char* path);
+
+/* Parse one source once per variant into a store. handles[i] receives the
+ * output handle of variant i, or -1 if it was not processed. Stops at the
+ * first failing variant and returns its error; output is never set. */
+VglslResult vglsl_parse_variants(const char* source, const char* filename, const VglslConfig* config,
+                                 const VglslVariant* variants, int variant_count,
+                                 VglslStore* store, int* handles);
+VglslResult vglsl_parse_file_variants(const char* filename, const VglslConfig* config,
+                                      const VglslVariant* variants, int variant_count,
+                                      VglslStore* store, int* handles);
+
+/* Preprocess a prelude (usually just #includes of the common headers) and
+ * capture its end state in *snapshot. The returned result holds the prelude
+ * output or the error. Token passes and segments are not applied to the
+ * prelude; they run on each parse that starts from the snapshot. */
+VglslResult vglsl_snapshot_create(const char* source, const char* filename, const VglslConfig* config,
+                                  VglslSnapshot** snapshot);
+
+/* Snapshot files - load maps the file and reads the prelude and include
+ * tables in place; only the define table is rebuilt */
+bool vglsl_snapshot_save(const VglslSnapshot* snapshot, const char* path);
+VglslSnapshot* vglsl_snapshot_load(const char* path);
+void vglsl_snapshot_destroy(VglslSnapshot* snapshot);
+
+/* Output cache shared by processes through a mapped file of fixed capacity.
+ * Entries are keyed by root path and config and checked against the size
+ * and modification time of every file the parse read and every directory
+ * it searched for an include, so a file appearing earlier in the search
+ * order misses. A hit returns a segment pointing into the mapping with
+ * config.output_segments (valid until the result is freed), otherwise a
+ * copy. Stage outputs, reflection, minified output (the rename map) and
+ * exported defines are not cached; such parses and custom loaders go
+ * straight to the parser. Needs mmap - elsewhere open returns NULL.
+ * capacity caps the file: when it fills up, the least recently used
+ * entries are evicted until it is half full. Use a handle from one thread
+ * at a time; results can be freed anywhere. */
+typedef struct VglslCache VglslCache;
+
+VglslCache* vglsl_cache_open(const char* path, size_t capacity);
+void vglsl_cache_close(VglslCache* cache);
+VglslResult vglsl_parse_file_cached(VglslCache* cache, const char* filename, const VglslConfig* config);
+
+/* Evict now - drop stale entries and keep the most recently used ones up
+ * to half the capacity. Other processes keep reading meanwhile. False if
+ * another process is already compacting. */
+bool vglsl_cache_compact(VglslCache* cache);
+
+/* Entries are keyed by including file, include spelling, search paths and
+ * loader, and re-resolved after the virtual include paths change. Files
+ * created or deleted later are not noticed: clear the cache when the shader
+ * tree changes. The cache also keeps the directory listings used to search
+ * config.include_paths, refreshed when a directory's mtime changes. Use a
+ * cache from one parse at a time. */
+VglslIncludeCache* vglsl_include_cache_create(void);
+void vglsl_include_cache_clear(VglslIncludeCache* cache);
+void vglsl_include_cache_destroy(VglslIncludeCache* cache);
+
+/* Start threads (up to VGLSL_MAX_PREFETCH_THREADS) that read the files a
+ * parse is about to include. A pool can serve parses on several threads at
+ * once; destroy it only after they are done. NULL without thread support
+ * (VGLSL_NO_THREADS) or when no thread could be started. */
+VglslPrefetchPool* vglsl_prefetch_pool_create(int threads);
+void vglsl_prefetch_pool_destroy(VglslPrefetchPool* pool);
+
+/* Files the pool's threads have read so far */
+uint64_t vglsl_prefetch_pool_reads(VglslPrefetchPool* pool);
+
+/* 64-bit content hash (XXH64, seed 0), the same one used for output_hash */
+uint64_t vglsl_hash(const void* data, size_t length);
+
 /* Get default configuration */
 VglslConfig vglsl_default_config(void);
 
@@ -91,16 +342,16 @@ void vglsl_clear_virtual_include_paths(void);
 #define VGLSL_MAX_INCLUDE_DEPTH 32
 #endif
 
-#ifndef VGLSL_MAX_DEFINES
-#define VGLSL_MAX_DEFINES 256
+#ifndef VGLSL_MAX_MACRO_PARAMS
+#define VGLSL_MAX_MACRO_PARAMS 32
 #endif
 
-#ifndef VGLSL_MAX_OUTPUT_SIZE
-#define VGLSL_MAX_OUTPUT_SIZE (1024 * 1024) /* 1MB default */
+#ifndef VGLSL_MAX_MACRO_DEPTH
+#define VGLSL_MAX_MACRO_DEPTH 16 /* Nested expansions */
 #endif
 
-#ifndef VGLSL_MAX_VIRTUAL_PATHS
-#define VGLSL_MAX_VIRTUAL_PATHS 32
+#ifndef VGLSL_MAX_OUTPUT_SIZE
+#define VGLSL_MAX_OUTPUT_SIZE (1024 * 1024) /* 1MB default */
 #endif
 
 #ifndef VGLSL_MALLOC
@@ -115,15 +366,73 @@ void vglsl_clear_virtual_include_paths(void);
 #define VGLSL_REALLOC realloc
 #endif
 
-/* Virtual include path structure */
-typedef struct VglslVirtualPath {
-    char* virtual_name;   /* e.g., "Vantor" */
-    char* real_path;      /* e.g., "/path/to/vantor/shaders" */
-} VglslVirtualPath;
+/* Snapshot files are mapped instead of read where mmap is available, and
+ * include directories are listed instead of probed file by file */
+#if !defined(VGLSL_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define VGLSL_HAS_MMAP 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+/* Includes are prefetched on a few I/O threads where threads are available */
+#if !defined(VGLSL_NO_THREADS) && defined(_WIN32)
+#define VGLSL_HAS_THREADS 1
+#include <windows.h>
+typedef CRITICAL_SECTION vglsl_mutex;
+typedef CONDITION_VARIABLE vglsl_cond;
+typedef HANDLE vglsl_thread;
+#define VGLSL_THREAD_RESULT DWORD WINAPI
+#define vglsl_mutex_init(m) (InitializeCriticalSection(m), true)
+#define vglsl_mutex_destroy(m) DeleteCriticalSection(m)
+#define vglsl_mutex_lock(m) EnterCriticalSection(m)
+#define vglsl_mutex_unlock(m) LeaveCriticalSection(m)
+#define vglsl_cond_init(c) (InitializeConditionVariable(c), true)
+#define vglsl_cond_destroy(c) ((void)(c))
+#define vglsl_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define vglsl_cond_broadcast(c) WakeAllConditionVariable(c)
+#define vglsl_thread_start(t, fn, arg) ((*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL)) != NULL)
+#define vglsl_thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#elif !defined(VGLSL_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#define VGLSL_HAS_THREADS 1
+#include <pthread.h>
+typedef pthread_mutex_t vglsl_mutex;
+typedef pthread_cond_t vglsl_cond;
+typedef pthread_t vglsl_thread;
+#define VGLSL_THREAD_RESULT void*
+#define vglsl_mutex_init(m) (pthread_mutex_init(m, NULL) == 0)
+#define vglsl_mutex_destroy(m) pthread_mutex_destroy(m)
+#define vglsl_mutex_lock(m) pthread_mutex_lock(m)
+#define vglsl_mutex_unlock(m) pthread_mutex_unlock(m)
+#define vglsl_cond_init(c) (pthread_cond_init(c, NULL) == 0)
+#define vglsl_cond_destroy(c) pthread_cond_destroy(c)
+#define vglsl_cond_wait(c, m) pthread_cond_wait(c, m)
+#define vglsl_cond_broadcast(c) pthread_cond_broadcast(c)
+#define vglsl_thread_start(t, fn, arg) (pthread_create(t, NULL, fn, arg) == 0)
+#define vglsl_thread_join(t) pthread_join(t, NULL)
+#endif
+
+#ifndef VGLSL_MAX_PREFETCH_THREADS
+#define VGLSL_MAX_PREFETCH_THREADS 16
+#endif
+
+/* Virtual include paths - a trie of path segments, so "Engine" and
+ * "Engine/Render" can both be mounted and the longest one wins */
+typedef struct VglslVirtualNode {
+    char* segment;        /* e.g., "Render" */
+    size_t length;
+    char* real_path;      /* e.g., "/path/to/render/shaders", NULL if not mounted */
+    struct VglslVirtualNode** children; /* Sorted by segment */
+    int child_count;
+    int child_capacity;
+} VglslVirtualNode;
 
 /* Global virtual include paths storage */
-static VglslVirtualPath g_virtual_paths[VGLSL_MAX_VIRTUAL_PATHS];
-static int g_virtual_path_count = 0;
+static VglslVirtualNode g_virtual_root;
+static uint64_t g_virtual_generation = 0; /* Bumped on every change */
 
 /* Internal structures */
 typedef struct VglslDefine {
@@ -132,19 +441,331 @@ typedef struct VglslDefine {
     char** params;
     int param_count;
     bool is_function_macro;
+    
+    uint64_t hash;               /* vglsl_hash of name */
+    int refs;                    /* Maps holding it; frozen: define sets holding it */
+    bool frozen;                 /* Owned by define sets, never changed by a parse */
 } VglslDefine;
 
+/* Define map trie node. Slots hold a define or a subtree, indexed by five
+ * hash bits per level; items lists the defines, then the subtrees. */
+typedef struct VglslDefineNode {
+    int refs;
+    bool frozen;
+    uint32_t leaf_map;
+    uint32_t child_map;
+    int leaf_count;
+    int count;
+    void* items[];
+} VglslDefineNode;
+
+typedef struct VglslDefineMap {
+    VglslDefineNode* root;
+    int count;
+} VglslDefineMap;
+
+struct VglslDefineSet {
+    VglslDefineMap map;
+    uint64_t hash;               /* Order-independent content hash (cache keys) */
+};
+
+/* Device and inode of a file; inode 0 when it could not be stat'ed (no
+ * such file on disk, or no POSIX stat) and the normalized path decides */
+typedef struct VglslFileId {
+    uint64_t device;
+    uint64_t inode;
+} VglslFileId;
+
+/* File skipped when included again - #pragma once (guard NULL), or an
+ * include guard, skipped while the guard macro is defined */
+typedef struct VglslOnceEntry {
+    char* path;                  /* Normalized */
+    VglslFileId id;
+    char* guard;
+} VglslOnceEntry;
+
+/* Canonical identity of a path a parse resolved, computed once per path */
+typedef struct VglslFileEntry {
+    char* path;                  /* As resolved; NULL marks an empty slot */
+    char* canonical;             /* Normalized - no empty, "." or "dir/.." segments */
+    VglslFileId id;
+    bool listed;                 /* Already in the tracked file list */
+} VglslFileEntry;
+
+/* Resolved #include. The key holds the including file's directory (quoted
+ * includes only), the spelling (with its delimiter) and the base path, each
+ * NUL-terminated. */
+typedef struct VglslResolveEntry {
+    uint64_t hash;               /* Of key, search paths and loader, 0 marks an empty slot */
+    char* key;
+    size_t key_length;
+    uint64_t search;             /* Hash of config->include_paths */
+    char* (*load_file)(const char* path, size_t* size, void* user_data);
+    void* load_user_data;
+    uint64_t generation;         /* Virtual paths it was resolved under */
+    char* path;
+    bool found;                  /* false: reading path failed */
+    bool stale;                  /* Found, then failed to read: resolve again */
+} VglslResolveEntry;
+
+struct VglslSnapshot {
+    VglslDefineSet* defines;
+    VglslOnceEntry* once;
+    int once_count;
+    const char* prelude;
+    size_t prelude_length;
+    void* mapping;               /* Loaded file the strings point into, or NULL */
+    size_t mapping_size;
+    uint64_t hash;               /* Content hash (cache keys) */
+};
+
+/* Identity of a file's contents as far as stat can tell */
+typedef struct VglslFileStamp {
+    uint64_t size;
+    uint64_t mtime;              /* Nanoseconds where available */
+    uint64_t identity;           /* Device and inode */
+} VglslFileStamp;
+
+/* Files read by a parse, stamped before reading, and directories searched
+ * for its includes, a missing one with a zero stamp (vglsl_parse_file_cached) */
+typedef struct VglslFileList {
+    char** paths;
+    VglslFileStamp* stamps;
+    int count;
+    int capacity;
+    bool unstable;               /* A file could not be stamped */
+} VglslFileList;
+
+/* Background read of an include the parser has not reached yet */
+typedef enum {
+    VGLSL_PREFETCH_QUEUED,
+    VGLSL_PREFETCH_READING,
+    VGLSL_PREFETCH_DONE,
+    VGLSL_PREFETCH_TAKEN         /* Handed to the parser, or read by it */
+} VglslPrefetchState;
+
+typedef struct VglslPrefetchJob {
+    char* path;
+    uint64_t hash;
+    bool track;                  /* The parse tracks its files, so stamp it */
+    char* data;                  /* VGLSL_MALLOC'd contents, NULL if unreadable */
+    size_t size;
+    VglslFileStamp stamp;        /* Taken before the read */
+    bool stamped;
+    VglslPrefetchState state;
+    struct VglslPrefetchJob* next; /* In the pool queue while queued */
+} VglslPrefetchJob;
+
+#ifdef VGLSL_HAS_THREADS
+/* Workers take jobs from one queue shared by the parses using the pool.
+ * Jobs belong to the parse that queued them and are freed when it ends. */
+struct VglslPrefetchPool {
+    vglsl_mutex lock;
+    vglsl_cond work;             /* Job queued, or stopping */
+    vglsl_cond done;             /* Job read */
+    VglslPrefetchJob* head;      /* Queued jobs, oldest first */
+    VglslPrefetchJob* tail;
+    uint64_t reads;
+    vglsl_thread threads[VGLSL_MAX_PREFETCH_THREADS];
+    int thread_count;
+    bool stop;
+};
+#endif
+
+/* Names in an include directory, as of its stamp */
+typedef struct VglslDirListing {
+    char* path;
+    uint64_t hash;               /* vglsl_hash of path */
+    VglslFileStamp stamp;
+    bool exists;
+    char** names;                /* Open addressing, NULL marks an empty slot */
+    int name_count;
+    int name_capacity;           /* Power of two, 0 when empty */
+} VglslDirListing;
+
+struct VglslIncludeCache {
+    VglslResolveEntry* entries;
+    int count;
+    int capacity;                /* Power of two, 0 when empty */
+    
+    VglslDirListing* dirs;
+    int dir_count;
+    int dir_capacity;
+};
+
+/* Input source - length-delimited text read line by line by the driver.
+ * Files, memory buffers and loader results all end up as one of these. */
+typedef struct VglslSource {
+    const char* data;            /* Current piece, not necessarily NUL-terminated */
+    size_t size;
+    size_t pos;                  /* Next unread byte */
+    char* owned;                 /* Buffer released with the source, or NULL */
+    const VglslSegment* pieces;  /* Pieces following the current one */
+    int piece_count;
+} VglslSource;
+
+/* Text chunk of the segment storage, holding expanded (non-verbatim) text */
+typedef struct VglslChunk {
+    struct VglslChunk* next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} VglslChunk;
+
+typedef struct VglslCacheMap VglslCacheMap;
+
+/* Storage behind segmented output - pinned source buffers and text chunks,
+ * or the cache file a cache hit points into. Handed to the result, released
+ * by vglsl_free_result. */
+typedef struct VglslStorage {
+    char** pinned;
+    int pinned_count;
+    int pinned_capacity;
+    VglslChunk* chunks;
+    VglslCacheMap* mapping;
+} VglslStorage;
+
+/* Streaming XXH64 state, fed by the output builder as text is appended */
+typedef struct VglslHash {
+    uint64_t lanes[4];
+    uint64_t total_length;
+    unsigned char buffer[32];
+    size_t buffer_size;
+} VglslHash;
+
+/* Include frame - one entry per file on the include stack, root included */
+typedef struct VglslIncludeFrame {
+    VglslSource source;
+    char* filename;              /* Owned path (errors and #line) */
+    char* directory;             /* Directory part of filename for quoted includes, NULL if none */
+    const char* parent_filename; /* File containing the #include */
+    int line_num;                /* Line number of the next line to read */
+    int include_line;            /* Line of the #include in the parent */
+    int guard_state;             /* Include guard detection (VGLSL_GUARD_*) */
+    int guard_depth;             /* Conditional depth of the guard #ifndef */
+    char* guard;                 /* Guard macro once seen */
+} VglslIncludeFrame;
+
+/* Include guard detection - a file is guarded when every significant line
+ * lies inside one #ifndef NAME ... #endif */
+enum {
+    VGLSL_GUARD_START,           /* Nothing significant read yet */
+    VGLSL_GUARD_OPEN,            /* Inside the #ifndef */
+    VGLSL_GUARD_CLOSED,          /* After its #endif */
+    VGLSL_GUARD_NONE             /* Not guarded */
+};
+
+/* Start of a #pragma stage section; stage -1 is shared by all stages */
+typedef struct VglslStageMark {
+    size_t offset;
+    int stage;
+} VglslStageMark;
+
+/* Global statement collected for reflection as the output is emitted, so
+ * reflection without token passes needs no second scan of the output.
+ * Comments and directives are left out and function bodies skipped. */
+typedef enum {
+    VGLSL_STREAM_CODE,
+    VGLSL_STREAM_LINE_COMMENT,
+    VGLSL_STREAM_BLOCK_COMMENT,
+    VGLSL_STREAM_DIRECTIVE
+} VglslStreamMode;
+
+typedef struct VglslReflectStream {
+    bool active;
+    char* text;                  /* Statement so far */
+    size_t length;
+    size_t capacity;
+    VglslStreamMode mode;
+    int depth;                   /* Bracket nesting */
+    bool in_body;                /* Inside a function body */
+    bool line_start;
+    bool slash;                  /* A '/' held back until the next byte */
+    bool star;                   /* Last byte of a block comment was '*' */
+} VglslReflectStream;
+
 typedef struct VglslContext {
-    VglslDefine defines[VGLSL_MAX_DEFINES];
-    int define_count;
+    VglslDefineMap defines;      /* Starts as the base set's map, shared until changed */
     
     char* output;
     size_t output_size;
     size_t output_capacity;
     
+    /* Segmented output (config->output_segments) */
+    VglslSegment* segments;
+    int segment_count;
+    int segment_capacity;
+    VglslStorage* storage;
+    
+    /* Hash of everything emitted so far */
+    VglslHash hash;
+    
+    /* Renames made by the minifier, handed to the result */
+    VglslRename* renames;
+    int rename_count;
+    
+    /* #pragma stage sections, as offsets into the output */
+    VglslStageMark* stage_marks;
+    int stage_mark_count;
+    int stage_mark_capacity;
+    char** stage_names;
+    int stage_count;
+    VglslStage* stages;
+    
+    /* Reflection of the output, handed to the result */
+    VglslVariable* variables;
+    int variable_count;
+    VglslReflectStream reflect_stream;
+    
+    /* Raw text of the current line inside its (pinned) source buffer */
+    const char* raw_line;
+    size_t raw_length;
+    bool raw_has_newline;
+    
     const VglslConfig* config;
     int include_depth;
     
+    /* Files read, when the caller tracks them */
+    VglslFileList* files;
+    
+    /* Directory listings for config->include_paths, kept in the caller's
+     * include cache or, without one, in a cache owned by the parse */
+    VglslIncludeCache* listings;
+    bool owns_listings;
+    uint64_t search_hash;        /* Of config->include_paths, 0 if none */
+    
+    /* Last include candidate a loader served while probing, kept for the
+     * include it resolves to instead of loading it again */
+    VglslSource probe;
+    char* probe_path;
+    
+    /* Include reads queued on config->prefetch by this parse */
+    VglslPrefetchJob** prefetch_jobs;
+    int prefetch_count;
+    int prefetch_capacity;
+    
+    /* Identities of the paths seen, so spellings of one file match */
+    VglslFileEntry* file_table;
+    int file_count;
+    int file_capacity;           /* Power of two, 0 when empty */
+    
+    /* Files not to include again (#pragma once, include guards) */
+    VglslOnceEntry* once;
+    int once_count;
+    int once_capacity;
+    
+    /* Include stack, driven iteratively by vglsl_run */
+    VglslIncludeFrame* frames;
+    int frame_count;
+    int frame_capacity;
+    
+    /* Heap scratch buffers (VGLSL_MAX_LINE_LENGTH each), shared by all levels */
+    char* scratch;
+    char* line_buffer;
+    char* processed_line;
+    char* directive;
+    char* expanded_line;
+    
     /* Error handling */
     bool has_error;
     char* error_message;
@@ -161,12 +782,13 @@ typedef struct VglslContext {
 static bool vglsl_process_line(VglslContext* ctx, const char* line, int line_num, const char* filename);
 static bool vglsl_process_directive(VglslContext* ctx, const char* line, int line_num, const char* filename);
 static bool vglsl_expand_macros(VglslContext* ctx, const char* input, char* output, size_t output_size);
-static VglslDefine* vglsl_find_define(VglslContext* ctx, const char* name);
+static const VglslDefine* vglsl_find_define(VglslContext* ctx, const char* name);
 static bool vglsl_append_output(VglslContext* ctx, const char* text);
 static void vglsl_set_error(VglslContext* ctx, const char* message, int line, const char* filename);
-static char* vglsl_read_file(const char* filename);
+static char* vglsl_read_file(const char* filename, size_t* out_size);
 static void vglsl_cleanup_context(VglslContext* ctx);
-static const char* vglsl_resolve_virtual_path(const char* include_path);
+static size_t vglsl_resolve_virtual_path(const char* include_path, char* buffer, size_t capacity);
+static bool vglsl_reflect_feed(VglslContext* ctx, const char* text, size_t length);
 
 /* Utility functions */
 static char* vglsl_strdup(const char* str) {
@@ -193,11 +815,161 @@ static void vglsl_trim_whitespace(char* str) {
     }
 }
 
+/* Collapse whitespace runs to single spaces in place; returns the new length */
+static size_t vglsl_collapse_whitespace(char* str) {
+    char* dst = str;
+    bool in_space = false;
+    for (const char* src = str; *src; src++) {
+        if (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\v' || *src == '\f') {
+            in_space = true;
+            continue;
+        }
+        if (in_space && dst != str) *dst++ = ' ';
+        in_space = false;
+        *dst++ = *src;
+    }
+    *dst = '\0';
+    return (size_t)(dst - str);
+}
+
 static bool vglsl_starts_with(const char* str, const char* prefix) {
     if (!str || !prefix) return false;
     return strncmp(str, prefix, strlen(prefix)) == 0;
 }
 
+static bool vglsl_is_ident_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool vglsl_is_ident_char(char c) {
+    return vglsl_is_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+/* XXH64 - four independent lanes over 32-byte stripes, so the multiplies
+ * of one stripe run in parallel; no intrinsics needed to stay fast. */
+#define VGLSL_PRIME64_1 0x9E3779B185EBCA87ULL
+#define VGLSL_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define VGLSL_PRIME64_3 0x165667B19E3779F9ULL
+#define VGLSL_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define VGLSL_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t vglsl_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t vglsl_read64(const unsigned char* p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t vglsl_read32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t vglsl_hash_round(uint64_t acc, uint64_t input) {
+    acc += input * VGLSL_PRIME64_2;
+    acc = vglsl_rotl64(acc, 31);
+    return acc * VGLSL_PRIME64_1;
+}
+
+static uint64_t vglsl_hash_merge(uint64_t acc, uint64_t lane) {
+    acc ^= vglsl_hash_round(0, lane);
+    return acc * VGLSL_PRIME64_1 + VGLSL_PRIME64_4;
+}
+
+static void vglsl_hash_init(VglslHash* hash) {
+    memset(hash, 0, sizeof(*hash));
+    hash->lanes[0] = VGLSL_PRIME64_1 + VGLSL_PRIME64_2;
+    hash->lanes[1] = VGLSL_PRIME64_2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = 0 - VGLSL_PRIME64_1;
+}
+
+static void vglsl_hash_stripe(VglslHash* hash, const unsigned char* p) {
+    hash->lanes[0] = vglsl_hash_round(hash->lanes[0], vglsl_read64(p));
+    hash->lanes[1] = vglsl_hash_round(hash->lanes[1], vglsl_read64(p + 8));
+    hash->lanes[2] = vglsl_hash_round(hash->lanes[2], vglsl_read64(p + 16));
+    hash->lanes[3] = vglsl_hash_round(hash->lanes[3], vglsl_read64(p + 24));
+}
+
+static void vglsl_hash_update(VglslHash* hash, const void* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    hash->total_length += length;
+    
+    /* Complete a partially filled stripe first */
+    if (hash->buffer_size > 0) {
+        size_t fill = 32 - hash->buffer_size;
+        if (fill > length) fill = length;
+        memcpy(hash->buffer + hash->buffer_size, p, fill);
+        hash->buffer_size += fill;
+        p += fill;
+        length -= fill;
+        if (hash->buffer_size < 32) return;
+        vglsl_hash_stripe(hash, hash->buffer);
+        hash->buffer_size = 0;
+    }
+    
+    while (length >= 32) {
+        vglsl_hash_stripe(hash, p);
+        p += 32;
+        length -= 32;
+    }
+    
+    memcpy(hash->buffer, p, length);
+    hash->buffer_size = length;
+}
+
+static uint64_t vglsl_hash_digest(const VglslHash* hash) {
+    uint64_t h;
+    if (hash->total_length >= 32) {
+        h = vglsl_rotl64(hash->lanes[0], 1) + vglsl_rotl64(hash->lanes[1], 7) +
+            vglsl_rotl64(hash->lanes[2], 12) + vglsl_rotl64(hash->lanes[3], 18);
+        for (int i = 0; i < 4; i++) h = vglsl_hash_merge(h, hash->lanes[i]);
+    } else {
+        h = VGLSL_PRIME64_5;
+    }
+    h += hash->total_length;
+    
+    const unsigned char* p = hash->buffer;
+    size_t remaining = hash->buffer_size;
+    while (remaining >= 8) {
+        h ^= vglsl_hash_round(0, vglsl_read64(p));
+        h = vglsl_rotl64(h, 27) * VGLSL_PRIME64_1 + VGLSL_PRIME64_4;
+        p += 8;
+        remaining -= 8;
+    }
+    if (remaining >= 4) {
+        h ^= (uint64_t)vglsl_read32(p) * VGLSL_PRIME64_1;
+        h = vglsl_rotl64(h, 23) * VGLSL_PRIME64_2 + VGLSL_PRIME64_3;
+        p += 4;
+        remaining -= 4;
+    }
+    while (remaining > 0) {
+        h ^= (*p++) * VGLSL_PRIME64_5;
+        h = vglsl_rotl64(h, 11) * VGLSL_PRIME64_1;
+        remaining--;
+    }
+    
+    h ^= h >> 33;
+    h *= VGLSL_PRIME64_2;
+    h ^= h >> 29;
+    h *= VGLSL_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t vglsl_hash(const void* data, size_t length) {
+    VglslHash hash;
+    vglsl_hash_init(&hash);
+    vglsl_hash_update(&hash, data, length);
+    return vglsl_hash_digest(&hash);
+}
+
+static void vglsl_hash_string(VglslHash* hash, const char* text) {
+    if (!text) text = "";
+    vglsl_hash_update(hash, text, strlen(text) + 1);
+}
+
 /* Default configuration */
 VglslConfig vglsl_default_config(void) {
     VglslConfig config = {0};
@@ -210,7 +982,7 @@ VglslConfig vglsl_default_config(void) {
 }
 
 /* Read entire file into memory */
-static char* vglsl_read_file(const char* filename) {
+static char* vglsl_read_file(const char* filename, size_t* out_size) {
     FILE* file = fopen(filename, "rb");
     if (!file) return NULL;
     
@@ -233,9 +1005,167 @@ static char* vglsl_read_file(const char* filename) {
     content[read_size] = '\0';
     fclose(file);
     
+    if (out_size) *out_size = read_size;
     return content;
 }
 
+/* Source over caller-owned memory */
+static VglslSource vglsl_source_from_memory(const char* data, size_t size) {
+    VglslSource source = {0};
+    source.data = data;
+    source.size = size;
+    return source;
+}
+
+/* Source over a file, through the configured loader first */
+static bool vglsl_source_from_file(const VglslConfig* config, const char* path, VglslSource* source) {
+    size_t size = 0;
+    char* content = NULL;
+    
+    if (config->load_file) {
+        content = config->load_file(path, &size, config->load_user_data);
+    }
+    if (!content) {
+        content = vglsl_read_file(path, &size);
+    }
+    if (!content) return false;
+    
+    *source = vglsl_source_from_memory(content, size);
+    source->owned = content;
+    return true;
+}
+
+/* Stamp a file without reading it */
+static bool vglsl_stat_file(const char* path, VglslFileStamp* stamp) {
+#ifdef VGLSL_HAS_MMAP
+    struct stat info;
+    if (stat(path, &info) != 0) return false;
+    stamp->size = (uint64_t)info.st_size;
+    stamp->mtime = (uint64_t)info.st_mtime * 1000000000ULL;
+#if defined(__APPLE__)
+    stamp->mtime += (uint64_t)info.st_mtimespec.tv_nsec;
+#elif defined(st_mtime)
+    stamp->mtime += (uint64_t)info.st_mtim.tv_nsec;
+#elif defined(__GLIBC__)
+    stamp->mtime += (uint64_t)info.st_mtimensec;
+#endif
+    stamp->identity = ((uint64_t)info.st_dev << 32) ^ (uint64_t)info.st_ino;
+    return true;
+#else
+    (void)path;
+    (void)stamp;
+    return false;
+#endif
+}
+
+/* Device and inode of a file */
+static bool vglsl_file_id(const char* path, VglslFileId* id) {
+#ifdef VGLSL_HAS_MMAP
+    struct stat info;
+    if (stat(path, &info) != 0) return false;
+    id->device = (uint64_t)info.st_dev;
+    id->inode = (uint64_t)info.st_ino;
+    return id->inode != 0;
+#else
+    (void)path;
+    (void)id;
+    return false;
+#endif
+}
+
+/* Record a file about to be read. The stamp is taken first, so a change
+ * racing with the read leaves a stamp that no longer matches. A prefetched
+ * file brings the stamp its worker took before reading. */
+static bool vglsl_file_list_add(VglslFileList* files, const char* path, const VglslFileStamp* stamp) {
+    if (files->count >= files->capacity) {
+        int new_capacity = files->capacity ? files->capacity * 2 : 8;
+        char** paths = (char**)VGLSL_REALLOC(files->paths, new_capacity * sizeof(char*));
+        if (paths) files->paths = paths;
+        VglslFileStamp* stamps = (VglslFileStamp*)VGLSL_REALLOC(files->stamps, new_capacity * sizeof(VglslFileStamp));
+        if (stamps) files->stamps = stamps;
+        if (!paths || !stamps) return false;
+        files->capacity = new_capacity;
+    }
+    
+    files->paths[files->count] = vglsl_strdup(path);
+    if (!files->paths[files->count]) return false;
+    if (stamp) {
+        files->stamps[files->count] = *stamp;
+    } else if (!vglsl_stat_file(path, &files->stamps[files->count])) {
+        files->unstable = true;
+    }
+    files->count++;
+    return true;
+}
+
+#ifdef VGLSL_HAS_MMAP
+static void vglsl_file_list_free(VglslFileList* files) {
+    for (int i = 0; i < files->count; i++) {
+        VGLSL_FREE(files->paths[i]);
+    }
+    VGLSL_FREE(files->paths);
+    VGLSL_FREE(files->stamps);
+}
+#endif
+
+/* Move on to the next piece of a multi-piece source */
+static void vglsl_source_next_piece(VglslSource* source) {
+    source->data = source->pieces[0].data;
+    source->size = source->pieces[0].length;
+    source->pos = 0;
+    source->pieces++;
+    source->piece_count--;
+}
+
+/* Get the next line (without its newline); false once the source is exhausted.
+ * A line is returned in place when it lies within one piece. One that runs
+ * across pieces is joined into the join buffer; if it does not fit, length is
+ * still its full length and the caller rejects it. */
+static bool vglsl_source_next_line(VglslSource* source, const char** line, size_t* length,
+                                   char* join, size_t join_capacity) {
+    while (source->pos >= source->size) {
+        if (source->piece_count == 0) return false;
+        vglsl_source_next_piece(source);
+    }
+    
+    const char* start = source->data + source->pos;
+    size_t available = source->size - source->pos;
+    const char* end = (const char*)memchr(start, '\n', available);
+    
+    if (end || source->piece_count == 0) {
+        *line = start;
+        *length = end ? (size_t)(end - start) : available;
+        source->pos += end ? *length + 1 : available;
+        return true;
+    }
+    
+    /* Line continues into the following pieces */
+    size_t total = 0;
+    for (;;) {
+        start = source->data + source->pos;
+        available = source->size - source->pos;
+        end = (const char*)memchr(start, '\n', available);
+        
+        size_t part = end ? (size_t)(end - start) : available;
+        if (total + part < join_capacity) memcpy(join + total, start, part);
+        total += part;
+        source->pos += end ? part + 1 : part;
+        
+        if (end || source->piece_count == 0) break;
+        vglsl_source_next_piece(source);
+    }
+    
+    if (total < join_capacity) join[total] = '\0';
+    *line = join;
+    *length = total;
+    return true;
+}
+
+static void vglsl_source_close(VglslSource* source) {
+    VGLSL_FREE(source->owned);
+    source->owned = NULL;
+}
+
 /* Set error in context */
 static void vglsl_set_error(VglslContext* ctx, const char* message, int line, const char* filename) {
     if (ctx->has_error) return; /* Keep first error */
@@ -246,11 +1176,132 @@ static void vglsl_set_error(VglslContext* ctx, const char* message, int line, co
     ctx->error_file = vglsl_strdup(filename);
 }
 
-/* Append text to output buffer */
-static bool vglsl_append_output(VglslContext* ctx, const char* text) {
-    if (!text) return true;
+/* Release segment storage */
+static void vglsl_cache_map_release(VglslCacheMap* map);
+
+static void vglsl_free_storage(VglslStorage* storage) {
+    if (!storage) return;
+    if (storage->mapping) vglsl_cache_map_release(storage->mapping);
+    
+    for (int i = 0; i < storage->pinned_count; i++) {
+        VGLSL_FREE(storage->pinned[i]);
+    }
+    VGLSL_FREE(storage->pinned);
+    
+    VglslChunk* chunk = storage->chunks;
+    while (chunk) {
+        VglslChunk* next = chunk->next;
+        VGLSL_FREE(chunk);
+        chunk = next;
+    }
+    VGLSL_FREE(storage);
+}
+
+/* Keep a source buffer alive for the lifetime of the result */
+static bool vglsl_pin_buffer(VglslContext* ctx, char* buffer) {
+    VglslStorage* storage = ctx->storage;
+    if (storage->pinned_count >= storage->pinned_capacity) {
+        int new_capacity = storage->pinned_capacity ? storage->pinned_capacity * 2 : 16;
+        char** new_pinned = (char**)VGLSL_REALLOC(storage->pinned, new_capacity * sizeof(char*));
+        if (!new_pinned) {
+            VGLSL_FREE(buffer);
+            vglsl_set_error(ctx, "Failed to allocate memory for output", 0, "");
+            return false;
+        }
+        storage->pinned = new_pinned;
+        storage->pinned_capacity = new_capacity;
+    }
+    storage->pinned[storage->pinned_count++] = buffer;
+    return true;
+}
+
+/* Close a frame source; in segmented mode its buffer is pinned instead */
+static void vglsl_release_source(VglslContext* ctx, VglslSource* source) {
+    if (ctx->storage && source->owned) {
+        vglsl_pin_buffer(ctx, source->owned);
+        source->owned = NULL;
+    }
+    vglsl_source_close(source);
+}
+
+/* Check the output size limit before adding text_len bytes */
+static bool vglsl_check_output_size(VglslContext* ctx, size_t text_len) {
+    if (ctx->output_size + text_len + 1 > (size_t)ctx->config->max_output_size) {
+        vglsl_set_error(ctx, "Output size exceeded maximum limit", 0, "");
+        return false;
+    }
+    return true;
+}
+
+/* Add a segment, merging it into the previous one when they are adjacent */
+static bool vglsl_add_segment(VglslContext* ctx, const char* data, size_t length) {
+    if (ctx->segment_count > 0) {
+        VglslSegment* last = &ctx->segments[ctx->segment_count - 1];
+        if (last->data + last->length == data) {
+            last->length += length;
+            return true;
+        }
+    }
+    
+    if (ctx->segment_count >= ctx->segment_capacity) {
+        int new_capacity = ctx->segment_capacity ? ctx->segment_capacity * 2 : 64;
+        VglslSegment* new_segments = (VglslSegment*)VGLSL_REALLOC(ctx->segments, new_capacity * sizeof(VglslSegment));
+        if (!new_segments) {
+            vglsl_set_error(ctx, "Failed to allocate memory for output", 0, "");
+            return false;
+        }
+        ctx->segments = new_segments;
+        ctx->segment_capacity = new_capacity;
+    }
+    
+    ctx->segments[ctx->segment_count].data = data;
+    ctx->segments[ctx->segment_count].length = length;
+    ctx->segment_count++;
+    return true;
+}
+
+/* Append text that stays valid for the lifetime of the result (pinned source) */
+static bool vglsl_emit_pinned(VglslContext* ctx, const char* text, size_t text_len);
+
+/* Append a copy of text to the output */
+static bool vglsl_emit(VglslContext* ctx, const char* text, size_t text_len) {
+    if (!ctx->storage) return vglsl_emit_pinned(ctx, text, text_len);
+    if (!vglsl_check_output_size(ctx, text_len)) return false;
+    
+    /* Copy into the current chunk, starting a new one when full */
+    VglslChunk* chunk = ctx->storage->chunks;
+    if (!chunk || chunk->capacity - chunk->used < text_len) {
+        size_t capacity = text_len > 4096 ? text_len : 4096;
+        chunk = (VglslChunk*)VGLSL_MALLOC(sizeof(VglslChunk) + capacity);
+        if (!chunk) {
+            vglsl_set_error(ctx, "Failed to allocate memory for output", 0, "");
+            return false;
+        }
+        chunk->next = ctx->storage->chunks;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        ctx->storage->chunks = chunk;
+    }
+    
+    char* dst = chunk->data + chunk->used;
+    memcpy(dst, text, text_len);
+    vglsl_hash_update(&ctx->hash, text, text_len);
+    if (ctx->reflect_stream.active && !vglsl_reflect_feed(ctx, text, text_len)) return false;
+    chunk->used += text_len;
+    ctx->output_size += text_len;
+    return vglsl_add_segment(ctx, dst, text_len);
+}
+
+static bool vglsl_emit_pinned(VglslContext* ctx, const char* text, size_t text_len) {
+    if (!vglsl_check_output_size(ctx, text_len)) return false;
+    vglsl_hash_update(&ctx->hash, text, text_len);
+    if (ctx->reflect_stream.active && !vglsl_reflect_feed(ctx, text, text_len)) return false;
+    
+    if (ctx->storage) {
+        ctx->output_size += text_len;
+        return vglsl_add_segment(ctx, text, text_len);
+    }
     
-    size_t text_len = strlen(text);
     size_t needed = ctx->output_size + text_len + 1;
     
     /* Check if we need to reallocate */
@@ -259,17 +1310,11 @@ static bool vglsl_append_output(VglslContext* ctx, const char* text) {
         size_t new_capacity = ctx->output_capacity * 2;
         if (new_capacity < needed) new_capacity = needed * 2;
         
-        /* Check if new capacity would exceed the maximum allowed size */
-        if (new_capacity > ctx->config->max_output_size) {
+        /* Never grow past the maximum allowed size (checked above) */
+        if (new_capacity > (size_t)ctx->config->max_output_size) {
             new_capacity = ctx->config->max_output_size;
         }
         
-        /* If even the maximum allowed size is not enough, fail */
-        if (needed > new_capacity) {
-            vglsl_set_error(ctx, "Output size exceeded maximum limit", 0, "");
-            return false;
-        }
-        
         char* new_output = (char*)VGLSL_REALLOC(ctx->output, new_capacity);
         if (!new_output) {
             vglsl_set_error(ctx, "Failed to allocate memory for output", 0, "");
@@ -280,81 +1325,350 @@ static bool vglsl_append_output(VglslContext* ctx, const char* text) {
         ctx->output_capacity = new_capacity;
     }
     
-    strcat(ctx->output, text);
+    memcpy(ctx->output + ctx->output_size, text, text_len);
     ctx->output_size += text_len;
+    ctx->output[ctx->output_size] = '\0';
     return true;
 }
 
-/* Find define by name */
-static VglslDefine* vglsl_find_define(VglslContext* ctx, const char* name) {
-    for (int i = 0; i < ctx->define_count; i++) {
-        if (strcmp(ctx->defines[i].name, name) == 0) {
-            return &ctx->defines[i];
-        }
-    }
-    return NULL;
+/* Append text to output buffer */
+static bool vglsl_append_output(VglslContext* ctx, const char* text) {
+    if (!text) return true;
+    return vglsl_emit(ctx, text, strlen(text));
 }
 
-/* Add or update define */
-static bool vglsl_add_define(VglslContext* ctx, const char* name, const char* value, char** params, int param_count) {
-    if (ctx->define_count >= VGLSL_MAX_DEFINES) {
-        vglsl_set_error(ctx, "Too many defines", 0, "");
-        return false;
+/* Define map - a persistent hash array mapped trie. Every change copies
+ * only the path to the changed entry, so maps made from one another share
+ * everything else. Nodes and defines are reference counted while a parse
+ * owns them; frozen ones belong to define sets and are never written by a
+ * parse, so one set can back many parses at once. */
+#define VGLSL_MAP_BITS 5
+#define VGLSL_MAP_MAX_DEPTH 12  /* 60 hash bits; deeper entries share a collision node */
+
+static uint32_t vglsl_popcount32(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    return (((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+static void vglsl_define_retain(VglslDefine* define) {
+    if (!define->frozen) define->refs++;
+}
+
+static void vglsl_define_release(VglslDefine* define) {
+    if (define->frozen || --define->refs > 0) return;
+    VGLSL_FREE(define->name);
+    VGLSL_FREE(define->value);
+    for (int i = 0; i < define->param_count; i++) {
+        VGLSL_FREE(define->params[i]);
     }
-    
-    /* Check if define already exists */
-    VglslDefine* existing = vglsl_find_define(ctx, name);
-    if (existing) {
-        /* Update existing define */
-        VGLSL_FREE(existing->value);
-        if (existing->params) {
-            for (int i = 0; i < existing->param_count; i++) {
-                VGLSL_FREE(existing->params[i]);
+    VGLSL_FREE(define->params);
+    VGLSL_FREE(define);
+}
+
+static void vglsl_node_retain(VglslDefineNode* node) {
+    if (node && !node->frozen) node->refs++;
+}
+
+static void vglsl_node_release(VglslDefineNode* node) {
+    if (!node || node->frozen || --node->refs > 0) return;
+    int leaf_count = node->leaf_count;
+    for (int i = 0; i < node->count; i++) {
+        if (i < leaf_count) vglsl_define_release((VglslDefine*)node->items[i]);
+        else vglsl_node_release((VglslDefineNode*)node->items[i]);
+    }
+    VGLSL_FREE(node);
+}
+
+static VglslDefineNode* vglsl_node_alloc(int leaf_count, int child_count) {
+    int count = leaf_count + child_count;
+    VglslDefineNode* node = (VglslDefineNode*)VGLSL_MALLOC(sizeof(VglslDefineNode) + count * sizeof(void*));
+    if (!node) return NULL;
+    memset(node, 0, sizeof(VglslDefineNode));
+    node->refs = 1;
+    node->leaf_count = leaf_count;
+    node->count = count;
+    return node;
+}
+
+static int vglsl_node_slot(uint64_t hash, int depth) {
+    return (int)((hash >> (depth * VGLSL_MAP_BITS)) & 31);
+}
+
+static const VglslDefine* vglsl_map_find(const VglslDefineNode* node, const char* name) {
+    uint64_t hash = vglsl_hash(name, strlen(name));
+    for (int depth = 0; node; depth++) {
+        if (depth == VGLSL_MAP_MAX_DEPTH) {
+            for (int i = 0; i < node->count; i++) {
+                const VglslDefine* define = (const VglslDefine*)node->items[i];
+                if (strcmp(define->name, name) == 0) return define;
             }
-            VGLSL_FREE(existing->params);
+            return NULL;
         }
-    } else {
-        /* Add new define */
-        existing = &ctx->defines[ctx->define_count++];
-        existing->name = vglsl_strdup(name);
+        
+        uint32_t bit = 1u << vglsl_node_slot(hash, depth);
+        uint32_t below = bit - 1;
+        if (node->leaf_map & bit) {
+            const VglslDefine* define = (const VglslDefine*)node->items[vglsl_popcount32(node->leaf_map & below)];
+            return strcmp(define->name, name) == 0 ? define : NULL;
+        }
+        if (!(node->child_map & bit)) return NULL;
+        node = (const VglslDefineNode*)node->items[node->leaf_count + vglsl_popcount32(node->child_map & below)];
     }
+    return NULL;
+}
+
+/* Copy of node with one slot set to a leaf, a child or nothing. The new
+ * item's reference passes to the copy; the others are retained. */
+static VglslDefineNode* vglsl_node_with_slot(const VglslDefineNode* node, int slot, VglslDefine* leaf,
+                                             VglslDefineNode* child) {
+    uint32_t bit = 1u << slot;
+    uint32_t leaf_map = (node->leaf_map & ~bit) | (leaf ? bit : 0);
+    uint32_t child_map = (node->child_map & ~bit) | (child ? bit : 0);
+    VglslDefineNode* copy = vglsl_node_alloc((int)vglsl_popcount32(leaf_map), (int)vglsl_popcount32(child_map));
+    if (!copy) return NULL;
+    copy->leaf_map = leaf_map;
+    copy->child_map = child_map;
     
-    existing->value = vglsl_strdup(value ? value : "");
-    existing->param_count = param_count;
-    existing->is_function_macro = (param_count > 0);
+    int leaf_index = 0;
+    int child_index = copy->leaf_count;
+    for (int s = 0; s < 32; s++) {
+        uint32_t s_bit = 1u << s;
+        uint32_t below = s_bit - 1;
+        if (leaf_map & s_bit) {
+            VglslDefine* item = (s == slot) ? leaf : (VglslDefine*)node->items[vglsl_popcount32(node->leaf_map & below)];
+            if (s != slot) vglsl_define_retain(item);
+            copy->items[leaf_index++] = item;
+        } else if (child_map & s_bit) {
+            VglslDefineNode* item = (s == slot) ? child :
+                (VglslDefineNode*)node->items[node->leaf_count + vglsl_popcount32(node->child_map & below)];
+            if (s != slot) vglsl_node_retain(item);
+            copy->items[child_index++] = item;
+        }
+    }
+    return copy;
+}
+
+/* New trie with define added or replaced; takes the caller's define
+ * reference. node is left as it was. */
+static VglslDefineNode* vglsl_node_assoc(const VglslDefineNode* node, VglslDefine* define, int depth, bool* added) {
+    static const VglslDefineNode empty = {0};
+    if (!node) node = &empty;
     
-    if (param_count > 0) {
-        existing->params = (char**)VGLSL_MALLOC(param_count * sizeof(char*));
-        for (int i = 0; i < param_count; i++) {
-            existing->params[i] = vglsl_strdup(params[i]);
+    if (depth == VGLSL_MAP_MAX_DEPTH) {
+        int replace = -1;
+        for (int i = 0; i < node->count; i++) {
+            if (strcmp(((VglslDefine*)node->items[i])->name, define->name) == 0) replace = i;
+        }
+        VglslDefineNode* copy = vglsl_node_alloc(node->count + (replace < 0), 0);
+        if (!copy) return NULL;
+        for (int i = 0; i < node->count; i++) {
+            copy->items[i] = (i == replace) ? define : node->items[i];
+            if (i != replace) vglsl_define_retain((VglslDefine*)node->items[i]);
         }
+        if (replace < 0) copy->items[node->count] = define;
+        *added = (replace < 0);
+        return copy;
+    }
+    
+    int slot = vglsl_node_slot(define->hash, depth);
+    uint32_t bit = 1u << slot;
+    uint32_t below = bit - 1;
+    
+    if (node->leaf_map & bit) {
+        VglslDefine* existing = (VglslDefine*)node->items[vglsl_popcount32(node->leaf_map & below)];
+        if (strcmp(existing->name, define->name) == 0) {
+            *added = false;
+            return vglsl_node_with_slot(node, slot, define, NULL);
+        }
+        
+        /* Two names in one slot - push both one level down */
+        vglsl_define_retain(existing);
+        VglslDefineNode* pair = vglsl_node_assoc(NULL, existing, depth + 1, added);
+        VglslDefineNode* child = pair ? vglsl_node_assoc(pair, define, depth + 1, added) : NULL;
+        vglsl_node_release(pair);
+        if (!pair) vglsl_define_release(existing);
+        if (!child) return NULL;
+        VglslDefineNode* copy = vglsl_node_with_slot(node, slot, NULL, child);
+        if (!copy) vglsl_node_release(child);
+        return copy;
+    }
+    
+    if (node->child_map & bit) {
+        const VglslDefineNode* old = (const VglslDefineNode*)node->items[node->leaf_count + vglsl_popcount32(node->child_map & below)];
+        VglslDefineNode* child = vglsl_node_assoc(old, define, depth + 1, added);
+        if (!child) return NULL;
+        VglslDefineNode* copy = vglsl_node_with_slot(node, slot, NULL, child);
+        if (!copy) vglsl_node_release(child);
+        return copy;
+    }
+    
+    *added = true;
+    return vglsl_node_with_slot(node, slot, define, NULL);
+}
+
+/* New trie without name, or node itself (unretained) if name is absent.
+ * Sets *removed; a NULL result with *removed set is the empty trie. */
+static VglslDefineNode* vglsl_node_dissoc(const VglslDefineNode* node, uint64_t hash, const char* name,
+                                          int depth, bool* removed, bool* failed) {
+    *removed = false;
+    if (!node) return NULL;
+    
+    if (depth == VGLSL_MAP_MAX_DEPTH) {
+        int remove = -1;
+        for (int i = 0; i < node->count; i++) {
+            if (strcmp(((VglslDefine*)node->items[i])->name, name) == 0) remove = i;
+        }
+        if (remove < 0) return (VglslDefineNode*)node;
+        *removed = true;
+        if (node->count == 1) return NULL;
+        
+        VglslDefineNode* copy = vglsl_node_alloc(node->count - 1, 0);
+        if (!copy) {
+            *failed = true;
+            return NULL;
+        }
+        for (int i = 0, j = 0; i < node->count; i++) {
+            if (i == remove) continue;
+            vglsl_define_retain((VglslDefine*)node->items[i]);
+            copy->items[j++] = node->items[i];
+        }
+        return copy;
+    }
+    
+    int slot = vglsl_node_slot(hash, depth);
+    uint32_t bit = 1u << slot;
+    uint32_t below = bit - 1;
+    VglslDefineNode* child = NULL;
+    
+    if (node->leaf_map & bit) {
+        VglslDefine* existing = (VglslDefine*)node->items[vglsl_popcount32(node->leaf_map & below)];
+        if (strcmp(existing->name, name) != 0) return (VglslDefineNode*)node;
+    } else if (node->child_map & bit) {
+        const VglslDefineNode* old = (const VglslDefineNode*)node->items[node->leaf_count + vglsl_popcount32(node->child_map & below)];
+        child = vglsl_node_dissoc(old, hash, name, depth + 1, removed, failed);
+        if (!*removed) return (VglslDefineNode*)node;
+        if (*failed) return NULL;
     } else {
-        existing->params = NULL;
+        return (VglslDefineNode*)node;
+    }
+    
+    *removed = true;
+    if (!child && node->count == 1) return NULL;
+    VglslDefineNode* copy = vglsl_node_with_slot(node, slot, NULL, child);
+    if (!copy) {
+        vglsl_node_release(child);
+        *failed = true;
+    }
+    return copy;
+}
+
+static VglslDefine* vglsl_define_create(const char* name, size_t name_len, const char* value,
+                                        char* const* params, int param_count, bool is_function) {
+    VglslDefine* define = (VglslDefine*)VGLSL_MALLOC(sizeof(VglslDefine));
+    if (!define) return NULL;
+    memset(define, 0, sizeof(VglslDefine));
+    define->refs = 1;
+    define->is_function_macro = is_function;
+    define->name = (char*)VGLSL_MALLOC(name_len + 1);
+    define->value = vglsl_strdup(value ? value : "");
+    if (define->name) {
+        memcpy(define->name, name, name_len);
+        define->name[name_len] = '\0';
+        define->hash = vglsl_hash(name, name_len);
+    }
+    if (param_count > 0) {
+        define->params = (char**)VGLSL_MALLOC(param_count * sizeof(char*));
+        for (int i = 0; define->params && i < param_count; i++) {
+            define->params[i] = vglsl_strdup(params[i]);
+            define->param_count++;
+            if (!define->params[i]) break;
+        }
     }
     
+    if (!define->name || !define->value || define->param_count != param_count) {
+        vglsl_define_release(define);
+        return NULL;
+    }
+    return define;
+}
+
+/* Set a define in map, replacing the root; takes the define reference */
+static bool vglsl_map_set(VglslDefineMap* map, VglslDefine* define) {
+    bool added = false;
+    VglslDefineNode* root = vglsl_node_assoc(map->root, define, 0, &added);
+    if (!root) {
+        vglsl_define_release(define);
+        return false;
+    }
+    vglsl_node_release(map->root);
+    map->root = root;
+    if (added) map->count++;
+    return true;
+}
+
+static bool vglsl_map_remove(VglslDefineMap* map, const char* name) {
+    bool removed = false;
+    bool failed = false;
+    VglslDefineNode* root = vglsl_node_dissoc(map->root, vglsl_hash(name, strlen(name)), name, 0, &removed, &failed);
+    if (failed) return false;
+    if (removed) {
+        vglsl_node_release(map->root);
+        map->root = root;
+        map->count--;
+    }
+    return true;
+}
+
+/* Call fn for every define in the trie */
+static bool vglsl_map_each(const VglslDefineNode* node, bool (*fn)(const VglslDefine*, void*), void* user_data) {
+    if (!node) return true;
+    for (int i = 0; i < node->count; i++) {
+        if (i < node->leaf_count ? !fn((const VglslDefine*)node->items[i], user_data)
+                                 : !vglsl_map_each((const VglslDefineNode*)node->items[i], fn, user_data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Find define by name */
+static const VglslDefine* vglsl_find_define(VglslContext* ctx, const char* name) {
+    return vglsl_map_find(ctx->defines.root, name);
+}
+
+/* Add or update define */
+static bool vglsl_add_define(VglslContext* ctx, const char* name, const char* value, char** params, int param_count) {
+    /* NAME() has a parameter list but no parameters */
+    VglslDefine* define = vglsl_define_create(name, strlen(name), value, params, param_count, params != NULL);
+    if (!define || !vglsl_map_set(&ctx->defines, define)) {
+        vglsl_set_error(ctx, "Failed to allocate define", 0, "");
+        return false;
+    }
     return true;
 }
 
+/* Add a "NAME" or "NAME=VALUE" define from the config */
+static bool vglsl_add_config_define(VglslContext* ctx, const char* entry) {
+    const char* equals = strchr(entry, '=');
+    size_t name_len = equals ? (size_t)(equals - entry) : strlen(entry);
+    
+    char name[256];
+    if (name_len == 0 || name_len >= sizeof(name)) {
+        vglsl_set_error(ctx, "Invalid predefined macro", 0, entry);
+        return false;
+    }
+    memcpy(name, entry, name_len);
+    name[name_len] = '\0';
+    vglsl_trim_whitespace(name);
+    
+    return vglsl_add_define(ctx, name, equals ? equals + 1 : "", NULL, 0);
+}
+
 /* Remove define */
 static void vglsl_remove_define(VglslContext* ctx, const char* name) {
-    for (int i = 0; i < ctx->define_count; i++) {
-        if (strcmp(ctx->defines[i].name, name) == 0) {
-            /* Free memory */
-            VGLSL_FREE(ctx->defines[i].name);
-            VGLSL_FREE(ctx->defines[i].value);
-            if (ctx->defines[i].params) {
-                for (int j = 0; j < ctx->defines[i].param_count; j++) {
-                    VGLSL_FREE(ctx->defines[i].params[j]);
-                }
-                VGLSL_FREE(ctx->defines[i].params);
-            }
-            
-            /* Shift remaining defines */
-            memmove(&ctx->defines[i], &ctx->defines[i + 1], 
-                    (ctx->define_count - i - 1) * sizeof(VglslDefine));
-            ctx->define_count--;
-            break;
-        }
+    if (!vglsl_map_remove(&ctx->defines, name)) {
+        vglsl_set_error(ctx, "Failed to allocate define", 0, "");
     }
 }
 
@@ -390,51 +1704,164 @@ static void vglsl_remove_comments(char* line) {
     }
 }
 
-/* Expand macros in text */
-static bool vglsl_expand_macros(VglslContext* ctx, const char* input, char* output, size_t output_size) {
+/* Substitute the arguments of a function macro call into its body */
+static bool vglsl_substitute_params(const VglslDefine* define, char** args, char* output, size_t output_size) {
+    const char* src = define->value;
+    char* dst = output;
+    size_t remaining = output_size - 1;
+    
+    while (*src) {
+        const char* text = src;
+        size_t length = 1;
+        if (vglsl_is_ident_start(*src)) {
+            while (vglsl_is_ident_char(src[length])) length++;
+            for (int i = 0; i < define->param_count; i++) {
+                if (strlen(define->params[i]) == length && memcmp(define->params[i], src, length) == 0) {
+                    text = args[i];
+                    break;
+                }
+            }
+        }
+        
+        size_t text_len = (text == src) ? length : strlen(text);
+        if (text_len > remaining) return false;
+        memcpy(dst, text, text_len);
+        dst += text_len;
+        remaining -= text_len;
+        src += length;
+    }
+    
+    *dst = '\0';
+    return true;
+}
+
+/* Macros being expanded, innermost first - not expanded again inside
+ * their own replacement, as in C */
+typedef struct VglslExpansion {
+    const VglslDefine* define;
+    const struct VglslExpansion* outer;
+} VglslExpansion;
+
+static bool vglsl_expansion_disabled(const VglslExpansion* expansion, const VglslDefine* define) {
+    for (; expansion; expansion = expansion->outer) {
+        if (expansion->define == define) return true;
+    }
+    return false;
+}
+
+/* Expand macros, rescanning each replacement up to VGLSL_MAX_MACRO_DEPTH.
+ * Arguments are expanded before they are substituted. */
+static bool vglsl_expand_macros_at(VglslContext* ctx, const char* input, char* output, size_t output_size,
+                                   int depth, const VglslExpansion* disabled) {
     const char* src = input;
     char* dst = output;
     size_t remaining = output_size - 1;
     
     while (*src && remaining > 0) {
-        if ((*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') || *src == '_') {
+        if (vglsl_is_ident_start(*src)) {
             /* Potential identifier */
             const char* id_start = src;
-            while ((*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') || 
-                   (*src >= '0' && *src <= '9') || *src == '_') {
+            while (vglsl_is_ident_char(*src)) {
                 src++;
             }
             
             size_t id_len = src - id_start;
             char identifier[256];
-            if (id_len < sizeof(identifier)) {
-                memcpy(identifier, id_start, id_len);
-                identifier[id_len] = '\0';
+            if (id_len >= sizeof(identifier)) {
+                return false; /* Identifier too long */
+            }
+            memcpy(identifier, id_start, id_len);
+            identifier[id_len] = '\0';
+            
+            const VglslDefine* define = depth < VGLSL_MAX_MACRO_DEPTH ? vglsl_find_define(ctx, identifier) : NULL;
+            if (define && vglsl_expansion_disabled(disabled, define)) define = NULL;
+            const char* call_end = NULL;
+            if (define && define->is_function_macro) {
+                /* Only a call when followed by a complete argument list on this line */
+                const char* open = src;
+                while (*open == ' ' || *open == '\t') open++;
+                if (*open == '(') {
+                    int nesting = 0;
+                    for (call_end = open; *call_end; call_end++) {
+                        if (*call_end == '(') nesting++;
+                        else if (*call_end == ')' && --nesting == 0) break;
+                    }
+                    if (*call_end != ')') call_end = NULL;
+                }
+                if (!call_end) define = NULL;
+            }
+            
+            if (!define) {
+                /* Copy identifier as-is */
+                if (id_len > remaining) return false;
+                memcpy(dst, id_start, id_len);
+                dst += id_len;
+                remaining -= id_len;
+                continue;
+            }
+            
+            const char* body = define->value;
+            char* substituted = NULL;
+            if (define->is_function_macro) {
+                /* Arguments split at top-level commas, in one scratch copy
+                 * after the replacement and the expanded arguments */
+                const char* open = strchr(src, '(');
+                size_t args_len = (size_t)(call_end - open - 1);
+                substituted = (char*)VGLSL_MALLOC(2 * VGLSL_MAX_LINE_LENGTH + args_len + 1);
+                if (!substituted) return false;
+                char* expanded = substituted + VGLSL_MAX_LINE_LENGTH;
+                char* arg_text = substituted + 2 * VGLSL_MAX_LINE_LENGTH;
+                memcpy(arg_text, open + 1, args_len);
+                arg_text[args_len] = '\0';
                 
-                VglslDefine* define = vglsl_find_define(ctx, identifier);
-                if (define && !define->is_function_macro) {
-                    /* Simple macro substitution */
-                    size_t value_len = strlen(define->value);
-                    if (value_len <= remaining) {
-                        strcpy(dst, define->value);
-                        dst += value_len;
-                        remaining -= value_len;
-                    } else {
-                        return false; /* Output buffer too small */
+                char* args[VGLSL_MAX_MACRO_PARAMS];
+                int arg_count = 0;
+                int nesting = 0;
+                args[arg_count++] = arg_text;
+                for (char* p = arg_text; *p; p++) {
+                    if (*p == '(') nesting++;
+                    else if (*p == ')') nesting--;
+                    else if (*p == ',' && nesting == 0) {
+                        if (arg_count >= VGLSL_MAX_MACRO_PARAMS) break;
+                        *p = '\0';
+                        args[arg_count++] = p + 1;
                     }
-                } else {
-                    /* Copy identifier as-is */
-                    if (id_len <= remaining) {
-                        memcpy(dst, id_start, id_len);
-                        dst += id_len;
-                        remaining -= id_len;
-                    } else {
+                }
+                for (int i = 0; i < arg_count; i++) {
+                    vglsl_trim_whitespace(args[i]);
+                }
+                if (define->param_count == 0 && arg_count == 1 && args[0][0] == '\0') arg_count = 0;
+                
+                size_t expanded_used = 0;
+                for (int i = 0; i < arg_count && i < define->param_count; i++) {
+                    char* arg = expanded + expanded_used;
+                    if (expanded_used + 1 >= VGLSL_MAX_LINE_LENGTH ||
+                        !vglsl_expand_macros_at(ctx, args[i], arg, VGLSL_MAX_LINE_LENGTH - expanded_used,
+                                                depth + 1, disabled)) {
+                        VGLSL_FREE(substituted);
                         return false;
                     }
+                    args[i] = arg;
+                    expanded_used += strlen(arg) + 1;
                 }
-            } else {
-                return false; /* Identifier too long */
+                
+                if (arg_count != define->param_count ||
+                    !vglsl_substitute_params(define, args, substituted, VGLSL_MAX_LINE_LENGTH)) {
+                    VGLSL_FREE(substituted);
+                    return false;
+                }
+                body = substituted;
+                src = call_end + 1;
             }
+            
+            /* Rescan the replacement for further macros, except this one */
+            VglslExpansion expansion = { define, disabled };
+            bool ok = vglsl_expand_macros_at(ctx, body, dst, remaining + 1, depth + 1, &expansion);
+            VGLSL_FREE(substituted);
+            if (!ok) return false;
+            size_t value_len = strlen(dst);
+            dst += value_len;
+            remaining -= value_len;
         } else {
             /* Copy character as-is */
             *dst++ = *src++;
@@ -446,512 +1873,5105 @@ static bool vglsl_expand_macros(VglslContext* ctx, const char* input, char* outp
     return true;
 }
 
-/* Process #include directive */
-static bool vglsl_process_include(VglslContext* ctx, const char* directive, int line_num, const char* filename) {
-    if (ctx->include_depth >= ctx->config->max_include_depth) {
-        vglsl_set_error(ctx, "Maximum include depth exceeded", line_num, filename);
-        return false;
-    }
-    
-    /* Extract filename from #include "filename" or #include <filename> */
-    const char* quote_start = strchr(directive, '"');
-    const char* angle_start = strchr(directive, '<');
-    const char* start = NULL;
-    char end_char = 0;
-    bool is_angle_include = false;
+/* Expand macros in text */
+static bool vglsl_expand_macros(VglslContext* ctx, const char* input, char* output, size_t output_size) {
+    return vglsl_expand_macros_at(ctx, input, output, output_size, 0, NULL);
+}
+
+/* Normalize a path lexically into out, which needs strlen(path) + 2 bytes:
+ * empty and "." segments go, ".." removes the segment before it */
+static void vglsl_normalize_path(const char* path, char* out) {
+    bool absolute = path[0] == '/';
+    char* base = absolute ? out + 1 : out;
+    char* end = base;
+    if (absolute) out[0] = '/';
     
-    if (quote_start && (!angle_start || quote_start < angle_start)) {
-        start = quote_start + 1;
-        end_char = '"';
-        is_angle_include = false;
-    } else if (angle_start) {
-        start = angle_start + 1;
-        end_char = '>';
-        is_angle_include = true;
+    while (*path) {
+        while (*path == '/') path++;
+        size_t length = strcspn(path, "/");
+        if (length == 0) break;
+        
+        if (length == 1 && path[0] == '.') {
+            /* Nothing */
+        } else if (length == 2 && path[0] == '.' && path[1] == '.' && end > base &&
+                   !(end - base >= 2 && end[-1] == '.' && end[-2] == '.' && (end - base == 2 || end[-3] == '/'))) {
+            while (end > base && end[-1] != '/') end--;
+            if (end > base) end--;
+        } else if (!(length == 2 && path[0] == '.' && path[1] == '.' && absolute)) {
+            if (end > base) *end++ = '/';
+            memcpy(end, path, length);
+            end += length;
+        }
+        path += length;
     }
     
-    if (!start) {
-        vglsl_set_error(ctx, "Invalid include directive", line_num, filename);
-        return false;
+    if (end == out) *end++ = '.';
+    *end = '\0';
+}
+
+static size_t vglsl_file_slot(const VglslFileEntry* table, int capacity, const char* path) {
+    size_t mask = (size_t)capacity - 1;
+    size_t slot = (size_t)vglsl_hash(path, strlen(path)) & mask;
+    while (table[slot].path && strcmp(table[slot].path, path) != 0) slot = (slot + 1) & mask;
+    return slot;
+}
+
+/* Identity of a path, worked out the first time the parse sees it; NULL
+ * without memory. Entries move when the table grows. */
+static VglslFileEntry* vglsl_file_entry(VglslContext* ctx, const char* path) {
+    if (!path) path = "";
+    if ((ctx->file_count + 1) * 2 > ctx->file_capacity) {
+        int capacity = ctx->file_capacity ? ctx->file_capacity * 2 : 32;
+        VglslFileEntry* table = (VglslFileEntry*)VGLSL_MALLOC(capacity * sizeof(VglslFileEntry));
+        if (!table) return NULL;
+        memset(table, 0, capacity * sizeof(VglslFileEntry));
+        for (int i = 0; i < ctx->file_capacity; i++) {
+            if (ctx->file_table[i].path) {
+                table[vglsl_file_slot(table, capacity, ctx->file_table[i].path)] = ctx->file_table[i];
+            }
+        }
+        VGLSL_FREE(ctx->file_table);
+        ctx->file_table = table;
+        ctx->file_capacity = capacity;
     }
     
-    const char* end = strchr(start, end_char);
-    if (!end) {
-        vglsl_set_error(ctx, "Unterminated include filename", line_num, filename);
-        return false;
+    VglslFileEntry* file = &ctx->file_table[vglsl_file_slot(ctx->file_table, ctx->file_capacity, path)];
+    if (file->path) return file;
+    
+    char* copy = vglsl_strdup(path);
+    char* canonical = (char*)VGLSL_MALLOC(strlen(path) + 2);
+    if (!copy || !canonical) {
+        VGLSL_FREE(copy);
+        VGLSL_FREE(canonical);
+        return NULL;
     }
+    vglsl_normalize_path(path, canonical);
     
-    size_t filename_len = end - start;
-    char include_filename[512];
-    if (filename_len >= sizeof(include_filename)) {
-        vglsl_set_error(ctx, "Include filename too long", line_num, filename);
+    file->path = copy;
+    file->canonical = canonical;
+    if (!vglsl_file_id(path, &file->id)) memset(&file->id, 0, sizeof(file->id));
+    file->listed = false;
+    ctx->file_count++;
+    return file;
+}
+
+/* Same file by device and inode where both are known, else by normalized path */
+static bool vglsl_same_file(const char* path, VglslFileId id, const char* other_path, VglslFileId other_id) {
+    if (id.inode && other_id.inode) return id.device == other_id.device && id.inode == other_id.inode;
+    return strcmp(path, other_path) == 0;
+}
+
+/* Record a file not to include again; takes ownership of guard */
+static bool vglsl_add_once(VglslContext* ctx, const char* path, char* guard) {
+    VglslFileEntry* file = vglsl_file_entry(ctx, path);
+    if (!file) {
+        VGLSL_FREE(guard);
+        vglsl_set_error(ctx, "Failed to allocate include table", 0, "");
         return false;
     }
     
-    memcpy(include_filename, start, filename_len);
-    include_filename[filename_len] = '\0';
-    
-    /* Build full path */
-    char full_path[1024];
-    
-    /* Handle angle bracket includes with virtual paths */
-    if (is_angle_include) {
-        const char* resolved_virtual = vglsl_resolve_virtual_path(include_filename);
-        if (resolved_virtual) {
-            strcpy(full_path, resolved_virtual);
-        } else {
-            /* Fallback to base_path for angle includes without virtual mapping */
-            if (ctx->config->base_path) {
-                snprintf(full_path, sizeof(full_path), "%s/%s", ctx->config->base_path, include_filename);
+    for (int i = 0; i < ctx->once_count; i++) {
+        if (vglsl_same_file(ctx->once[i].path, ctx->once[i].id, file->canonical, file->id)) {
+            /* #pragma once wins over a guard */
+            if (guard && ctx->once[i].guard) {
+                VGLSL_FREE(ctx->once[i].guard);
+                ctx->once[i].guard = guard;
             } else {
-                strcpy(full_path, include_filename);
+                VGLSL_FREE(ctx->once[i].guard);
+                ctx->once[i].guard = NULL;
+                VGLSL_FREE(guard);
             }
+            return true;
         }
-    } else {
-        /* Handle quoted includes normally with base_path */
-        if (ctx->config->base_path) {
-            snprintf(full_path, sizeof(full_path), "%s/%s", ctx->config->base_path, include_filename);
-        } else {
-            strcpy(full_path, include_filename);
+    }
+    
+    if (ctx->once_count >= ctx->once_capacity) {
+        int new_capacity = ctx->once_capacity ? ctx->once_capacity * 2 : 16;
+        VglslOnceEntry* once = (VglslOnceEntry*)VGLSL_REALLOC(ctx->once, new_capacity * sizeof(VglslOnceEntry));
+        if (!once) {
+            VGLSL_FREE(guard);
+            vglsl_set_error(ctx, "Failed to allocate include table", 0, "");
+            return false;
         }
+        ctx->once = once;
+        ctx->once_capacity = new_capacity;
     }
     
-    /* Read and process included file */
-    char* include_content = vglsl_read_file(full_path);
-    if (!include_content) {
-        char error_msg[512];
-        snprintf(error_msg, sizeof(error_msg), "Failed to read include file: %s", full_path);
-        vglsl_set_error(ctx, error_msg, line_num, filename);
+    char* copy = vglsl_strdup(file->canonical);
+    if (!copy) {
+        VGLSL_FREE(guard);
+        vglsl_set_error(ctx, "Failed to allocate include table", 0, "");
         return false;
     }
-    
-    ctx->include_depth++;
-    
-    /* Add line directive if requested */
-    if (ctx->config->preserve_lines) {
-        char line_directive[256];
-        snprintf(line_directive, sizeof(line_directive), "#line 1 \"%s\"\n", full_path);
-        vglsl_append_output(ctx, line_directive);
+    ctx->once[ctx->once_count].path = copy;
+    ctx->once[ctx->once_count].id = file->id;
+    ctx->once[ctx->once_count].guard = guard;
+    ctx->once_count++;
+    return true;
+}
+
+static bool vglsl_once_skips(VglslContext* ctx, const VglslOnceEntry* once, int count, const VglslFileEntry* file) {
+    for (int i = 0; i < count; i++) {
+        if (vglsl_same_file(once[i].path, once[i].id, file->canonical, file->id)) {
+            return !once[i].guard || vglsl_find_define(ctx, once[i].guard) != NULL;
+        }
     }
+    return false;
+}
+
+/* Whether an #include of a file can be skipped entirely */
+static bool vglsl_include_skipped(VglslContext* ctx, const VglslFileEntry* file) {
+    const VglslSnapshot* snapshot = ctx->config->snapshot;
+    return vglsl_once_skips(ctx, ctx->once, ctx->once_count, file) ||
+           (snapshot && vglsl_once_skips(ctx, snapshot->once, snapshot->once_count, file));
+}
+
+/* Follow the include guard pattern over the significant lines of a file */
+static void vglsl_track_guard(VglslContext* ctx, const char* line) {
+    if (line[0] == '\0' || ctx->frame_count == 0) return;
+    VglslIncludeFrame* frame = &ctx->frames[ctx->frame_count - 1];
+    if (frame->guard_state == VGLSL_GUARD_NONE) return;
     
-    /* Process included file line by line */
-    char* line_start = include_content;
-    int include_line_num = 1;
-    bool success = true;
+    const char* directive = NULL;
+    if (line[0] == '#') {
+        directive = line + 1;
+        while (*directive == ' ' || *directive == '\t') directive++;
+    }
     
-    while (*line_start && success) {
-        char* line_end = strchr(line_start, '\n');
-        size_t line_length;
-        
-        if (line_end) {
-            line_length = line_end - line_start;
-        } else {
-            line_length = strlen(line_start);
-        }
-        
-        char line_buffer[VGLSL_MAX_LINE_LENGTH];
-        if (line_length < sizeof(line_buffer)) {
-            memcpy(line_buffer, line_start, line_length);
-            line_buffer[line_length] = '\0';
+    switch (frame->guard_state) {
+    case VGLSL_GUARD_START:
+        frame->guard_state = VGLSL_GUARD_NONE;
+        if (directive && vglsl_starts_with(directive, "ifndef") && (directive[6] == ' ' || directive[6] == '\t')) {
+            const char* name = directive + 6;
+            while (*name == ' ' || *name == '\t') name++;
+            size_t length = 0;
+            while (vglsl_is_ident_char(name[length])) length++;
+            if (length == 0) return;
             
-            success = vglsl_process_line(ctx, line_buffer, include_line_num, full_path);
+            frame->guard = (char*)VGLSL_MALLOC(length + 1);
+            if (!frame->guard) return;
+            memcpy(frame->guard, name, length);
+            frame->guard[length] = '\0';
+            frame->guard_state = VGLSL_GUARD_OPEN;
+            frame->guard_depth = ctx->if_depth + 1;
         }
-        
-        if (line_end) {
-            line_start = line_end + 1;
-        } else {
-            break;
+        break;
+    case VGLSL_GUARD_OPEN:
+        /* Checked before the directive runs, so if_depth is still the guard's */
+        if (directive && ctx->if_depth == frame->guard_depth) {
+            if (vglsl_starts_with(directive, "endif")) frame->guard_state = VGLSL_GUARD_CLOSED;
+            else if (vglsl_starts_with(directive, "else")) frame->guard_state = VGLSL_GUARD_NONE;
+        }
+        break;
+    default:
+        frame->guard_state = VGLSL_GUARD_NONE;
+        break;
+    }
+}
+
+/* Push a source on the include stack; takes ownership of the source */
+static bool vglsl_push_frame(VglslContext* ctx, VglslSource* source, const char* filename,
+                             const char* parent_filename, int include_line) {
+    if (ctx->frame_count >= ctx->frame_capacity) {
+        int new_capacity = ctx->frame_capacity ? ctx->frame_capacity * 2 : 8;
+        VglslIncludeFrame* new_frames = (VglslIncludeFrame*)VGLSL_REALLOC(ctx->frames, new_capacity * sizeof(VglslIncludeFrame));
+        if (!new_frames) {
+            vglsl_source_close(source);
+            vglsl_set_error(ctx, "Failed to allocate include frame", include_line, parent_filename);
+            return false;
         }
-        include_line_num++;
+        ctx->frames = new_frames;
+        ctx->frame_capacity = new_capacity;
     }
     
-    ctx->include_depth--;
+    VglslIncludeFrame* frame = &ctx->frames[ctx->frame_count++];
+    frame->source = *source;
+    frame->filename = vglsl_strdup(filename);
+    frame->directory = NULL;
+    const char* slash = filename ? strrchr(filename, '/') : NULL;
+    if (slash) {
+        size_t length = slash == filename ? 1 : (size_t)(slash - filename);
+        frame->directory = (char*)VGLSL_MALLOC(length + 1);
+        if (frame->directory) {
+            memcpy(frame->directory, filename, length);
+            frame->directory[length] = '\0';
+        }
+    }
+    frame->parent_filename = parent_filename;
+    frame->line_num = 1;
+    frame->include_line = include_line;
+    frame->guard_state = VGLSL_GUARD_START;
+    frame->guard_depth = 0;
+    frame->guard = NULL;
+    ctx->include_depth = ctx->frame_count - 1;
+    return true;
+}
+
+/* Pop the innermost include frame */
+static void vglsl_pop_frame(VglslContext* ctx) {
+    VglslIncludeFrame* frame = &ctx->frames[--ctx->frame_count];
+    ctx->include_depth = ctx->frame_count > 0 ? ctx->frame_count - 1 : 0;
     
     /* Restore line directive if requested */
-    if (ctx->config->preserve_lines && success) {
+    if (ctx->config->preserve_lines && frame->parent_filename && !ctx->has_error) {
         char line_directive[256];
-        snprintf(line_directive, sizeof(line_directive), "#line %d \"%s\"\n", line_num + 1, filename);
+        snprintf(line_directive, sizeof(line_directive), "#line %d \"%s\"\n", frame->include_line + 1, frame->parent_filename);
         vglsl_append_output(ctx, line_directive);
     }
     
-    VGLSL_FREE(include_content);
-    return success;
+    /* Guarded files are skipped from now on while the guard is defined */
+    if (frame->guard_state == VGLSL_GUARD_CLOSED && !ctx->has_error) {
+        vglsl_add_once(ctx, frame->filename, frame->guard);
+        frame->guard = NULL;
+    }
+    
+    vglsl_release_source(ctx, &frame->source);
+    VGLSL_FREE(frame->filename);
+    VGLSL_FREE(frame->directory);
+    VGLSL_FREE(frame->guard);
 }
 
-/* Process preprocessor directive */
-static bool vglsl_process_directive(VglslContext* ctx, const char* line, int line_num, const char* filename) {
-    char directive[VGLSL_MAX_LINE_LENGTH];
-    strcpy(directive, line + 1); /* Skip # */
-    vglsl_trim_whitespace(directive);
-    
-    if (vglsl_starts_with(directive, "include")) {
-        return vglsl_process_include(ctx, directive, line_num, filename);
-    } else if (vglsl_starts_with(directive, "define")) {
-        /* Parse #define NAME [VALUE] */
-        char* name_start = directive + 6; /* Skip "define" */
-        while (*name_start == ' ' || *name_start == '\t') name_start++;
+/* Driver loop - feeds lines of the innermost frame to vglsl_process_line.
+ * A #include only pushes a frame, so nesting never recurses. The root frame
+ * is left on the stack once exhausted so its final line number stays known. */
+static bool vglsl_run(VglslContext* ctx) {
+    while (ctx->frame_count > 0 && !ctx->has_error) {
+        VglslIncludeFrame* frame = &ctx->frames[ctx->frame_count - 1];
+        const char* line;
+        size_t line_length;
         
-        char* name_end = name_start;
-        while (*name_end && *name_end != ' ' && *name_end != '\t' && *name_end != '(') name_end++;
+        if (!vglsl_source_next_line(&frame->source, &line, &line_length,
+                                    ctx->line_buffer, VGLSL_MAX_LINE_LENGTH)) {
+            if (ctx->frame_count == 1) break;
+            vglsl_pop_frame(ctx);
+            continue;
+        }
         
-        if (name_end == name_start) {
-            vglsl_set_error(ctx, "Invalid define directive", line_num, filename);
+        int line_num = frame->line_num++;
+        if (line_length >= VGLSL_MAX_LINE_LENGTH) {
+            vglsl_set_error(ctx, "Line too long", line_num, frame->filename);
             return false;
         }
         
-        char name[256];
-        size_t name_len = name_end - name_start;
-        if (name_len >= sizeof(name)) {
-            vglsl_set_error(ctx, "Define name too long", line_num, filename);
+        /* Lines joined across pieces are already in the line buffer and
+         * have no single raw slice to reference */
+        if (line == ctx->line_buffer) {
+            ctx->raw_line = NULL;
+            ctx->raw_length = 0;
+            ctx->raw_has_newline = false;
+        } else {
+            memcpy(ctx->line_buffer, line, line_length);
+            ctx->line_buffer[line_length] = '\0';
+            ctx->raw_line = line;
+            ctx->raw_length = line_length;
+            ctx->raw_has_newline = line + line_length < frame->source.data + frame->source.size;
+        }
+        
+        /* May push a frame and reallocate ctx->frames */
+        if (!vglsl_process_line(ctx, ctx->line_buffer, line_num, frame->filename)) return false;
+    }
+    return !ctx->has_error;
+}
+
+/* Include resolution cache. Keys are parts[] (NULL reads as "") plus the
+ * loader, which may serve paths the disk does not have. */
+#define VGLSL_RESOLVE_PARTS 4
+
+static uint64_t vglsl_resolve_hash(const VglslConfig* config, const char* const* parts, uint64_t search) {
+    VglslHash hash;
+    vglsl_hash_init(&hash);
+    for (int i = 0; i < VGLSL_RESOLVE_PARTS; i++) vglsl_hash_string(&hash, parts[i]);
+    vglsl_hash_update(&hash, &search, sizeof(search));
+    vglsl_hash_update(&hash, &config->load_file, sizeof(config->load_file));
+    vglsl_hash_update(&hash, &config->load_user_data, sizeof(config->load_user_data));
+    
+    /* 0 marks an empty slot */
+    uint64_t key = vglsl_hash_digest(&hash);
+    return key ? key : 1;
+}
+
+static bool vglsl_resolve_matches(const VglslResolveEntry* entry, const VglslConfig* config,
+                                  const char* const* parts, uint64_t search) {
+    if (entry->search != search) return false;
+    if (entry->load_file != config->load_file || entry->load_user_data != config->load_user_data) return false;
+    
+    const char* pos = entry->key;
+    size_t left = entry->key_length;
+    for (int i = 0; i < VGLSL_RESOLVE_PARTS; i++) {
+        const char* part = parts[i] ? parts[i] : "";
+        size_t length = strlen(part) + 1;
+        if (length > left || memcmp(pos, part, length) != 0) return false;
+        pos += length;
+        left -= length;
+    }
+    return left == 0;
+}
+
+static size_t vglsl_resolve_slot(const VglslIncludeCache* cache, uint64_t hash, const VglslConfig* config,
+                                 const char* const* parts, uint64_t search) {
+    size_t mask = (size_t)cache->capacity - 1;
+    size_t slot = (size_t)hash & mask;
+    while (cache->entries[slot].hash &&
+           !(cache->entries[slot].hash == hash && vglsl_resolve_matches(&cache->entries[slot], config, parts, search))) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/* Entry resolved under the current virtual paths, or NULL */
+static VglslResolveEntry* vglsl_resolve_find(VglslIncludeCache* cache, uint64_t hash, const VglslConfig* config,
+                                             const char* const* parts, uint64_t search) {
+    if (cache->capacity == 0) return NULL;
+    VglslResolveEntry* entry = &cache->entries[vglsl_resolve_slot(cache, hash, config, parts, search)];
+    return entry->hash && !entry->stale && entry->generation == g_virtual_generation ? entry : NULL;
+}
+
+/* Remember where an include resolved to. Running out of memory only
+ * loses the entry. */
+static void vglsl_resolve_put(VglslIncludeCache* cache, uint64_t hash, const VglslConfig* config,
+                              const char* const* parts, uint64_t search, const char* path, bool found) {
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 64;
+        VglslResolveEntry* entries = (VglslResolveEntry*)VGLSL_MALLOC(capacity * sizeof(VglslResolveEntry));
+        if (!entries) return;
+        memset(entries, 0, capacity * sizeof(VglslResolveEntry));
+        
+        size_t mask = (size_t)capacity - 1;
+        for (int i = 0; i < cache->capacity; i++) {
+            if (!cache->entries[i].hash) continue;
+            size_t slot = (size_t)cache->entries[i].hash & mask;
+            while (entries[slot].hash) slot = (slot + 1) & mask;
+            entries[slot] = cache->entries[i];
+        }
+        VGLSL_FREE(cache->entries);
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    
+    VglslResolveEntry* entry = &cache->entries[vglsl_resolve_slot(cache, hash, config, parts, search)];
+    char* copy = vglsl_strdup(path);
+    if (!copy) return;
+    
+    if (!entry->hash) {
+        size_t length = 0;
+        for (int i = 0; i < VGLSL_RESOLVE_PARTS; i++) length += strlen(parts[i] ? parts[i] : "") + 1;
+        char* key = (char*)VGLSL_MALLOC(length);
+        if (!key) {
+            VGLSL_FREE(copy);
+            return;
+        }
+        char* pos = key;
+        for (int i = 0; i < VGLSL_RESOLVE_PARTS; i++) {
+            const char* part = parts[i] ? parts[i] : "";
+            size_t part_length = strlen(part) + 1;
+            memcpy(pos, part, part_length);
+            pos += part_length;
+        }
+        
+        entry->hash = hash;
+        entry->key = key;
+        entry->key_length = length;
+        entry->search = search;
+        entry->load_file = config->load_file;
+        entry->load_user_data = config->load_user_data;
+        cache->count++;
+    }
+    
+    VGLSL_FREE(entry->path);
+    entry->path = copy;
+    entry->found = found;
+    entry->stale = false;
+    entry->generation = g_virtual_generation;
+}
+
+static void vglsl_resolve_clear(VglslIncludeCache* cache) {
+    for (int i = 0; i < cache->capacity; i++) {
+        VGLSL_FREE(cache->entries[i].key);
+        VGLSL_FREE(cache->entries[i].path);
+    }
+    if (cache->capacity) memset(cache->entries, 0, cache->capacity * sizeof(VglslResolveEntry));
+    cache->count = 0;
+}
+
+/* Directory listings - include_paths are searched by name lookups in a
+ * listing of each directory, taken once and refreshed when its stamp
+ * (mtime) changes, instead of a failed open per directory */
+static void vglsl_dir_free_names(VglslDirListing* dir) {
+    for (int i = 0; i < dir->name_capacity; i++) VGLSL_FREE(dir->names[i]);
+    VGLSL_FREE(dir->names);
+    dir->names = NULL;
+    dir->name_count = 0;
+    dir->name_capacity = 0;
+}
+
+#ifdef VGLSL_HAS_MMAP
+static size_t vglsl_dir_slot(char** names, int capacity, const char* name, size_t length) {
+    size_t mask = (size_t)capacity - 1;
+    size_t slot = (size_t)vglsl_hash(name, length) & mask;
+    while (names[slot] && !(strncmp(names[slot], name, length) == 0 && names[slot][length] == '\0')) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool vglsl_dir_has_name(const VglslDirListing* dir, const char* name, size_t length) {
+    if (dir->name_capacity == 0) return false;
+    return dir->names[vglsl_dir_slot(dir->names, dir->name_capacity, name, length)] != NULL;
+}
+
+static bool vglsl_dir_add_name(VglslDirListing* dir, const char* name) {
+    if ((dir->name_count + 1) * 2 > dir->name_capacity) {
+        int capacity = dir->name_capacity ? dir->name_capacity * 2 : 32;
+        char** names = (char**)VGLSL_MALLOC(capacity * sizeof(char*));
+        if (!names) return false;
+        memset(names, 0, capacity * sizeof(char*));
+        for (int i = 0; i < dir->name_capacity; i++) {
+            if (dir->names[i]) names[vglsl_dir_slot(names, capacity, dir->names[i], strlen(dir->names[i]))] = dir->names[i];
+        }
+        VGLSL_FREE(dir->names);
+        dir->names = names;
+        dir->name_capacity = capacity;
+    }
+    
+    size_t slot = vglsl_dir_slot(dir->names, dir->name_capacity, name, strlen(name));
+    if (dir->names[slot]) return true;
+    dir->names[slot] = vglsl_strdup(name);
+    if (!dir->names[slot]) return false;
+    dir->name_count++;
+    return true;
+}
+
+/* Take a fresh listing; a directory that cannot be read lists nothing */
+static void vglsl_dir_load(VglslDirListing* dir) {
+    vglsl_dir_free_names(dir);
+    DIR* handle = opendir(dir->path);
+    if (!handle) return;
+    
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (!vglsl_dir_add_name(dir, entry->d_name)) {
+            /* Incomplete: force a reload next time */
+            dir->exists = false;
+            break;
+        }
+    }
+    closedir(handle);
+}
+
+/* Relist a directory if its stamp changed (or always with force); true
+ * if it did */
+static bool vglsl_dir_refresh(VglslDirListing* dir, bool force) {
+    /* Stamp first, so a change made while listing shows up next time */
+    VglslFileStamp stamp;
+    bool exists = vglsl_stat_file(dir->path, &stamp);
+    if (!force && exists == dir->exists &&
+        (!exists || (stamp.mtime == dir->stamp.mtime && stamp.identity == dir->stamp.identity))) {
+        return false;
+    }
+    
+    dir->exists = exists;
+    if (exists) {
+        dir->stamp = stamp;
+        vglsl_dir_load(dir);
+    } else {
+        vglsl_dir_free_names(dir);
+    }
+    return true;
+}
+
+/* Listing of a directory, taken on first use; NULL without memory */
+static VglslDirListing* vglsl_dir_listing(VglslIncludeCache* cache, const char* path, size_t length) {
+    uint64_t hash = vglsl_hash(path, length);
+    VglslDirListing* dir = NULL;
+    for (int i = 0; i < cache->dir_count; i++) {
+        if (cache->dirs[i].hash == hash && strncmp(cache->dirs[i].path, path, length) == 0 &&
+            cache->dirs[i].path[length] == '\0') {
+            dir = &cache->dirs[i];
+            break;
+        }
+    }
+    
+    if (!dir) {
+        if (cache->dir_count >= cache->dir_capacity) {
+            int new_capacity = cache->dir_capacity ? cache->dir_capacity * 2 : 8;
+            VglslDirListing* dirs = (VglslDirListing*)VGLSL_REALLOC(cache->dirs, new_capacity * sizeof(VglslDirListing));
+            if (!dirs) return NULL;
+            cache->dirs = dirs;
+            cache->dir_capacity = new_capacity;
+        }
+        char* copy = (char*)VGLSL_MALLOC(length + 1);
+        if (!copy) return NULL;
+        memcpy(copy, path, length);
+        copy[length] = '\0';
+        
+        dir = &cache->dirs[cache->dir_count++];
+        memset(dir, 0, sizeof(*dir));
+        dir->path = copy;
+        dir->hash = hash;
+        vglsl_dir_refresh(dir, true);
+    }
+    return dir;
+}
+
+/* Check every listing against its directory. A changed directory may
+ * turn earlier results either way, so resolved includes are dropped. */
+static void vglsl_include_cache_refresh(VglslIncludeCache* cache) {
+    bool changed = false;
+    for (int i = 0; i < cache->dir_count; i++) {
+        if (vglsl_dir_refresh(&cache->dirs[i], false)) changed = true;
+    }
+    if (changed) vglsl_resolve_clear(cache);
+}
+
+/* Record a directory searched by a tracked parse, with the stamp of the
+ * listing it was searched in */
+static void vglsl_file_list_dir(VglslFileList* files, const VglslDirListing* dir) {
+    for (int i = files->count - 1; i >= 0; i--) {
+        if (strcmp(files->paths[i], dir->path) == 0) return;
+    }
+    VglslFileStamp stamp;
+    if (dir->exists) {
+        stamp = dir->stamp;
+    } else {
+        memset(&stamp, 0, sizeof(stamp));
+    }
+    if (!vglsl_file_list_add(files, dir->path, &stamp)) files->unstable = true;
+}
+#endif
+
+/* Drop the source kept by the last loader probe */
+static void vglsl_probe_release(VglslContext* ctx) {
+    if (!ctx->probe_path) return;
+    vglsl_source_close(&ctx->probe);
+    VGLSL_FREE(ctx->probe_path);
+    ctx->probe_path = NULL;
+}
+
+/* Take the source the last loader probe read for path, if any */
+static bool vglsl_probe_take(VglslContext* ctx, const char* path, VglslSource* source) {
+    if (!ctx->probe_path || strcmp(ctx->probe_path, path) != 0) return false;
+    *source = ctx->probe;
+    VGLSL_FREE(ctx->probe_path);
+    ctx->probe_path = NULL;
+    return true;
+}
+
+/* Whether an include candidate exists. Loaders may serve paths the disk
+ * does not have, so with one the candidate is simply tried and what it
+ * returned is kept for the include. */
+static bool vglsl_include_exists(VglslContext* ctx, const char* path) {
+    if (ctx->config->load_file) {
+        VglslSource source;
+        if (!vglsl_source_from_file(ctx->config, path, &source)) return false;
+        vglsl_probe_release(ctx);
+        ctx->probe_path = vglsl_strdup(path);
+        if (ctx->probe_path) {
+            ctx->probe = source;
+        } else {
+            vglsl_source_close(&source);
+        }
+        return true;
+    }
+    
+#ifdef VGLSL_HAS_MMAP
+    if (!ctx->listings) {
+        ctx->listings = ctx->config->include_cache;
+        if (!ctx->listings) {
+            ctx->listings = vglsl_include_cache_create();
+            ctx->owns_listings = ctx->listings != NULL;
+        }
+    }
+    if (ctx->listings) {
+        const char* slash = strrchr(path, '/');
+        const char* name = slash ? slash + 1 : path;
+        VglslDirListing* dir = slash ? vglsl_dir_listing(ctx->listings, path, slash == path ? 1 : (size_t)(slash - path))
+                                     : vglsl_dir_listing(ctx->listings, ".", 1);
+        if (dir) {
+            if (ctx->files) vglsl_file_list_dir(ctx->files, dir);
+            return vglsl_dir_has_name(dir, name, strlen(name));
+        }
+    }
+#endif
+    if (ctx->files) ctx->files->unstable = true;
+    
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    fclose(file);
+    return true;
+}
+
+VglslIncludeCache* vglsl_include_cache_create(void) {
+    VglslIncludeCache* cache = (VglslIncludeCache*)VGLSL_MALLOC(sizeof(VglslIncludeCache));
+    if (cache) memset(cache, 0, sizeof(*cache));
+    return cache;
+}
+
+void vglsl_include_cache_clear(VglslIncludeCache* cache) {
+    if (!cache) return;
+    vglsl_resolve_clear(cache);
+    for (int i = 0; i < cache->dir_count; i++) {
+        vglsl_dir_free_names(&cache->dirs[i]);
+        VGLSL_FREE(cache->dirs[i].path);
+    }
+    cache->dir_count = 0;
+}
+
+void vglsl_include_cache_destroy(VglslIncludeCache* cache) {
+    if (!cache) return;
+    vglsl_include_cache_clear(cache);
+    VGLSL_FREE(cache->entries);
+    VGLSL_FREE(cache->dirs);
+    VGLSL_FREE(cache);
+}
+
+/* Where an include resolves to. parts and path may point into the target
+ * and into name, which must outlive it. */
+typedef struct VglslIncludeTarget {
+    const char* parts[VGLSL_RESOLVE_PARTS];
+    uint64_t key;                /* Include cache key, 0 without a cache */
+    VglslResolveEntry* resolved; /* Include cache entry, NULL on a miss */
+    const char* path;            /* resolved->path or built */
+    char built[1024];
+} VglslIncludeTarget;
+
+/* Resolve an include from the include cache, a virtual path, the including
+ * file's directory, base_path or the search paths; false if too long.
+ * Tracked parses skip the include cache to record the directories. */
+static bool vglsl_locate_include(VglslContext* ctx, const char* name, bool is_angle,
+                                 const char* directory, VglslIncludeTarget* target) {
+    VglslIncludeCache* cache = ctx->config->include_cache;
+    target->parts[0] = directory;
+    target->parts[1] = is_angle ? "<" : "\"";
+    target->parts[2] = name;
+    target->parts[3] = ctx->config->base_path;
+    target->key = cache ? vglsl_resolve_hash(ctx->config, target->parts, ctx->search_hash) : 0;
+    target->resolved = cache && !ctx->files ? vglsl_resolve_find(cache, target->key, ctx->config, target->parts, ctx->search_hash) : NULL;
+    if (target->resolved) {
+        target->path = target->resolved->path;
+        return true;
+    }
+    
+    char* built_path = target->built;
+    target->path = built_path;
+    
+    /* Handle angle bracket includes with virtual paths */
+    if (is_angle) {
+        size_t virtual_length = vglsl_resolve_virtual_path(name, built_path, sizeof(target->built));
+        if (virtual_length >= sizeof(target->built)) return false;
+        if (virtual_length > 0) return true;
+    }
+    
+    /* Quoted includes next to the including file, then relative to
+     * base_path, then in the first search path that has it */
+    if (ctx->config->base_path) {
+        snprintf(built_path, sizeof(target->built), "%s/%s", ctx->config->base_path, name);
+    } else {
+        strcpy(built_path, name);
+    }
+    
+    char candidate[1024];
+    bool found = false;
+    if (directory) {
+        snprintf(candidate, sizeof(candidate), "%s/%s", directory, name);
+        if (strcmp(candidate, built_path) != 0 && vglsl_include_exists(ctx, candidate)) {
+            strcpy(built_path, candidate);
+            found = true;
+        }
+    }
+    
+    if (!found && ctx->config->include_path_count > 0 && !vglsl_include_exists(ctx, built_path)) {
+        for (int i = 0; i < ctx->config->include_path_count; i++) {
+            snprintf(candidate, sizeof(candidate), "%s/%s", ctx->config->include_paths[i], name);
+            if (vglsl_include_exists(ctx, candidate)) {
+                strcpy(built_path, candidate);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+#ifdef VGLSL_HAS_THREADS
+/* Prefetch worker - reads queued jobs until the pool stops */
+static VGLSL_THREAD_RESULT vglsl_prefetch_worker(void* arg) {
+    VglslPrefetchPool* pool = (VglslPrefetchPool*)arg;
+    vglsl_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        VglslPrefetchJob* job = pool->head;
+        if (!job) {
+            vglsl_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        pool->head = job->next;
+        if (!pool->head) pool->tail = NULL;
+        job->next = NULL;
+        job->state = VGLSL_PREFETCH_READING;
+        vglsl_mutex_unlock(&pool->lock);
+        
+        /* The parse waits for the job before freeing it */
+        VglslFileStamp file_stamp;
+        bool stamped = job->track && vglsl_stat_file(job->path, &file_stamp);
+        size_t size = 0;
+        char* data = vglsl_read_file(job->path, &size);
+        
+        vglsl_mutex_lock(&pool->lock);
+        job->data = data;
+        job->size = size;
+        job->stamp = file_stamp;
+        job->stamped = stamped;
+        job->state = VGLSL_PREFETCH_DONE;
+        pool->reads++;
+        vglsl_cond_broadcast(&pool->done);
+    }
+    vglsl_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* Take a job no worker has started off the queue; pool lock held */
+static void vglsl_prefetch_unqueue(VglslPrefetchPool* pool, VglslPrefetchJob* job) {
+    VglslPrefetchJob* prev = NULL;
+    for (VglslPrefetchJob* at = pool->head; at; prev = at, at = at->next) {
+        if (at != job) continue;
+        if (prev) {
+            prev->next = job->next;
+        } else {
+            pool->head = job->next;
+        }
+        if (pool->tail == job) pool->tail = prev;
+        job->next = NULL;
+        return;
+    }
+}
+#endif
+
+VglslPrefetchPool* vglsl_prefetch_pool_create(int threads) {
+#ifdef VGLSL_HAS_THREADS
+    VglslPrefetchPool* pool = (VglslPrefetchPool*)VGLSL_MALLOC(sizeof(VglslPrefetchPool));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(VglslPrefetchPool));
+    if (!vglsl_mutex_init(&pool->lock)) {
+        VGLSL_FREE(pool);
+        return NULL;
+    }
+    if (!vglsl_cond_init(&pool->work)) {
+        vglsl_mutex_destroy(&pool->lock);
+        VGLSL_FREE(pool);
+        return NULL;
+    }
+    if (!vglsl_cond_init(&pool->done)) {
+        vglsl_cond_destroy(&pool->work);
+        vglsl_mutex_destroy(&pool->lock);
+        VGLSL_FREE(pool);
+        return NULL;
+    }
+    
+    if (threads > VGLSL_MAX_PREFETCH_THREADS) threads = VGLSL_MAX_PREFETCH_THREADS;
+    while (pool->thread_count < threads &&
+           vglsl_thread_start(&pool->threads[pool->thread_count], vglsl_prefetch_worker, pool)) {
+        pool->thread_count++;
+    }
+    if (pool->thread_count == 0) {
+        vglsl_prefetch_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+#else
+    (void)threads;
+    return NULL;
+#endif
+}
+
+void vglsl_prefetch_pool_destroy(VglslPrefetchPool* pool) {
+#ifdef VGLSL_HAS_THREADS
+    if (!pool) return;
+    vglsl_mutex_lock(&pool->lock);
+    pool->stop = true;
+    vglsl_cond_broadcast(&pool->work);
+    vglsl_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        vglsl_thread_join(pool->threads[i]);
+    }
+    
+    vglsl_cond_destroy(&pool->done);
+    vglsl_cond_destroy(&pool->work);
+    vglsl_mutex_destroy(&pool->lock);
+    VGLSL_FREE(pool);
+#else
+    (void)pool;
+#endif
+}
+
+uint64_t vglsl_prefetch_pool_reads(VglslPrefetchPool* pool) {
+#ifdef VGLSL_HAS_THREADS
+    if (!pool) return 0;
+    vglsl_mutex_lock(&pool->lock);
+    uint64_t reads = pool->reads;
+    vglsl_mutex_unlock(&pool->lock);
+    return reads;
+#else
+    (void)pool;
+    return 0;
+#endif
+}
+
+#ifdef VGLSL_HAS_THREADS
+/* Queue a read, once per path and parse */
+static void vglsl_prefetch_queue(VglslContext* ctx, const char* path) {
+    uint64_t hash = vglsl_hash(path, strlen(path));
+    for (int i = 0; i < ctx->prefetch_count; i++) {
+        if (ctx->prefetch_jobs[i]->hash == hash && strcmp(ctx->prefetch_jobs[i]->path, path) == 0) return;
+    }
+    if (ctx->prefetch_count >= ctx->prefetch_capacity) {
+        int new_capacity = ctx->prefetch_capacity ? ctx->prefetch_capacity * 2 : 16;
+        VglslPrefetchJob** jobs = (VglslPrefetchJob**)VGLSL_REALLOC(ctx->prefetch_jobs, new_capacity * sizeof(VglslPrefetchJob*));
+        if (!jobs) return;
+        ctx->prefetch_jobs = jobs;
+        ctx->prefetch_capacity = new_capacity;
+    }
+    VglslPrefetchJob* job = (VglslPrefetchJob*)VGLSL_MALLOC(sizeof(VglslPrefetchJob));
+    if (!job) return;
+    memset(job, 0, sizeof(VglslPrefetchJob));
+    job->path = vglsl_strdup(path);
+    if (!job->path) {
+        VGLSL_FREE(job);
+        return;
+    }
+    job->hash = hash;
+    job->track = ctx->files != NULL;
+    job->state = VGLSL_PREFETCH_QUEUED;
+    ctx->prefetch_jobs[ctx->prefetch_count++] = job;
+    
+    VglslPrefetchPool* pool = ctx->config->prefetch;
+    vglsl_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    vglsl_cond_broadcast(&pool->work);
+    vglsl_mutex_unlock(&pool->lock);
+}
+#endif
+
+/* Hand over a prefetched read, waiting for one in progress. A job no worker
+ * has started is withdrawn and the caller reads the file itself. */
+static bool vglsl_prefetch_take(VglslContext* ctx, const char* path, VglslPrefetchJob* out) {
+#ifdef VGLSL_HAS_THREADS
+    if (ctx->prefetch_count == 0) return false;
+    
+    VglslPrefetchPool* pool = ctx->config->prefetch;
+    uint64_t hash = vglsl_hash(path, strlen(path));
+    bool taken = false;
+    for (int i = 0; i < ctx->prefetch_count; i++) {
+        VglslPrefetchJob* job = ctx->prefetch_jobs[i];
+        if (job->hash != hash || strcmp(job->path, path) != 0) continue;
+        
+        vglsl_mutex_lock(&pool->lock);
+        if (job->state == VGLSL_PREFETCH_QUEUED) vglsl_prefetch_unqueue(pool, job);
+        while (job->state == VGLSL_PREFETCH_READING) {
+            vglsl_cond_wait(&pool->done, &pool->lock);
+        }
+        if (job->state == VGLSL_PREFETCH_DONE) {
+            *out = *job;
+            job->data = NULL;
+            taken = true;
+        }
+        job->state = VGLSL_PREFETCH_TAKEN;
+        vglsl_mutex_unlock(&pool->lock);
+        break;
+    }
+    return taken;
+#else
+    (void)ctx;
+    (void)path;
+    (void)out;
+    return false;
+#endif
+}
+
+/* Withdraw the parse's jobs from the pool, wait for the ones being read
+ * and drop what the parser never took */
+static void vglsl_prefetch_release(VglslContext* ctx) {
+#ifdef VGLSL_HAS_THREADS
+    if (ctx->prefetch_count > 0) {
+        VglslPrefetchPool* pool = ctx->config->prefetch;
+        vglsl_mutex_lock(&pool->lock);
+        for (int i = 0; i < ctx->prefetch_count; i++) {
+            VglslPrefetchJob* job = ctx->prefetch_jobs[i];
+            if (job->state == VGLSL_PREFETCH_QUEUED) vglsl_prefetch_unqueue(pool, job);
+            while (job->state == VGLSL_PREFETCH_READING) {
+                vglsl_cond_wait(&pool->done, &pool->lock);
+            }
+        }
+        vglsl_mutex_unlock(&pool->lock);
+    }
+    for (int i = 0; i < ctx->prefetch_count; i++) {
+        VGLSL_FREE(ctx->prefetch_jobs[i]->path);
+        VGLSL_FREE(ctx->prefetch_jobs[i]->data);
+        VGLSL_FREE(ctx->prefetch_jobs[i]);
+    }
+#endif
+    VGLSL_FREE(ctx->prefetch_jobs);
+    ctx->prefetch_jobs = NULL;
+    ctx->prefetch_count = 0;
+    ctx->prefetch_capacity = 0;
+}
+
+/* Look ahead through a file just loaded and queue reads of its includes.
+ * Conditionals are not evaluated, so an include that ends up skipped is
+ * read for nothing. Files from a loader are left to the parser, since the
+ * loader is not known to be thread-safe. */
+static void vglsl_prefetch_scan(VglslContext* ctx, const VglslIncludeFrame* frame) {
+#ifdef VGLSL_HAS_THREADS
+    if (!ctx->config->prefetch || ctx->config->load_file) return;
+    
+    const VglslSegment first = { frame->source.data, frame->source.size };
+    for (int piece = -1; piece < frame->source.piece_count; piece++) {
+        const VglslSegment* segment = piece < 0 ? &first : &frame->source.pieces[piece];
+        const char* p = segment->data;
+        const char* end = p + segment->length;
+        while (p < end) {
+            const char* line_end = (const char*)memchr(p, '\n', (size_t)(end - p));
+            if (!line_end) line_end = end;
+            const char* q = p;
+            p = line_end + 1;
+            
+            while (q < line_end && (*q == ' ' || *q == '\t')) q++;
+            if (q >= line_end || *q != '#') continue;
+            q++;
+            while (q < line_end && (*q == ' ' || *q == '\t')) q++;
+            if (line_end - q < 7 || memcmp(q, "include", 7) != 0) continue;
+            q += 7;
+            while (q < line_end && (*q == ' ' || *q == '\t')) q++;
+            if (q >= line_end || (*q != '"' && *q != '<')) continue;
+            
+            bool is_angle = *q == '<';
+            const char* name_start = q + 1;
+            const char* name_end = (const char*)memchr(name_start, is_angle ? '>' : '"', (size_t)(line_end - name_start));
+            char name[512];
+            if (!name_end || (size_t)(name_end - name_start) >= sizeof(name)) continue;
+            memcpy(name, name_start, name_end - name_start);
+            name[name_end - name_start] = '\0';
+            
+            VglslIncludeTarget target;
+            if (!vglsl_locate_include(ctx, name, is_angle, is_angle ? NULL : frame->directory, &target)) continue;
+            if (target.resolved && !target.resolved->found) continue;
+            vglsl_prefetch_queue(ctx, target.path);
+        }
+    }
+#else
+    (void)ctx;
+    (void)frame;
+#endif
+}
+
+/* Process #include directive */
+static bool vglsl_process_include(VglslContext* ctx, const char* directive, int line_num, const char* filename) {
+    if (ctx->include_depth >= ctx->config->max_include_depth) {
+        vglsl_set_error(ctx, "Maximum include depth exceeded", line_num, filename);
+        return false;
+    }
+    
+    /* Extract filename from #include "filename" or #include <filename> */
+    const char* quote_start = strchr(directive, '"');
+    const char* angle_start = strchr(directive, '<');
+    const char* start = NULL;
+    char end_char = 0;
+    bool is_angle_include = false;
+    
+    if (quote_start && (!angle_start || quote_start < angle_start)) {
+        start = quote_start + 1;
+        end_char = '"';
+        is_angle_include = false;
+    } else if (angle_start) {
+        start = angle_start + 1;
+        end_char = '>';
+        is_angle_include = true;
+    }
+    
+    if (!start) {
+        vglsl_set_error(ctx, "Invalid include directive", line_num, filename);
+        return false;
+    }
+    
+    const char* end = strchr(start, end_char);
+    if (!end) {
+        vglsl_set_error(ctx, "Unterminated include filename", line_num, filename);
+        return false;
+    }
+    
+    size_t filename_len = end - start;
+    char include_filename[512];
+    if (filename_len >= sizeof(include_filename)) {
+        vglsl_set_error(ctx, "Include filename too long", line_num, filename);
+        return false;
+    }
+    
+    memcpy(include_filename, start, filename_len);
+    include_filename[filename_len] = '\0';
+    
+    /* Resolve, from the include cache when this include was seen before */
+    VglslIncludeCache* cache = ctx->config->include_cache;
+    const char* directory = is_angle_include ? NULL : ctx->frames[ctx->frame_count - 1].directory;
+    VglslIncludeTarget target;
+    if (!vglsl_locate_include(ctx, include_filename, is_angle_include, directory, &target)) {
+        vglsl_set_error(ctx, "Include path too long", line_num, filename);
+        return false;
+    }
+    VglslResolveEntry* resolved = target.resolved;
+    const char* full_path = target.path;
+    
+    /* Already included under #pragma once or a still defined guard, under
+     * this or any other path to the same file */
+    VglslFileEntry* file = vglsl_file_entry(ctx, full_path);
+    if (!file) {
+        vglsl_set_error(ctx, "Failed to allocate file table", line_num, filename);
+        return false;
+    }
+    if (vglsl_include_skipped(ctx, file)) return true;
+    
+    /* Data a prefetch worker already read, or is reading */
+    VglslPrefetchJob job;
+    bool prefetched = vglsl_prefetch_take(ctx, full_path, &job);
+    
+    if (ctx->files && !file->listed) {
+        if (prefetched && !job.stamped) ctx->files->unstable = true;
+        if (!vglsl_file_list_add(ctx->files, full_path, prefetched && job.stamped ? &job.stamp : NULL)) {
+            VGLSL_FREE(prefetched ? job.data : NULL);
+            vglsl_set_error(ctx, "Failed to allocate file list", line_num, filename);
             return false;
         }
-        memcpy(name, name_start, name_len);
-        name[name_len] = '\0';
+        file->listed = true;
+    }
+    
+    /* Open included file and push it on the include stack. A cached miss
+     * fails without trying again. */
+    VglslSource source;
+    bool loaded;
+    if (prefetched) {
+        loaded = job.data != NULL;
+        source = vglsl_source_from_memory(job.data, job.size);
+        source.owned = job.data;
+    } else if (vglsl_probe_take(ctx, full_path, &source)) {
+        loaded = true;
+    } else {
+        loaded = (!resolved || resolved->found) && vglsl_source_from_file(ctx->config, full_path, &source);
+    }
+    if (resolved && !loaded) {
+        /* A file missing for a moment (an editor saving through a rename)
+         * must not become a cached miss */
+        if (resolved->found) resolved->stale = true;
+    } else if (cache && !resolved) {
+        vglsl_resolve_put(cache, target.key, ctx->config, target.parts, ctx->search_hash, full_path, loaded);
+    }
+    if (!loaded) {
+        char error_msg[512];
+        snprintf(error_msg, sizeof(error_msg), "Failed to read include file: %s", full_path);
+        vglsl_set_error(ctx, error_msg, line_num, filename);
+        return false;
+    }
+    
+    if (!vglsl_push_frame(ctx, &source, full_path, filename, line_num)) return false;
+    vglsl_prefetch_scan(ctx, &ctx->frames[ctx->frame_count - 1]);
+    
+    /* Add line directive if requested */
+    if (ctx->config->preserve_lines) {
+        char line_directive[256];
+        snprintf(line_directive, sizeof(line_directive), "#line 1 \"%s\"\n", full_path);
+        vglsl_append_output(ctx, line_directive);
+    }
+    
+    return true;
+}
+
+/* Check if current context should output (not in false conditional) */
+static bool vglsl_should_output(VglslContext* ctx) {
+    for (int i = 1; i <= ctx->if_depth; i++) {
+        if (!ctx->if_stack[i]) return false;
+    }
+    return true;
+}
+
+/* #pragma stage NAME - later output belongs to stage NAME ("common" for all) */
+static bool vglsl_begin_stage(VglslContext* ctx, const char* name, int line_num, const char* filename) {
+    while (*name == ' ' || *name == '\t') name++;
+    size_t length = 0;
+    while (vglsl_is_ident_char(name[length])) length++;
+    if (length == 0 || name[length] != '\0') {
+        vglsl_set_error(ctx, "Invalid stage pragma", line_num, filename);
+        return false;
+    }
+    
+    int stage = -1;
+    if (strcmp(name, "common") != 0) {
+        for (stage = 0; stage < ctx->stage_count; stage++) {
+            if (strcmp(ctx->stage_names[stage], name) == 0) break;
+        }
+        if (stage == ctx->stage_count) {
+            char** names = (char**)VGLSL_REALLOC(ctx->stage_names, (ctx->stage_count + 1) * sizeof(char*));
+            if (!names) {
+                vglsl_set_error(ctx, "Failed to allocate stage", line_num, filename);
+                return false;
+            }
+            ctx->stage_names = names;
+            ctx->stage_names[ctx->stage_count] = vglsl_strdup(name);
+            if (!ctx->stage_names[ctx->stage_count]) {
+                vglsl_set_error(ctx, "Failed to allocate stage", line_num, filename);
+                return false;
+            }
+            ctx->stage_count++;
+        }
+    }
+    
+    if (ctx->stage_mark_count >= ctx->stage_mark_capacity) {
+        int new_capacity = ctx->stage_mark_capacity ? ctx->stage_mark_capacity * 2 : 8;
+        VglslStageMark* marks = (VglslStageMark*)VGLSL_REALLOC(ctx->stage_marks, new_capacity * sizeof(VglslStageMark));
+        if (!marks) {
+            vglsl_set_error(ctx, "Failed to allocate stage", line_num, filename);
+            return false;
+        }
+        ctx->stage_marks = marks;
+        ctx->stage_mark_capacity = new_capacity;
+    }
+    ctx->stage_marks[ctx->stage_mark_count].offset = ctx->output_size;
+    ctx->stage_marks[ctx->stage_mark_count].stage = stage;
+    ctx->stage_mark_count++;
+    return true;
+}
+
+/* Process preprocessor directive */
+static bool vglsl_process_directive(VglslContext* ctx, const char* line, int line_num, const char* filename) {
+    char* directive = ctx->directive;
+    strcpy(directive, line + 1); /* Skip # */
+    vglsl_trim_whitespace(directive);
+    
+    if (vglsl_starts_with(directive, "include")) {
+        return vglsl_process_include(ctx, directive, line_num, filename);
+    } else if (vglsl_starts_with(directive, "define")) {
+        /* Parse #define NAME [VALUE] */
+        char* name_start = directive + 6; /* Skip "define" */
+        while (*name_start == ' ' || *name_start == '\t') name_start++;
+        
+        char* name_end = name_start;
+        while (*name_end && *name_end != ' ' && *name_end != '\t' && *name_end != '(') name_end++;
+        
+        if (name_end == name_start) {
+            vglsl_set_error(ctx, "Invalid define directive", line_num, filename);
+            return false;
+        }
+        
+        char name[256];
+        size_t name_len = name_end - name_start;
+        if (name_len >= sizeof(name)) {
+            vglsl_set_error(ctx, "Define name too long", line_num, filename);
+            return false;
+        }
+        memcpy(name, name_start, name_len);
+        name[name_len] = '\0';
+        
+        /* Check for function macro */
+        if (*name_end == '(') {
+            char* value_start = strchr(name_end, ')');
+            if (!value_start) {
+                vglsl_set_error(ctx, "Unterminated macro parameter list", line_num, filename);
+                return false;
+            }
+            *value_start++ = '\0';
+            
+            /* Split the parameter list at commas */
+            char* params[VGLSL_MAX_MACRO_PARAMS];
+            int param_count = 0;
+            char* param = name_end + 1;
+            while (*param == ' ' || *param == '\t') param++;
+            while (*param) {
+                char* comma = strchr(param, ',');
+                if (comma) *comma = '\0';
+                vglsl_trim_whitespace(param);
+                if (param[0] == '\0' || param_count >= VGLSL_MAX_MACRO_PARAMS) {
+                    vglsl_set_error(ctx, "Invalid macro parameter list", line_num, filename);
+                    return false;
+                }
+                params[param_count++] = param;
+                if (!comma) break;
+                param = comma + 1;
+            }
+            
+            while (*value_start == ' ' || *value_start == '\t') value_start++;
+            return vglsl_add_define(ctx, name, value_start, params, param_count);
+        } else {
+            /* Simple macro */
+            char* value_start = name_end;
+            while (*value_start == ' ' || *value_start == '\t') value_start++;
+            return vglsl_add_define(ctx, name, value_start, NULL, 0);
+        }
+    } else if (vglsl_starts_with(directive, "undef")) {
+        char* name_start = directive + 5; /* Skip "undef" */
+        while (*name_start == ' ' || *name_start == '\t') name_start++;
+        vglsl_trim_whitespace(name_start);
+        vglsl_remove_define(ctx, name_start);
+        return true;
+    } else if (vglsl_starts_with(directive, "ifdef")) {
+        char* name_start = directive + 5; /* Skip "ifdef" */
+        while (*name_start == ' ' || *name_start == '\t') name_start++;
+        vglsl_trim_whitespace(name_start);
+        
+        if (ctx->if_depth >= 63) {
+            vglsl_set_error(ctx, "Too many nested conditionals", line_num, filename);
+            return false;
+        }
+        
+        ctx->if_depth++;
+        bool defined = (vglsl_find_define(ctx, name_start) != NULL);
+        ctx->if_stack[ctx->if_depth] = defined;
+        ctx->if_taken[ctx->if_depth] = defined;
+        return true;
+    } else if (vglsl_starts_with(directive, "ifndef")) {
+        char* name_start = directive + 6; /* Skip "ifndef" */
+        while (*name_start == ' ' || *name_start == '\t') name_start++;
+        vglsl_trim_whitespace(name_start);
+        
+        if (ctx->if_depth >= 63) {
+            vglsl_set_error(ctx, "Too many nested conditionals", line_num, filename);
+            return false;
+        }
+        
+        ctx->if_depth++;
+        bool defined = (vglsl_find_define(ctx, name_start) != NULL);
+        ctx->if_stack[ctx->if_depth] = !defined;
+        ctx->if_taken[ctx->if_depth] = !defined;
+        return true;
+    } else if (strcmp(directive, "else") == 0) {
+        if (ctx->if_depth <= 0) {
+            vglsl_set_error(ctx, "#else without #ifdef/#ifndef", line_num, filename);
+            return false;
+        }
+        ctx->if_stack[ctx->if_depth] = !ctx->if_taken[ctx->if_depth];
+        return true;
+    } else if (strcmp(directive, "endif") == 0) {
+        if (ctx->if_depth <= 0) {
+            vglsl_set_error(ctx, "#endif without #ifdef/#ifndef", line_num, filename);
+            return false;
+        }
+        ctx->if_depth--;
+        return true;
+    }
+    
+    if (vglsl_starts_with(directive, "pragma")) {
+        const char* pragma = directive + 6;
+        while (*pragma == ' ' || *pragma == '\t') pragma++;
+        if (vglsl_starts_with(pragma, "stage") && (pragma[5] == ' ' || pragma[5] == '\t' || pragma[5] == '\0')) {
+            if (!vglsl_should_output(ctx)) return true;
+            return vglsl_begin_stage(ctx, pragma + 5, line_num, filename);
+        }
+        if (strcmp(pragma, "once") == 0) {
+            if (!vglsl_should_output(ctx)) return true;
+            return vglsl_add_once(ctx, filename, NULL);
+        }
+    }
+    
+    /* Unknown directive - pass through as-is */
+    if (ctx->config->canonicalize_output) {
+        /* Source #line numbers only make output differ between variants */
+        if (vglsl_starts_with(directive, "line") && (directive[4] == ' ' || directive[4] == '\t' || directive[4] == '\0') &&
+            !ctx->config->preserve_lines) {
+            return true;
+        }
+        
+        strcpy(ctx->expanded_line, line);
+        size_t length = vglsl_collapse_whitespace(ctx->expanded_line);
+        return vglsl_emit(ctx, ctx->expanded_line, length) && vglsl_emit_pinned(ctx, "\n", 1);
+    }
+    
+    if (!vglsl_append_output(ctx, line)) return false;
+    if (!vglsl_append_output(ctx, "\n")) return false;
+    return true;
+}
+
+/* Process a single line */
+static bool vglsl_process_line(VglslContext* ctx, const char* line, int line_num, const char* filename) {
+    if (ctx->has_error) return false;
+    
+    char* processed_line = ctx->processed_line;
+    if (processed_line != line) strcpy(processed_line, line);
+    
+    /* Remove comments if requested */
+    if (ctx->config->remove_comments) {
+        vglsl_remove_comments(processed_line);
+    }
+    
+    vglsl_trim_whitespace(processed_line);
+    vglsl_track_guard(ctx, processed_line);
+    
+    /* Handle preprocessor directives */
+    if (processed_line[0] == '#') {
+        return vglsl_process_directive(ctx, processed_line, line_num, filename);
+    }
+    
+    /* Skip line if in false conditional */
+    if (!vglsl_should_output(ctx)) {
+        return true;
+    }
+    
+    /* Expand macros */
+    char* expanded_line = ctx->expanded_line;
+    if (!vglsl_expand_macros(ctx, processed_line, expanded_line, VGLSL_MAX_LINE_LENGTH)) {
+        vglsl_set_error(ctx, "Macro expansion failed", line_num, filename);
+        return false;
+    }
+    
+    /* Canonical form - single spaces, no blank lines */
+    size_t expanded_len;
+    if (ctx->config->canonicalize_output) {
+        expanded_len = vglsl_collapse_whitespace(expanded_line);
+        if (expanded_len == 0) return true;
+    } else {
+        expanded_len = strlen(expanded_line);
+    }
+    
+    /* Add to output */
+    if (ctx->storage && ctx->raw_line) {
+        /* Reference the source line directly when it came through unchanged */
+        size_t lead = 0;
+        while (lead < ctx->raw_length && (ctx->raw_line[lead] == ' ' || ctx->raw_line[lead] == '\t')) lead++;
+        
+        if (lead + expanded_len <= ctx->raw_length &&
+            memcmp(ctx->raw_line + lead, expanded_line, expanded_len) == 0) {
+            if (lead + expanded_len == ctx->raw_length && ctx->raw_has_newline) {
+                return vglsl_emit_pinned(ctx, ctx->raw_line + lead, expanded_len + 1);
+            }
+            return vglsl_emit_pinned(ctx, ctx->raw_line + lead, expanded_len) &&
+                   vglsl_emit_pinned(ctx, "\n", 1);
+        }
+    }
+    
+    if (!vglsl_emit(ctx, expanded_line, expanded_len)) return false;
+    if (!vglsl_emit_pinned(ctx, "\n", 1)) return false;
+    
+    return true;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Token passes - optional post-processing over the preprocessed output      */
+/* ------------------------------------------------------------------------- */
+
+typedef enum {
+    VGLSL_TOKEN_IDENT,
+    VGLSL_TOKEN_NUMBER,
+    VGLSL_TOKEN_PUNCT,
+    VGLSL_TOKEN_DIRECTIVE      /* Whole preprocessor line, without newline */
+} VglslTokenType;
+
+typedef struct VglslToken {
+    VglslTokenType type;
+    const char* text;          /* Into the tokenized text, or a pass-owned string */
+    size_t length;
+    const char* space;         /* Whitespace and comments before the token */
+    size_t space_length;
+    bool removed;
+} VglslToken;
+
+typedef struct VglslTokenList {
+    VglslToken* tokens;
+    int count;
+    int capacity;
+    const char* tail;          /* Whitespace after the last token */
+    size_t tail_length;
+    
+    /* Replacement texts owned by the passes */
+    char** strings;
+    int string_count;
+    int string_capacity;
+} VglslTokenList;
+
+static bool vglsl_token_is(const VglslToken* token, const char* text) {
+    size_t length = strlen(text);
+    return token->length == length && memcmp(token->text, text, length) == 0;
+}
+
+static bool vglsl_tokens_push(VglslTokenList* list, const VglslToken* token) {
+    if (list->count >= list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 1024;
+        VglslToken* tokens = (VglslToken*)VGLSL_REALLOC(list->tokens, new_capacity * sizeof(VglslToken));
+        if (!tokens) return false;
+        list->tokens = tokens;
+        list->capacity = new_capacity;
+    }
+    list->tokens[list->count++] = *token;
+    return true;
+}
+
+/* Keep a pass-created string alive as long as the token list */
+static char* vglsl_tokens_string(VglslTokenList* list, const char* text, size_t length) {
+    if (list->string_count >= list->string_capacity) {
+        int new_capacity = list->string_capacity ? list->string_capacity * 2 : 64;
+        char** strings = (char**)VGLSL_REALLOC(list->strings, new_capacity * sizeof(char*));
+        if (!strings) return NULL;
+        list->strings = strings;
+        list->string_capacity = new_capacity;
+    }
+    
+    char* copy = (char*)VGLSL_MALLOC(length + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    list->strings[list->string_count++] = copy;
+    return copy;
+}
+
+static void vglsl_tokens_free(VglslTokenList* list) {
+    for (int i = 0; i < list->string_count; i++) {
+        VGLSL_FREE(list->strings[i]);
+    }
+    VGLSL_FREE(list->strings);
+    VGLSL_FREE(list->tokens);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Split GLSL text into tokens. Comments are kept as part of the whitespace
+ * before the next token; directives stay whole so passes leave them alone. */
+static bool vglsl_tokenize(const char* text, size_t length, VglslTokenList* list) {
+    static const char* const punctuators[] = {
+        "<<=", ">>=",
+        "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "^^",
+        "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^="
+    };
+    
+    const char* p = text;
+    const char* end = text + length;
+    bool line_start = true;
+    
+    while (p < end) {
+        /* Whitespace and comments */
+        const char* space = p;
+        while (p < end) {
+            if (*p == '\n') {
+                line_start = true;
+                p++;
+            } else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f') {
+                p++;
+            } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+                while (p < end && *p != '\n') p++;
+            } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+                p += 2;
+                while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/')) p++;
+                p = p < end ? p + 2 : end;
+            } else {
+                break;
+            }
+        }
+        if (p >= end) {
+            list->tail = space;
+            list->tail_length = (size_t)(p - space);
+            return true;
+        }
+        
+        VglslToken token = {0};
+        token.space = space;
+        token.space_length = (size_t)(p - space);
+        token.text = p;
+        
+        if (*p == '#' && line_start) {
+            token.type = VGLSL_TOKEN_DIRECTIVE;
+            while (p < end && *p != '\n') p++;
+            while (p > token.text && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r')) p--;
+        } else if (vglsl_is_ident_start(*p)) {
+            token.type = VGLSL_TOKEN_IDENT;
+            while (p < end && vglsl_is_ident_char(*p)) p++;
+        } else if ((*p >= '0' && *p <= '9') || (*p == '.' && p + 1 < end && p[1] >= '0' && p[1] <= '9')) {
+            token.type = VGLSL_TOKEN_NUMBER;
+            bool hex = (*p == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X'));
+            p++;
+            while (p < end) {
+                if (vglsl_is_ident_char(*p) || *p == '.') {
+                    p++;
+                } else if ((*p == '+' || *p == '-') && !hex && (p[-1] == 'e' || p[-1] == 'E')) {
+                    p++;
+                } else {
+                    break;
+                }
+            }
+        } else {
+            token.type = VGLSL_TOKEN_PUNCT;
+            size_t match = 1;
+            for (size_t i = 0; i < sizeof(punctuators) / sizeof(punctuators[0]); i++) {
+                size_t punct_length = strlen(punctuators[i]);
+                if ((size_t)(end - p) >= punct_length && memcmp(p, punctuators[i], punct_length) == 0) {
+                    match = punct_length;
+                    break;
+                }
+            }
+            p += match;
+        }
+        
+        token.length = (size_t)(p - token.text);
+        line_start = false;
+        if (!vglsl_tokens_push(list, &token)) return false;
+    }
+    
+    list->tail = end;
+    list->tail_length = 0;
+    return true;
+}
+
+/* Two adjacent tokens need a space if gluing them would lex differently */
+static bool vglsl_tokens_need_space(const VglslToken* prev, const VglslToken* next) {
+    char a = prev->text[prev->length - 1];
+    char b = next->text[0];
+    
+    if (vglsl_is_ident_char(a) && vglsl_is_ident_char(b)) return true;
+    if (prev->type == VGLSL_TOKEN_NUMBER && b == '.') return true;
+    if (a == '.' && b >= '0' && b <= '9') return true;
+    if (!vglsl_is_ident_char(a) && !vglsl_is_ident_char(b)) {
+        /* Folded negative literals start with '-' too */
+        static const char* const pairs[] = {
+            "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "^^",
+            "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "//", "/*"
+        };
+        for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+            if (pairs[i][0] == a && pairs[i][1] == b) return true;
+        }
+    }
+    return false;
+}
+
+/* Emit the token list back to the output. Without minify the original
+ * spacing is kept; with it, only the spacing the lexer needs remains and
+ * directives keep their own lines. */
+static bool vglsl_emit_tokens(VglslContext* ctx, const VglslTokenList* list, bool minify) {
+    const VglslToken* prev = NULL;
+    bool line_open = false;
+    
+    for (int i = 0; i < list->count; i++) {
+        const VglslToken* token = &list->tokens[i];
+        if (token->removed) continue;
+        
+        if (!minify) {
+            if (!vglsl_emit(ctx, token->space, token->space_length)) return false;
+        } else if (token->type == VGLSL_TOKEN_DIRECTIVE) {
+            if (line_open && !vglsl_emit_pinned(ctx, "\n", 1)) return false;
+        } else if (prev && prev->type != VGLSL_TOKEN_DIRECTIVE && vglsl_tokens_need_space(prev, token)) {
+            if (!vglsl_emit_pinned(ctx, " ", 1)) return false;
+        }
+        
+        if (!vglsl_emit(ctx, token->text, token->length)) return false;
+        
+        if (minify && token->type == VGLSL_TOKEN_DIRECTIVE) {
+            if (!vglsl_emit_pinned(ctx, "\n", 1)) return false;
+            line_open = false;
+        } else {
+            line_open = true;
+        }
+        prev = token;
+    }
+    
+    if (!minify) return vglsl_emit(ctx, list->tail, list->tail_length);
+    return !line_open || vglsl_emit_pinned(ctx, "\n", 1);
+}
+
+/* Name map - identifiers (slices of the text) mapped to a value */
+typedef struct VglslNameEntry {
+    const char* name;
+    size_t length;
+    const char* value;
+    int index;                 /* Pass-specific */
+} VglslNameEntry;
+
+typedef struct VglslNameMap {
+    VglslNameEntry* entries;
+    int count;
+    int capacity;              /* Power of two, 0 when empty */
+} VglslNameMap;
+
+static size_t vglsl_name_slot(const VglslNameMap* map, const char* name, size_t length) {
+    size_t mask = (size_t)map->capacity - 1;
+    size_t slot = (size_t)vglsl_hash(name, length) & mask;
+    while (map->entries[slot].name &&
+           !(map->entries[slot].length == length && memcmp(map->entries[slot].name, name, length) == 0)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static VglslNameEntry* vglsl_name_find(const VglslNameMap* map, const char* name, size_t length) {
+    if (map->capacity == 0) return NULL;
+    VglslNameEntry* entry = &map->entries[vglsl_name_slot(map, name, length)];
+    return entry->name ? entry : NULL;
+}
+
+static bool vglsl_name_put(VglslNameMap* map, const char* name, size_t length, const char* value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        VglslNameMap grown = {0};
+        grown.capacity = map->capacity ? map->capacity * 2 : 64;
+        grown.entries = (VglslNameEntry*)VGLSL_MALLOC(grown.capacity * sizeof(VglslNameEntry));
+        if (!grown.entries) return false;
+        memset(grown.entries, 0, grown.capacity * sizeof(VglslNameEntry));
+        
+        for (int i = 0; i < map->capacity; i++) {
+            if (map->entries[i].name) {
+                grown.entries[vglsl_name_slot(&grown, map->entries[i].name, map->entries[i].length)] = map->entries[i];
+                grown.count++;
+            }
+        }
+        VGLSL_FREE(map->entries);
+        *map = grown;
+    }
+    
+    VglslNameEntry* entry = &map->entries[vglsl_name_slot(map, name, length)];
+    if (!entry->name) {
+        entry->name = name;
+        entry->length = length;
+        map->count++;
+    }
+    entry->value = value;
+    return true;
+}
+
+static void vglsl_name_free(VglslNameMap* map) {
+    VGLSL_FREE(map->entries);
+    memset(map, 0, sizeof(*map));
+}
+
+/* GLSL keywords, reserved words and built-in functions. The minifier never
+ * generates these and never renames user overloads of built-ins. */
+static const char* const vglsl_reserved_names[] = {
+    "attribute", "const", "uniform", "varying", "buffer", "shared", "coherent", "volatile",
+    "restrict", "readonly", "writeonly", "layout", "centroid", "flat", "smooth", "noperspective",
+    "patch", "sample", "break", "continue", "do", "for", "while", "switch", "case", "default",
+    "if", "else", "subroutine", "in", "out", "inout", "float", "double", "int", "void", "bool",
+    "true", "false", "invariant", "precise", "discard", "return", "lowp", "mediump", "highp",
+    "precision", "struct", "uint", "atomic_uint", "asm", "class", "union", "enum", "typedef",
+    "template", "this", "resource", "goto", "inline", "noinline", "public", "static", "extern",
+    "external", "interface", "long", "short", "half", "fixed", "unsigned", "superp", "input",
+    "output", "filter", "sizeof", "cast", "namespace", "using", "active", "common", "partition",
+    "main",
+    "vec2", "vec3", "vec4", "ivec2", "ivec3", "ivec4", "uvec2", "uvec3", "uvec4", "bvec2",
+    "bvec3", "bvec4", "dvec2", "dvec3", "dvec4", "mat2", "mat3", "mat4", "mat2x2", "mat2x3",
+    "mat2x4", "mat3x2", "mat3x3", "mat3x4", "mat4x2", "mat4x3", "mat4x4", "dmat2", "dmat3",
+    "dmat4", "hvec2", "hvec3", "hvec4", "fvec2", "fvec3", "fvec4",
+    "radians", "degrees", "sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh",
+    "asinh", "acosh", "atanh", "pow", "exp", "log", "exp2", "log2", "sqrt", "inversesqrt",
+    "abs", "sign", "floor", "trunc", "round", "roundEven", "ceil", "fract", "mod", "modf",
+    "min", "max", "clamp", "mix", "step", "smoothstep", "isnan", "isinf", "floatBitsToInt",
+    "floatBitsToUint", "intBitsToFloat", "uintBitsToFloat", "fma", "frexp", "ldexp",
+    "packUnorm2x16", "packSnorm2x16", "packUnorm4x8", "packSnorm4x8", "unpackUnorm2x16",
+    "unpackSnorm2x16", "unpackUnorm4x8", "unpackSnorm4x8", "packHalf2x16", "unpackHalf2x16",
+    "packDouble2x32", "unpackDouble2x32", "length", "distance", "dot", "cross", "normalize",
+    "faceforward", "reflect", "refract", "matrixCompMult", "outerProduct", "transpose",
+    "determinant", "inverse", "lessThan", "lessThanEqual", "greaterThan", "greaterThanEqual",
+    "equal", "notEqual", "any", "all", "not", "uaddCarry", "usubBorrow", "umulExtended",
+    "imulExtended", "bitfieldExtract", "bitfieldInsert", "bitfieldReverse", "bitCount",
+    "findLSB", "findMSB", "textureSize", "textureQueryLod", "textureQueryLevels",
+    "textureSamples", "texture", "textureProj", "textureLod", "textureOffset", "texelFetch",
+    "texelFetchOffset", "textureProjOffset", "textureLodOffset", "textureProjLod",
+    "textureProjLodOffset", "textureGrad", "textureGradOffset", "textureProjGrad",
+    "textureProjGradOffset", "textureGather", "textureGatherOffset", "textureGatherOffsets",
+    "texture1D", "texture2D", "texture3D", "textureCube", "shadow2D", "texture2DLod",
+    "texture2DProj", "textureCubeLod", "atomicCounterIncrement", "atomicCounterDecrement",
+    "atomicCounter", "atomicAdd", "atomicMin", "atomicMax", "atomicAnd", "atomicOr",
+    "atomicXor", "atomicExchange", "atomicCompSwap", "imageSize", "imageSamples", "imageLoad",
+    "imageStore", "imageAtomicAdd", "imageAtomicMin", "imageAtomicMax", "imageAtomicAnd",
+    "imageAtomicOr", "imageAtomicXor", "imageAtomicExchange", "imageAtomicCompSwap",
+    "dFdx", "dFdy", "dFdxFine", "dFdyFine", "dFdxCoarse", "dFdyCoarse", "fwidth",
+    "fwidthFine", "fwidthCoarse", "interpolateAtCentroid", "interpolateAtSample",
+    "interpolateAtOffset", "noise1", "noise2", "noise3", "noise4", "EmitStreamVertex",
+    "EndStreamPrimitive", "EmitVertex", "EndPrimitive", "barrier", "memoryBarrier",
+    "memoryBarrierAtomicCounter", "memoryBarrierBuffer", "memoryBarrierShared",
+    "memoryBarrierImage", "groupMemoryBarrier"
+};
+
+static bool vglsl_is_reserved_name(const char* name, size_t length) {
+    for (size_t i = 0; i < sizeof(vglsl_reserved_names) / sizeof(vglsl_reserved_names[0]); i++) {
+        if (strlen(vglsl_reserved_names[i]) == length && memcmp(vglsl_reserved_names[i], name, length) == 0) {
+            return true;
+        }
+    }
+    /* Opaque types (sampler2D, image2D, ...) and the gl_ namespace */
+    return (length > 7 && memcmp(name, "sampler", 7) == 0) || (length > 5 && memcmp(name, "image", 5) == 0) ||
+           (length > 8 && memcmp(name, "isampler", 8) == 0) || (length > 8 && memcmp(name, "usampler", 8) == 0) ||
+           (length > 6 && memcmp(name, "iimage", 6) == 0) || (length > 6 && memcmp(name, "uimage", 6) == 0) ||
+           (length >= 3 && memcmp(name, "gl_", 3) == 0);
+}
+
+/* Built-in type names that can start a declaration */
+static bool vglsl_is_type_name(const VglslToken* token, const VglslNameMap* structs) {
+    static const char* const types[] = {
+        "float", "double", "int", "uint", "bool", "atomic_uint",
+        "vec2", "vec3", "vec4", "ivec2", "ivec3", "ivec4", "uvec2", "uvec3", "uvec4",
+        "bvec2", "bvec3", "bvec4", "dvec2", "dvec3", "dvec4", "mat2", "mat3", "mat4",
+        "mat2x2", "mat2x3", "mat2x4", "mat3x2", "mat3x3", "mat3x4", "mat4x2", "mat4x3",
+        "mat4x4", "dmat2", "dmat3", "dmat4"
+    };
+    if (token->type != VGLSL_TOKEN_IDENT) return false;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (vglsl_token_is(token, types[i])) return true;
+    }
+    if (token->length > 7 && memcmp(token->text, "sampler", 7) == 0) return true;
+    return vglsl_name_find(structs, token->text, token->length) != NULL;
+}
+
+/* Qualifiers that may precede the type of a declaration or parameter */
+static bool vglsl_is_qualifier(const VglslToken* token) {
+    static const char* const qualifiers[] = {
+        "const", "in", "out", "inout", "highp", "mediump", "lowp", "precise", "invariant",
+        "flat", "smooth", "noperspective", "centroid", "sample", "coherent", "volatile",
+        "restrict", "readonly", "writeonly"
+    };
+    if (token->type != VGLSL_TOKEN_IDENT) return false;
+    for (size_t i = 0; i < sizeof(qualifiers) / sizeof(qualifiers[0]); i++) {
+        if (vglsl_token_is(token, qualifiers[i])) return true;
+    }
+    return false;
+}
+
+/* Index of the bracket closing the one at index open, or list->count */
+static int vglsl_match_bracket(const VglslTokenList* list, int open) {
+    char open_char = list->tokens[open].text[0];
+    char close_char = open_char == '(' ? ')' : open_char == '[' ? ']' : '}';
+    int depth = 0;
+    for (int i = open; i < list->count; i++) {
+        const VglslToken* token = &list->tokens[i];
+        if (token->type != VGLSL_TOKEN_PUNCT || token->length != 1) continue;
+        if (token->text[0] == open_char) depth++;
+        else if (token->text[0] == close_char && --depth == 0) return i;
+    }
+    return list->count;
+}
+
+static bool vglsl_token_is_punct(const VglslTokenList* list, int index, char c) {
+    return index >= 0 && index < list->count && list->tokens[index].type == VGLSL_TOKEN_PUNCT &&
+           list->tokens[index].length == 1 && list->tokens[index].text[0] == c;
+}
+
+/* Function name at index - IDENT '(' after a type (global scope only) */
+static bool vglsl_is_function_name(const VglslTokenList* list, int index) {
+    return index > 0 && list->tokens[index].type == VGLSL_TOKEN_IDENT &&
+           vglsl_token_is_punct(list, index + 1, '(') &&
+           (list->tokens[index - 1].type == VGLSL_TOKEN_IDENT || vglsl_token_is_punct(list, index - 1, ']')) &&
+           !vglsl_is_qualifier(&list->tokens[index - 1]) && !vglsl_token_is(&list->tokens[index - 1], "return");
+}
+
+/* Mark the names declared by a local declaration starting at index */
+static void vglsl_mark_declaration(const VglslTokenList* list, int index, const VglslNameMap* structs, bool* declares) {
+    int i = index;
+    while (i < list->count && vglsl_is_qualifier(&list->tokens[i])) i++;
+    if (i >= list->count || !vglsl_is_type_name(&list->tokens[i], structs)) return;
+    i++;
+    if (vglsl_token_is_punct(list, i, '[')) i = vglsl_match_bracket(list, i) + 1;
+    
+    /* First declarator, then any after a top-level comma */
+    int depth = 0;
+    bool expect_name = true;
+    for (; i < list->count; i++) {
+        const VglslToken* token = &list->tokens[i];
+        if (expect_name) {
+            if (token->type != VGLSL_TOKEN_IDENT || vglsl_is_reserved_name(token->text, token->length)) return;
+            if (!(vglsl_token_is_punct(list, i + 1, '=') || vglsl_token_is_punct(list, i + 1, ';') ||
+                  vglsl_token_is_punct(list, i + 1, ',') || vglsl_token_is_punct(list, i + 1, '['))) return;
+            declares[i] = true;
+            expect_name = false;
+            continue;
+        }
+        if (token->type != VGLSL_TOKEN_PUNCT || token->length != 1) continue;
+        char c = token->text[0];
+        if (c == '(' || c == '[' || c == '{') depth++;
+        else if (c == ')' || c == ']' || c == '}') {
+            if (--depth < 0) return;
+        } else if (c == ';' && depth == 0) return;
+        else if (c == ',' && depth == 0) expect_name = true;
+    }
+}
+
+/* Short name number n: a-z A-Z, then [a-zA-Z][a-zA-Z0-9_]... */
+static size_t vglsl_short_name(int n, char* out) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    size_t length = 1;
+    long block = 52;
+    while (n >= block) {
+        n -= (int)block;
+        block *= 63;
+        length++;
+    }
+    
+    for (size_t i = length; i-- > 1;) {
+        out[i] = chars[n % 63];
+        n /= 63;
+    }
+    out[0] = chars[n];
+    out[length] = '\0';
+    return length;
+}
+
+/* Next short name not used anywhere in the source */
+static size_t vglsl_next_free_name(int* counter, const VglslNameMap* taken, char* out) {
+    for (;;) {
+        size_t length = vglsl_short_name((*counter)++, out);
+        if (strstr(out, "__")) continue;
+        if (vglsl_is_reserved_name(out, length)) continue;
+        if (vglsl_name_find(taken, out, length)) continue;
+        return length;
+    }
+}
+
+/* Local rename in scope */
+typedef struct VglslScopeEntry {
+    const char* name;
+    size_t length;
+    const char* renamed;
+    int depth;
+} VglslScopeEntry;
+
+/* Rename map being collected for the result */
+typedef struct VglslRenames {
+    VglslRename* items;
+    int count;
+    int capacity;
+} VglslRenames;
+
+static bool vglsl_renames_add(VglslRenames* renames, const char* original, size_t length,
+                              const char* renamed, const VglslToken* scope) {
+    if (renames->count >= renames->capacity) {
+        int new_capacity = renames->capacity ? renames->capacity * 2 : 32;
+        VglslRename* items = (VglslRename*)VGLSL_REALLOC(renames->items, new_capacity * sizeof(VglslRename));
+        if (!items) return false;
+        renames->items = items;
+        renames->capacity = new_capacity;
+    }
+    
+    VglslRename* item = &renames->items[renames->count++];
+    item->original = (char*)VGLSL_MALLOC(length + 1);
+    item->renamed = vglsl_strdup(renamed);
+    item->scope = NULL;
+    if (item->original) {
+        memcpy(item->original, original, length);
+        item->original[length] = '\0';
+    }
+    if (scope) {
+        item->scope = (char*)VGLSL_MALLOC(scope->length + 1);
+        if (item->scope) {
+            memcpy(item->scope, scope->text, scope->length);
+            item->scope[scope->length] = '\0';
+        }
+    }
+    return item->original && item->renamed && (!scope || item->scope);
+}
+
+static void vglsl_free_variables(VglslVariable* variables, int count) {
+    for (int i = 0; i < count; i++) {
+        VGLSL_FREE(variables[i].name);
+        VGLSL_FREE(variables[i].type);
+    }
+    VGLSL_FREE(variables);
+}
+
+static void vglsl_free_renames(VglslRename* items, int count) {
+    for (int i = 0; i < count; i++) {
+        VGLSL_FREE(items[i].original);
+        VGLSL_FREE(items[i].renamed);
+        VGLSL_FREE(items[i].scope);
+    }
+    VGLSL_FREE(items);
+}
+
+static void vglsl_free_stages(VglslStage* stages, int count) {
+    for (int i = 0; i < count; i++) {
+        VGLSL_FREE(stages[i].name);
+        VGLSL_FREE(stages[i].output);
+        vglsl_free_variables(stages[i].variables, stages[i].variable_count);
+        vglsl_free_renames(stages[i].renames, stages[i].rename_count);
+    }
+    VGLSL_FREE(stages);
+}
+
+/* Minifier renaming - user functions other than main and all locals and
+ * parameters get short names. Globals (uniforms, inputs, outputs, consts)
+ * keep their names, as do struct members and anything after a '.'. */
+static bool vglsl_minify_names(VglslTokenList* list, VglslRenames* renames) {
+    VglslNameMap taken = {0};
+    VglslNameMap structs = {0};
+    VglslNameMap functions = {0};
+    VglslScopeEntry* scope = NULL;
+    bool* declares = NULL;
+    bool ok = true;
+    int depth = 0;
+    
+    /* Every identifier in use, struct names and user function names */
+    for (int i = 0; i < list->count && ok; i++) {
+        VglslToken* token = &list->tokens[i];
+        if (token->type != VGLSL_TOKEN_IDENT) {
+            if (vglsl_token_is_punct(list, i, '{')) depth++;
+            else if (vglsl_token_is_punct(list, i, '}')) depth--;
+            continue;
+        }
+        ok = vglsl_name_put(&taken, token->text, token->length, NULL);
+        if (ok && i > 0 && vglsl_token_is(&list->tokens[i - 1], "struct")) {
+            ok = vglsl_name_put(&structs, token->text, token->length, NULL);
+        }
+        if (ok && depth == 0 && vglsl_is_function_name(list, i) &&
+            !vglsl_is_reserved_name(token->text, token->length)) {
+            ok = vglsl_name_put(&functions, token->text, token->length, NULL);
+        }
+    }
+    
+    /* Short names for functions, in order of first appearance */
+    int counter = 0;
+    for (int i = 0; i < list->count && ok; i++) {
+        VglslToken* token = &list->tokens[i];
+        if (token->type != VGLSL_TOKEN_IDENT) continue;
+        VglslNameEntry* function = vglsl_name_find(&functions, token->text, token->length);
+        if (!function || function->value) continue;
+        
+        char name[16];
+        size_t length = vglsl_next_free_name(&counter, &taken, name);
+        const char* renamed = vglsl_tokens_string(list, name, length);
+        ok = renamed && vglsl_name_put(&taken, renamed, length, NULL) &&
+             vglsl_name_put(&functions, token->text, token->length, renamed) &&
+             vglsl_renames_add(renames, token->text, token->length, renamed, NULL);
+    }
+    
+    declares = (bool*)VGLSL_MALLOC((list->count + 1) * sizeof(bool));
+    scope = (VglslScopeEntry*)VGLSL_MALLOC((list->count + 1) * sizeof(VglslScopeEntry));
+    ok = ok && declares && scope;
+    if (ok) memset(declares, 0, (list->count + 1) * sizeof(bool));
+    
+    /* Walk scopes, declaring and renaming locals */
+    int scope_count = 0;
+    int struct_depth = -1;       /* Brace depth of a struct body being skipped */
+    int local_counter = 0;
+    const VglslToken* function_name = NULL;
+    bool statement_start = false;
+    depth = 0;
+    
+    for (int i = 0; i < list->count && ok; i++) {
+        VglslToken* token = &list->tokens[i];
+        
+        if (token->type == VGLSL_TOKEN_PUNCT && token->length == 1) {
+            char c = token->text[0];
+            if (c == '{') {
+                depth++;
+                if (i > 0 && (vglsl_token_is(&list->tokens[i - 1], "struct") ||
+                              (i > 1 && vglsl_token_is(&list->tokens[i - 2], "struct")))) {
+                    if (struct_depth < 0) struct_depth = depth;
+                }
+            } else if (c == '}') {
+                if (depth == struct_depth) struct_depth = -1;
+                depth--;
+                while (scope_count > 0 && scope[scope_count - 1].depth > depth) scope_count--;
+                if (depth == 0) function_name = NULL;
+            }
+            statement_start = (c == '{' || c == '}' || c == ';') ||
+                              (c == '(' && i > 0 && vglsl_token_is(&list->tokens[i - 1], "for"));
+            continue;
+        }
+        
+        if (token->type != VGLSL_TOKEN_IDENT) {
+            statement_start = false;
+            continue;
+        }
+        
+        /* Function definition - parameters live in the body's scope */
+        if (depth == 0 && vglsl_is_function_name(list, i)) {
+            int close = vglsl_match_bracket(list, i + 1);
+            if (vglsl_token_is_punct(list, close + 1, '{')) {
+                function_name = token;
+                local_counter = 0;
+                int param_start = i + 2;
+                for (int j = i + 2; j <= close; j++) {
+                    if (!(vglsl_token_is_punct(list, j, ',') || j == close)) continue;
+                    
+                    /* Name is the last identifier, if the parameter has one */
+                    int type_count = 0;
+                    int last = -1;
+                    for (int k = param_start; k < j; k++) {
+                        if (vglsl_token_is_punct(list, k, '[')) break;
+                        if (list->tokens[k].type == VGLSL_TOKEN_IDENT && !vglsl_is_qualifier(&list->tokens[k])) {
+                            type_count++;
+                            last = k;
+                        }
+                    }
+                    if (type_count >= 2) declares[last] = true;
+                    param_start = j + 1;
+                }
+            }
+        }
+        
+        if (function_name && struct_depth < 0 && statement_start && depth > 0) {
+            vglsl_mark_declaration(list, i, &structs, declares);
+        }
+        statement_start = false;
+        
+        if (i > 0 && vglsl_token_is_punct(list, i - 1, '.')) continue;
+        
+        /* Struct and interface block members keep their names, even when a
+         * function or local has the same one */
+        if (struct_depth >= 0 || (depth > 0 && !function_name)) continue;
+        
+        if (declares[i]) {
+            char name[16];
+            size_t length = vglsl_next_free_name(&local_counter, &taken, name);
+            const char* renamed = vglsl_tokens_string(list, name, length);
+            ok = renamed && vglsl_renames_add(renames, token->text, token->length, renamed, function_name);
+            if (!ok) break;
+            
+            /* Parameters are declared before the body brace opens */
+            scope[scope_count].name = token->text;
+            scope[scope_count].length = token->length;
+            scope[scope_count].renamed = renamed;
+            scope[scope_count].depth = depth > 0 ? depth : 1;
+            scope_count++;
+            token->text = renamed;
+            token->length = length;
+            continue;
+        }
+        
+        bool renamed = false;
+        for (int s = scope_count - 1; s >= 0 && function_name; s--) {
+            if (scope[s].length == token->length && memcmp(scope[s].name, token->text, token->length) == 0) {
+                token->text = scope[s].renamed;
+                token->length = strlen(scope[s].renamed);
+                renamed = true;
+                break;
+            }
+        }
+        if (!renamed) {
+            VglslNameEntry* function = vglsl_name_find(&functions, token->text, token->length);
+            if (function && function->value) {
+                token->text = function->value;
+                token->length = strlen(function->value);
+            }
+        }
+    }
+    
+    VGLSL_FREE(declares);
+    VGLSL_FREE(scope);
+    vglsl_name_free(&taken);
+    vglsl_name_free(&structs);
+    vglsl_name_free(&functions);
+    return ok;
+}
+
+/* Constant folding - literal-only subexpressions evaluated with GLSL
+ * semantics: 32-bit wrapping int and uint, IEEE single precision float.
+ * Anything whose result GLSL leaves undefined, or that would need an
+ * implicit conversion, is left as written. */
+typedef enum {
+    VGLSL_CONST_INT,
+    VGLSL_CONST_UINT,
+    VGLSL_CONST_FLOAT
+} VglslConstType;
+
+typedef struct VglslConst {
+    VglslConstType type;
+    uint32_t bits;             /* int and uint */
+    float value;               /* float */
+} VglslConst;
+
+typedef struct VglslFolder {
+    const VglslTokenList* list;
+    int pos;
+    int end;
+    bool failed;
+} VglslFolder;
+
+static bool vglsl_fold_accept(VglslFolder* folder, const char* op) {
+    if (folder->pos >= folder->end) return false;
+    const VglslToken* token = &folder->list->tokens[folder->pos];
+    if (token->type != VGLSL_TOKEN_PUNCT || !vglsl_token_is(token, op)) return false;
+    folder->pos++;
+    return true;
+}
+
+static bool vglsl_parse_literal(const VglslToken* token, VglslConst* out) {
+    char text[64];
+    if (token->length >= sizeof(text)) return false;
+    memcpy(text, token->text, token->length);
+    text[token->length] = '\0';
+    
+    size_t length = token->length;
+    bool hex = (length > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'));
+    bool is_float = !hex && (strchr(text, '.') || strchr(text, 'e') || strchr(text, 'E'));
+    char* end;
+    
+    if (is_float) {
+        if (text[length - 1] == 'f' || text[length - 1] == 'F') {
+            if (length > 1 && (text[length - 2] == 'l' || text[length - 2] == 'L')) return false;
+            text[--length] = '\0';
+        }
+        out->type = VGLSL_CONST_FLOAT;
+        out->value = strtof(text, &end);
+        return *end == '\0' && isfinite(out->value);
+    }
+    
+    out->type = VGLSL_CONST_INT;
+    if (text[length - 1] == 'u' || text[length - 1] == 'U') {
+        out->type = VGLSL_CONST_UINT;
+        text[--length] = '\0';
+    }
+    
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 0);
+    if (*end != '\0' || errno != 0 || value > 0xFFFFFFFFull) return false;
+    
+    /* Decimal int literals must fit in a signed int */
+    if (out->type == VGLSL_CONST_INT && text[0] != '0' && value > 0x7FFFFFFFull) return false;
+    out->bits = (uint32_t)value;
+    return true;
+}
+
+static VglslConst vglsl_fold_expression(VglslFolder* folder, int level);
+
+static VglslConst vglsl_fold_unary(VglslFolder* folder) {
+    VglslConst value = {0};
+    if (folder->failed || folder->pos >= folder->end) {
+        folder->failed = true;
+        return value;
+    }
+    
+    if (vglsl_fold_accept(folder, "+")) return vglsl_fold_unary(folder);
+    if (vglsl_fold_accept(folder, "-")) {
+        value = vglsl_fold_unary(folder);
+        if (value.type == VGLSL_CONST_FLOAT) value.value = -value.value;
+        else value.bits = 0u - value.bits;
+        return value;
+    }
+    if (vglsl_fold_accept(folder, "~")) {
+        value = vglsl_fold_unary(folder);
+        if (value.type == VGLSL_CONST_FLOAT) folder->failed = true;
+        value.bits = ~value.bits;
+        return value;
+    }
+    if (vglsl_fold_accept(folder, "(")) {
+        value = vglsl_fold_expression(folder, 0);
+        if (!vglsl_fold_accept(folder, ")")) folder->failed = true;
+        return value;
+    }
+    
+    const VglslToken* token = &folder->list->tokens[folder->pos++];
+    if (token->type != VGLSL_TOKEN_NUMBER || !vglsl_parse_literal(token, &value)) {
+        folder->failed = true;
+    }
+    return value;
+}
+
+/* Apply a binary operator, failing on undefined or mixed-type cases */
+static VglslConst vglsl_fold_binary(VglslFolder* folder, const char* op, VglslConst a, VglslConst b) {
+    bool shift = (op[0] == '<' || op[0] == '>');
+    if (folder->failed || (a.type != b.type && !shift)) {
+        folder->failed = true;
+        return a;
+    }
+    
+    if (a.type == VGLSL_CONST_FLOAT) {
+        float result;
+        switch (op[0]) {
+            case '+': result = a.value + b.value; break;
+            case '-': result = a.value - b.value; break;
+            case '*': result = a.value * b.value; break;
+            case '/': result = b.value != 0.0f ? a.value / b.value : 0.0f; break;
+            default: folder->failed = true; return a;
+        }
+        if ((op[0] == '/' && b.value == 0.0f) || !isfinite(result)) folder->failed = true;
+        a.value = result;
+        return a;
+    }
+    
+    int32_t sa = (int32_t)a.bits;
+    int32_t sb = (int32_t)b.bits;
+    bool is_signed = (a.type == VGLSL_CONST_INT);
+    
+    if (shift) {
+        if (b.type == VGLSL_CONST_FLOAT || b.bits > 31) {
+            folder->failed = true;
+        } else if (op[0] == '<') {
+            a.bits <<= b.bits;
+        } else if (is_signed && sa < 0) {
+            a.bits = ~(~a.bits >> b.bits);
+        } else {
+            a.bits >>= b.bits;
+        }
+        return a;
+    }
+    
+    switch (op[0]) {
+        case '+': a.bits += b.bits; break;
+        case '-': a.bits -= b.bits; break;
+        case '*': a.bits *= b.bits; break;
+        case '&': a.bits &= b.bits; break;
+        case '^': a.bits ^= b.bits; break;
+        case '|': a.bits |= b.bits; break;
+        case '/':
+        case '%':
+            if (b.bits == 0 || (is_signed && (sa < 0 || sb < 0) && op[0] == '%') ||
+                (is_signed && sa == INT32_MIN && sb == -1)) {
+                folder->failed = true;
+            } else if (is_signed) {
+                a.bits = (uint32_t)(op[0] == '/' ? sa / sb : sa % sb);
+            } else {
+                a.bits = op[0] == '/' ? a.bits / b.bits : a.bits % b.bits;
+            }
+            break;
+        default:
+            folder->failed = true;
+    }
+    return a;
+}
+
+/* Binary operators from lowest to highest precedence */
+static VglslConst vglsl_fold_expression(VglslFolder* folder, int level) {
+    static const char* const levels[][3] = {
+        {"|", NULL, NULL}, {"^", NULL, NULL}, {"&", NULL, NULL},
+        {"<<", ">>", NULL}, {"+", "-", NULL}, {"*", "/", "%"}
+    };
+    static const int level_count = (int)(sizeof(levels) / sizeof(levels[0]));
+    
+    if (level >= level_count) return vglsl_fold_unary(folder);
+    
+    VglslConst value = vglsl_fold_expression(folder, level + 1);
+    for (;;) {
+        const char* op = NULL;
+        for (int i = 0; i < 3 && levels[level][i]; i++) {
+            if (vglsl_fold_accept(folder, levels[level][i])) {
+                op = levels[level][i];
+                break;
+            }
+        }
+        if (!op || folder->failed) return value;
+        value = vglsl_fold_binary(folder, op, value, vglsl_fold_expression(folder, level + 1));
+    }
+}
+
+/* Shortest literal spelling of a folded value, NULL if it has none */
+static size_t vglsl_format_const(const VglslConst* value, char* out, size_t size) {
+    if (value->type == VGLSL_CONST_INT) {
+        if ((int32_t)value->bits == INT32_MIN) return 0;
+        return (size_t)snprintf(out, size, "%d", (int)(int32_t)value->bits);
+    }
+    if (value->type == VGLSL_CONST_UINT) {
+        return (size_t)snprintf(out, size, "%uu", (unsigned)value->bits);
+    }
+    
+    for (int precision = 1; precision <= 9; precision++) {
+        snprintf(out, size, "%.*g", precision, (double)value->value);
+        if (strtof(out, NULL) == value->value) break;
+    }
+    if (!strpbrk(out, ".e")) strcat(out, ".0");
+    return strlen(out);
+}
+
+/* Token that may directly precede a complete expression operand */
+static bool vglsl_is_operand_start(const VglslToken* token) {
+    static const char* const delimiters[] = {
+        "=", "(", ",", "[", "{", ";", "+=", "-=", "*=", "/=", "%=", "<<=", ">>=", "&=", "^=", "|="
+    };
+    if (token->type == VGLSL_TOKEN_IDENT) return vglsl_token_is(token, "return");
+    if (token->type != VGLSL_TOKEN_PUNCT) return false;
+    for (size_t i = 0; i < sizeof(delimiters) / sizeof(delimiters[0]); i++) {
+        if (vglsl_token_is(token, delimiters[i])) return true;
+    }
+    return false;
+}
+
+static bool vglsl_fold_constants(VglslTokenList* list) {
+    for (int i = 0; i < list->count; i++) {
+        if (list->tokens[i].removed || !vglsl_is_operand_start(&list->tokens[i])) continue;
+        
+        /* The operand runs to the next top-level , ; ) ] or } */
+        int depth = 0;
+        int end = i + 1;
+        for (; end < list->count; end++) {
+            const VglslToken* token = &list->tokens[end];
+            if (token->type != VGLSL_TOKEN_PUNCT || token->length != 1) continue;
+            char c = token->text[0];
+            if (c == '(') depth++;
+            else if (c == ')' && depth > 0) depth--;
+            else if (depth == 0 && (c == ',' || c == ';' || c == ')' || c == ']' || c == '}')) break;
+        }
+        
+        /* Skip plain literals, with or without a sign */
+        int start = i + 1;
+        int length = end - start;
+        if (end >= list->count || length < 2) continue;
+        if (length == 2 && list->tokens[start].type == VGLSL_TOKEN_PUNCT &&
+            list->tokens[start + 1].type == VGLSL_TOKEN_NUMBER) continue;
+        
+        VglslFolder folder = {list, start, end, false};
+        VglslConst value = vglsl_fold_expression(&folder, 0);
+        if (folder.failed || folder.pos != end) continue;
+        
+        char text[64];
+        size_t text_length = vglsl_format_const(&value, text, sizeof(text));
+        if (text_length == 0 || text_length >= sizeof(text)) continue;
+        
+        VglslToken* result = &list->tokens[start];
+        result->type = VGLSL_TOKEN_NUMBER;
+        result->text = vglsl_tokens_string(list, text, text_length);
+        result->length = text_length;
+        if (!result->text) return false;
+        for (int j = start + 1; j < end; j++) {
+            list->tokens[j].removed = true;
+        }
+        if (result->space_length == 0 && list->tokens[i].type == VGLSL_TOKEN_IDENT) {
+            /* return(1+2) must not become return3 */
+            result->space = " ";
+            result->space_length = 1;
+        }
+        
+        /* Drop grouping parentheses around a non-negative result, unless
+         * they are all that separates it from return */
+        VglslToken* open = &list->tokens[i];
+        if (vglsl_token_is(open, "(") && text[0] != '-' && vglsl_token_is_punct(list, end, ')') &&
+            !(i > 0 && list->tokens[i - 1].type == VGLSL_TOKEN_IDENT &&
+              (!vglsl_token_is(&list->tokens[i - 1], "return") || open->space_length == 0)) &&
+            !vglsl_token_is_punct(list, i - 1, ']') &&
+            !vglsl_token_is_punct(list, end + 1, '.') && !vglsl_token_is_punct(list, end + 1, '[')) {
+            result->space = open->space;
+            result->space_length = open->space_length;
+            open->removed = true;
+            list->tokens[end].removed = true;
+        }
+        i = end - 1;
+    }
+    return true;
+}
+
+/* Parse the integer of a layout qualifier value, -1 if it is not a literal */
+static int vglsl_layout_value(const VglslToken* token) {
+    if (token->type != VGLSL_TOKEN_NUMBER) return -1;
+    VglslConst value;
+    if (!vglsl_parse_literal(token, &value) || value.type == VGLSL_CONST_FLOAT) return -1;
+    return (int)value.bits;
+}
+
+static bool vglsl_variables_add(VglslVariable** variables, int* count, const VglslVariable* variable) {
+    VglslVariable* grown = (VglslVariable*)VGLSL_REALLOC(*variables, (*count + 1) * sizeof(VglslVariable));
+    if (!grown) return false;
+    *variables = grown;
+    grown[(*count)++] = *variable;
+    return true;
+}
+
+static char* vglsl_token_strdup(const VglslToken* token) {
+    char* copy = (char*)VGLSL_MALLOC(token->length + 1);
+    if (copy) {
+        memcpy(copy, token->text, token->length);
+        copy[token->length] = '\0';
+    }
+    return copy;
+}
+
+/* Array size after a declarator name at index, 0 if none, -1 if unsized */
+static int vglsl_array_size(const VglslTokenList* list, int index, int* next) {
+    *next = index;
+    if (!vglsl_token_is_punct(list, index, '[')) return 0;
+    int close = vglsl_match_bracket(list, index);
+    *next = close + 1;
+    return close == index + 1 ? -1 : (close == index + 2 ? vglsl_layout_value(&list->tokens[index + 1]) : -1);
+}
+
+/* Record a global interface declaration starting at index, if it is one */
+static bool vglsl_reflect_declaration(const VglslTokenList* list, int index, VglslVariable** variables, int* count) {
+    VglslVariable variable = {0};
+    variable.location = -1;
+    variable.binding = -1;
+    variable.set = -1;
+    bool has_kind = false;
+    int i = index;
+    
+    while (i < list->count && list->tokens[i].type == VGLSL_TOKEN_IDENT) {
+        const VglslToken* token = &list->tokens[i];
+        if (vglsl_token_is(token, "layout") && vglsl_token_is_punct(list, i + 1, '(')) {
+            int close = vglsl_match_bracket(list, i + 1);
+            for (int j = i + 2; j < close; j++) {
+                if (list->tokens[j].type != VGLSL_TOKEN_IDENT || !vglsl_token_is_punct(list, j + 1, '=')) continue;
+                int value = j + 2 < close ? vglsl_layout_value(&list->tokens[j + 2]) : -1;
+                if (vglsl_token_is(&list->tokens[j], "location")) variable.location = value;
+                else if (vglsl_token_is(&list->tokens[j], "binding")) variable.binding = value;
+                else if (vglsl_token_is(&list->tokens[j], "set")) variable.set = value;
+            }
+            i = close + 1;
+            continue;
+        }
+        
+        if (vglsl_token_is(token, "uniform")) variable.kind = VGLSL_VARIABLE_UNIFORM;
+        else if (vglsl_token_is(token, "in") || vglsl_token_is(token, "attribute")) variable.kind = VGLSL_VARIABLE_IN;
+        else if (vglsl_token_is(token, "out") || vglsl_token_is(token, "varying")) variable.kind = VGLSL_VARIABLE_OUT;
+        else if (vglsl_token_is(token, "buffer")) variable.kind = VGLSL_VARIABLE_BUFFER;
+        else if (!vglsl_is_qualifier(token)) break;
+        else {
+            i++;
+            continue;
+        }
+        has_kind = true;
+        i++;
+    }
+    
+    /* Type, or block name */
+    if (!has_kind || i >= list->count || list->tokens[i].type != VGLSL_TOKEN_IDENT) return true;
+    const VglslToken* type = &list->tokens[i++];
+    
+    if (vglsl_token_is_punct(list, i, '{')) {
+        int close = vglsl_match_bracket(list, i);
+        int next = close + 1;
+        variable.block = true;
+        variable.type = vglsl_token_strdup(type);
+        if (next < list->count && list->tokens[next].type == VGLSL_TOKEN_IDENT) {
+            variable.name = vglsl_token_strdup(&list->tokens[next]);
+            variable.array_size = vglsl_array_size(list, next + 1, &next);
+        } else {
+            variable.name = vglsl_token_strdup(type);
+        }
+        if (!variable.name || !variable.type || !vglsl_variables_add(variables, count, &variable)) {
+            VGLSL_FREE(variable.name);
+            VGLSL_FREE(variable.type);
+            return false;
+        }
+        return true;
+    }
+    
+    variable.opaque = (type->length > 7 && memcmp(type->text, "sampler", 7) == 0) ||
+                      (type->length > 5 && memcmp(type->text, "image", 5) == 0) ||
+                      (type->length > 8 && (memcmp(type->text, "isampler", 8) == 0 ||
+                                            memcmp(type->text, "usampler", 8) == 0)) ||
+                      (type->length > 6 && (memcmp(type->text, "iimage", 6) == 0 ||
+                                            memcmp(type->text, "uimage", 6) == 0)) ||
+                      vglsl_token_is(type, "atomic_uint");
+    
+    /* float[4] name - the size belongs to every declarator */
+    int type_array = vglsl_array_size(list, i, &i);
+    
+    while (i < list->count && list->tokens[i].type == VGLSL_TOKEN_IDENT) {
+        VglslVariable declared = variable;
+        int next;
+        int array_size = vglsl_array_size(list, i + 1, &next);
+        declared.name = vglsl_token_strdup(&list->tokens[i]);
+        declared.type = vglsl_token_strdup(type);
+        declared.array_size = type_array ? type_array : array_size;
+        if (!declared.name || !declared.type || !vglsl_variables_add(variables, count, &declared)) {
+            VGLSL_FREE(declared.name);
+            VGLSL_FREE(declared.type);
+            return false;
+        }
+        
+        /* Skip an initializer, then continue after a comma */
+        int depth = 0;
+        for (i = next; i < list->count; i++) {
+            const VglslToken* token = &list->tokens[i];
+            if (token->type != VGLSL_TOKEN_PUNCT || token->length != 1) continue;
+            char c = token->text[0];
+            if (c == '(' || c == '[' || c == '{') depth++;
+            else if (c == ')' || c == ']' || c == '}') depth--;
+            else if (depth == 0 && (c == ',' || c == ';')) break;
+        }
+        if (!vglsl_token_is_punct(list, i, ',')) break;
+        i++;
+    }
+    return true;
+}
+
+/* Reflection - uniforms, samplers, inputs, outputs and buffers declared at
+ * global scope, with their layout location, binding and set */
+static bool vglsl_reflect(const VglslTokenList* list, VglslVariable** variables, int* count) {
+    int depth = 0;
+    bool statement_start = true;
+    
+    for (int i = 0; i < list->count; i++) {
+        const VglslToken* token = &list->tokens[i];
+        if (token->removed) continue;
+        
+        if (token->type == VGLSL_TOKEN_DIRECTIVE) {
+            statement_start = (depth == 0);
+            continue;
+        }
+        if (token->type == VGLSL_TOKEN_PUNCT && token->length == 1) {
+            char c = token->text[0];
+            if (c == '{' || c == '(' || c == '[') depth++;
+            else if (c == '}' || c == ')' || c == ']') depth--;
+            statement_start = (depth == 0 && (c == ';' || c == '}'));
+            continue;
+        }
+        
+        if (statement_start && depth == 0 && !vglsl_reflect_declaration(list, i, variables, count)) {
+            return false;
+        }
+        statement_start = false;
+    }
+    return true;
+}
+
+/* Reflect the statement collected so far */
+static bool vglsl_reflect_flush(VglslContext* ctx) {
+    VglslReflectStream* stream = &ctx->reflect_stream;
+    if (stream->length == 0) return true;
+    
+    VglslTokenList list = {0};
+    bool ok = vglsl_tokenize(stream->text, stream->length, &list) &&
+              vglsl_reflect(&list, &ctx->variables, &ctx->variable_count);
+    vglsl_tokens_free(&list);
+    stream->length = 0;
+    if (!ok) vglsl_set_error(ctx, "Failed to allocate memory for reflection", 0, "");
+    return ok;
+}
+
+static bool vglsl_reflect_keep(VglslContext* ctx, char c) {
+    VglslReflectStream* stream = &ctx->reflect_stream;
+    if (stream->length >= stream->capacity) {
+        size_t new_capacity = stream->capacity ? stream->capacity * 2 : 256;
+        char* text = (char*)VGLSL_REALLOC(stream->text, new_capacity);
+        if (!text) {
+            vglsl_set_error(ctx, "Failed to allocate memory for reflection", 0, "");
+            return false;
+        }
+        stream->text = text;
+        stream->capacity = new_capacity;
+    }
+    stream->text[stream->length++] = c;
+    return true;
+}
+
+/* Follow emitted output, reflecting each global statement as it ends */
+static bool vglsl_reflect_feed(VglslContext* ctx, const char* text, size_t length) {
+    VglslReflectStream* stream = &ctx->reflect_stream;
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        if (stream->mode == VGLSL_STREAM_LINE_COMMENT || stream->mode == VGLSL_STREAM_DIRECTIVE) {
+            if (c != '\n') continue;
+            stream->mode = VGLSL_STREAM_CODE;
+            stream->line_start = true;
+            if (!stream->in_body && !vglsl_reflect_keep(ctx, '\n')) return false;
+            continue;
+        }
+        if (stream->mode == VGLSL_STREAM_BLOCK_COMMENT) {
+            if (stream->star && c == '/') {
+                stream->mode = VGLSL_STREAM_CODE;
+                if (!stream->in_body && !vglsl_reflect_keep(ctx, ' ')) return false;
+            }
+            stream->star = (c == '*');
+            continue;
+        }
+        
+        if (stream->slash) {
+            stream->slash = false;
+            if (c == '/' || c == '*') {
+                stream->mode = c == '/' ? VGLSL_STREAM_LINE_COMMENT : VGLSL_STREAM_BLOCK_COMMENT;
+                stream->star = false;
+                continue;
+            }
+            if (!stream->in_body && !vglsl_reflect_keep(ctx, '/')) return false;
+        }
+        if (c == '/') {
+            stream->slash = true;
+            stream->line_start = false;
+            continue;
+        }
+        if (c == '#' && stream->line_start) {
+            stream->mode = VGLSL_STREAM_DIRECTIVE;
+            continue;
+        }
+        if (c == '\n') stream->line_start = true;
+        else if (c != ' ' && c != '\t' && c != '\r') stream->line_start = false;
+        
+        if (stream->in_body) {
+            if (c == '{') stream->depth++;
+            else if (c == '}' && --stream->depth == 0) stream->in_body = false;
+            continue;
+        }
+        
+        if (c == '{' && stream->depth == 0) {
+            /* A body after a parameter list belongs to a function */
+            size_t end = stream->length;
+            while (end > 0 && (stream->text[end - 1] == ' ' || stream->text[end - 1] == '\t' ||
+                               stream->text[end - 1] == '\r' || stream->text[end - 1] == '\n')) end--;
+            if (end > 0 && stream->text[end - 1] == ')') {
+                stream->length = 0;
+                stream->in_body = true;
+                stream->depth = 1;
+                continue;
+            }
+        }
+        if (c == '{' || c == '(' || c == '[') stream->depth++;
+        else if (c == '}' || c == ')' || c == ']') stream->depth--;
+        
+        if (!vglsl_reflect_keep(ctx, c)) return false;
+        if (c == ';' && stream->depth == 0 && !vglsl_reflect_flush(ctx)) return false;
+    }
+    return true;
+}
+
+/* Whether reflection follows the output, as no token pass runs */
+static bool vglsl_reflect_streams(const VglslConfig* config) {
+    return config->reflect && !config->minify && !config->strip_unused && !config->fold_constants;
+}
+
+/* Start following the output for reflection */
+static void vglsl_reflect_start(VglslContext* ctx) {
+    memset(&ctx->reflect_stream, 0, sizeof(VglslReflectStream));
+    ctx->reflect_stream.active = true;
+    ctx->reflect_stream.line_start = true;
+}
+
+/* Reflect what is left and stop following the output */
+static bool vglsl_reflect_finish(VglslContext* ctx) {
+    VglslReflectStream* stream = &ctx->reflect_stream;
+    if (!stream->active) return true;
+    stream->active = false;
+    if (stream->slash && !stream->in_body && !vglsl_reflect_keep(ctx, '/')) return false;
+    return stream->in_body || vglsl_reflect_flush(ctx);
+}
+
+/* Top-level declaration: a function, a prototype or a global statement */
+typedef struct VglslItem {
+    int start;
+    int end;                   /* Inclusive */
+    bool removable;            /* Function or const global, kept only if referenced */
+    bool reached;
+} VglslItem;
+
+/* Name defined by an item, chained with other items defining the same name */
+typedef struct VglslDefinition {
+    int item;
+    int next;
+} VglslDefinition;
+
+/* Split the token list into top-level items */
+static int vglsl_split_items(const VglslTokenList* list, VglslItem* items) {
+    int count = 0;
+    int i = 0;
+    
+    while (i < list->count) {
+        VglslItem* item = &items[count++];
+        item->start = i;
+        item->removable = false;
+        item->reached = false;
+        
+        if (list->tokens[i].type == VGLSL_TOKEN_DIRECTIVE) {
+            item->end = i++;
+            continue;
+        }
+        
+        int depth = 0;
+        int end = list->count - 1;
+        for (int j = i; j < list->count; j++) {
+            if (depth == 0 && vglsl_is_function_name(list, j)) {
+                int close = vglsl_match_bracket(list, j + 1);
+                if (vglsl_token_is_punct(list, close + 1, '{')) {
+                    end = vglsl_match_bracket(list, close + 1);
+                    break;
+                }
+            }
+            
+            const VglslToken* token = &list->tokens[j];
+            if (token->type != VGLSL_TOKEN_PUNCT || token->length != 1) continue;
+            char c = token->text[0];
+            if (c == '(' || c == '[' || c == '{') depth++;
+            else if (c == ')' || c == ']' || c == '}') depth--;
+            else if (c == ';' && depth == 0) {
+                end = j;
+                break;
+            }
+        }
+        
+        item->end = end < list->count ? end : list->count - 1;
+        i = item->end + 1;
+    }
+    return count;
+}
+
+static bool vglsl_define_name(VglslNameMap* names, VglslDefinition** definitions, int* definition_count,
+                              const VglslToken* token, int item) {
+    VglslNameEntry* entry = vglsl_name_find(names, token->text, token->length);
+    if (!entry) {
+        if (!vglsl_name_put(names, token->text, token->length, NULL)) return false;
+        entry = vglsl_name_find(names, token->text, token->length);
+        entry->index = -1;
+    }
+    
+    VglslDefinition* grown = (VglslDefinition*)VGLSL_REALLOC(*definitions, (*definition_count + 1) * sizeof(VglslDefinition));
+    if (!grown) return false;
+    *definitions = grown;
+    grown[*definition_count].item = item;
+    grown[*definition_count].next = entry->index;
+    entry->index = (*definition_count)++;
+    return true;
+}
+
+/* Names an item defines: the function name, or the declarators of a const global */
+static bool vglsl_item_definitions(const VglslTokenList* list, VglslItem* items, int index,
+                                   VglslNameMap* names, VglslDefinition** definitions, int* definition_count,
+                                   bool* has_main) {
+    VglslItem* item = &items[index];
+    int depth = 0;
+    bool is_const = false;
+    bool in_initializer = false;
+    
+    for (int i = item->start; i <= item->end && vglsl_is_qualifier(&list->tokens[i]); i++) {
+        if (vglsl_token_is(&list->tokens[i], "const")) is_const = true;
+    }
+    
+    for (int i = item->start; i <= item->end; i++) {
+        const VglslToken* token = &list->tokens[i];
+        if (token->type == VGLSL_TOKEN_PUNCT && token->length == 1) {
+            char c = token->text[0];
+            if (c == '(' || c == '[' || c == '{') depth++;
+            else if (c == ')' || c == ']' || c == '}') depth--;
+            else if (c == '=' && depth == 0) in_initializer = true;
+            else if (c == ',' && depth == 0) in_initializer = false;
+            continue;
+        }
+        if (token->type != VGLSL_TOKEN_IDENT || depth != 0) continue;
+        
+        if (vglsl_is_function_name(list, i)) {
+            if (vglsl_token_is(token, "main")) {
+                *has_main = true;
+                return true;
+            }
+            item->removable = true;
+            return vglsl_define_name(names, definitions, definition_count, token, index);
+        }
+        
+        if (is_const && !in_initializer && !vglsl_is_reserved_name(token->text, token->length) &&
+            (vglsl_token_is_punct(list, i + 1, '=') || vglsl_token_is_punct(list, i + 1, '[') ||
+             vglsl_token_is_punct(list, i + 1, ',') || vglsl_token_is_punct(list, i + 1, ';'))) {
+            item->removable = true;
+            if (!vglsl_define_name(names, definitions, definition_count, token, index)) return false;
+        }
+    }
+    return true;
+}
+
+/* Dead code stripping - keep main, every global that is not a function or
+ * const, and whatever they reference; drop the rest. Directives inside
+ * dropped code are kept. Without a main nothing is dropped. */
+static bool vglsl_strip_unused(VglslTokenList* list) {
+    VglslItem* items = (VglslItem*)VGLSL_MALLOC((list->count + 1) * sizeof(VglslItem));
+    int* worklist = (int*)VGLSL_MALLOC((list->count + 1) * sizeof(int));
+    VglslDefinition* definitions = NULL;
+    int definition_count = 0;
+    VglslNameMap names = {0};
+    bool has_main = false;
+    bool ok = items && worklist;
+    
+    int item_count = ok ? vglsl_split_items(list, items) : 0;
+    for (int i = 0; i < item_count && ok; i++) {
+        ok = vglsl_item_definitions(list, items, i, &names, &definitions, &definition_count, &has_main);
+    }
+    
+    if (ok && has_main) {
+        int pending = 0;
+        for (int i = 0; i < item_count; i++) {
+            if (!items[i].removable) {
+                items[i].reached = true;
+                worklist[pending++] = i;
+            }
+        }
+        
+        /* Everything an item references is reached too */
+        while (pending > 0) {
+            const VglslItem* item = &items[worklist[--pending]];
+            for (int i = item->start; i <= item->end; i++) {
+                const VglslToken* token = &list->tokens[i];
+                if (token->type != VGLSL_TOKEN_IDENT || vglsl_token_is_punct(list, i - 1, '.')) continue;
+                
+                VglslNameEntry* entry = vglsl_name_find(&names, token->text, token->length);
+                for (int d = entry ? entry->index : -1; d >= 0; d = definitions[d].next) {
+                    if (!items[definitions[d].item].reached) {
+                        items[definitions[d].item].reached = true;
+                        worklist[pending++] = definitions[d].item;
+                    }
+                }
+            }
+        }
+        
+        for (int i = 0; i < item_count; i++) {
+            if (items[i].reached) continue;
+            for (int j = items[i].start; j <= items[i].end; j++) {
+                if (list->tokens[j].type != VGLSL_TOKEN_DIRECTIVE) list->tokens[j].removed = true;
+            }
+        }
+    }
+    
+    VGLSL_FREE(items);
+    VGLSL_FREE(worklist);
+    VGLSL_FREE(definitions);
+    vglsl_name_free(&names);
+    return ok;
+}
+
+/* Take the output built so far as one buffer and reset the builder */
+static char* vglsl_take_output(VglslContext* ctx, size_t* length) {
+    char* text;
+    *length = ctx->output_size;
+    
+    if (ctx->storage) {
+        text = (char*)VGLSL_MALLOC(ctx->output_size + 1);
+        if (!text) return NULL;
+        size_t offset = 0;
+        for (int i = 0; i < ctx->segment_count; i++) {
+            memcpy(text + offset, ctx->segments[i].data, ctx->segments[i].length);
+            offset += ctx->segments[i].length;
+        }
+        text[offset] = '\0';
+        ctx->segment_count = 0;
+    } else {
+        text = ctx->output;
+        ctx->output = (char*)VGLSL_MALLOC(4096);
+        ctx->output_capacity = 4096;
+        if (!ctx->output) {
+            ctx->output = text;
+            return NULL;
+        }
+        ctx->output[0] = '\0';
+    }
+    
+    ctx->output_size = 0;
+    vglsl_hash_init(&ctx->hash);
+    return text;
+}
+
+/* Run the enabled token passes over text, emitting the result to ctx */
+static bool vglsl_transform(VglslContext* ctx, const char* text, size_t length) {
+    const VglslConfig* config = ctx->config;
+    if (!config->minify && !config->strip_unused && !config->fold_constants) {
+        return vglsl_emit(ctx, text, length) && vglsl_reflect_finish(ctx);
+    }
+    
+    VglslTokenList list = {0};
+    bool ok = vglsl_tokenize(text, length, &list);
+    
+    if (ok && config->fold_constants) {
+        ok = vglsl_fold_constants(&list);
+    }
+    
+    if (ok && config->strip_unused) {
+        ok = vglsl_strip_unused(&list);
+    }
+    
+    if (ok && config->minify) {
+        VglslRenames renames = {0};
+        ok = vglsl_minify_names(&list, &renames);
+        ctx->renames = renames.items;
+        ctx->rename_count = renames.count;
+    }
+    
+    if (ok && config->reflect) {
+        ok = vglsl_reflect(&list, &ctx->variables, &ctx->variable_count);
+    }
+    
+    if (!ok) {
+        vglsl_set_error(ctx, "Failed to allocate memory for output passes", 0, "");
+    } else {
+        ok = vglsl_emit_tokens(ctx, &list, config->minify);
+    }
+    
+    vglsl_tokens_free(&list);
+    return ok;
+}
+
+static void vglsl_cleanup_context(VglslContext* ctx);
+
+/* Build one output per #pragma stage section. Each stage gets the shared
+ * sections (before the first pragma, or marked "common") and its own, in
+ * source order, then goes through the same passes as the full output. */
+static bool vglsl_build_stages(VglslContext* ctx, const char* text, size_t length) {
+    ctx->stages = (VglslStage*)VGLSL_MALLOC(ctx->stage_count * sizeof(VglslStage));
+    char* composed = (char*)VGLSL_MALLOC(length + 1);
+    if (!ctx->stages || !composed) {
+        VGLSL_FREE(composed);
+        vglsl_set_error(ctx, "Failed to allocate memory for stage output", 0, "");
+        return false;
+    }
+    memset(ctx->stages, 0, ctx->stage_count * sizeof(VglslStage));
+    
+    bool ok = true;
+    for (int s = 0; s < ctx->stage_count && ok; s++) {
+        size_t composed_length = 0;
+        for (int m = -1; m < ctx->stage_mark_count; m++) {
+            size_t start = m < 0 ? 0 : ctx->stage_marks[m].offset;
+            size_t end = m + 1 < ctx->stage_mark_count ? ctx->stage_marks[m + 1].offset : length;
+            int stage = m < 0 ? -1 : ctx->stage_marks[m].stage;
+            if (stage != -1 && stage != s) continue;
+            memcpy(composed + composed_length, text + start, end - start);
+            composed_length += end - start;
+        }
+        
+        VglslContext stage = {0};
+        stage.config = ctx->config;
+        vglsl_hash_init(&stage.hash);
+        stage.output_capacity = composed_length + 1;
+        stage.output = (char*)VGLSL_MALLOC(stage.output_capacity);
+        if (vglsl_reflect_streams(ctx->config)) vglsl_reflect_start(&stage);
+        ok = stage.output && vglsl_transform(&stage, composed, composed_length);
+        
+        ctx->stages[s].name = ctx->stage_names[s];
+        ctx->stage_names[s] = NULL; /* Transfer ownership */
+        if (ok) {
+            stage.output[stage.output_size] = '\0';
+            ctx->stages[s].output = stage.output;
+            ctx->stages[s].output_length = stage.output_size;
+            ctx->stages[s].output_hash = vglsl_hash_digest(&stage.hash);
+            ctx->stages[s].variables = stage.variables;
+            ctx->stages[s].variable_count = stage.variable_count;
+            ctx->stages[s].renames = stage.renames;
+            ctx->stages[s].rename_count = stage.rename_count;
+            stage.output = NULL;
+            stage.variables = NULL;
+            stage.variable_count = 0;
+            stage.renames = NULL;
+            stage.rename_count = 0;
+        }
+        vglsl_cleanup_context(&stage);
+    }
+    
+    VGLSL_FREE(composed);
+    if (!ok) vglsl_set_error(ctx, "Failed to allocate memory for stage output", 0, "");
+    return ok;
+}
+
+/* Split stages and run the output passes on the complete text */
+static bool vglsl_post_process(VglslContext* ctx) {
+    const VglslConfig* config = ctx->config;
+    if (!config->minify && !config->strip_unused && !config->fold_constants) {
+        /* Reflection followed the output as it was emitted */
+        if (!vglsl_reflect_finish(ctx)) return false;
+        if (ctx->stage_count == 0) return true;
+    }
+    
+    size_t length;
+    char* text = vglsl_take_output(ctx, &length);
+    if (!text) {
+        vglsl_set_error(ctx, "Failed to allocate memory for output", 0, "");
+        return false;
+    }
+    
+    bool ok = (ctx->stage_count == 0 || vglsl_build_stages(ctx, text, length)) &&
+              vglsl_transform(ctx, text, length);
+    VGLSL_FREE(text);
+    return ok;
+}
+
+/* Clean up context */
+static void vglsl_cleanup_context(VglslContext* ctx) {
+    vglsl_node_release(ctx->defines.root);
+    
+    if (ctx->output) {
+        VGLSL_FREE(ctx->output);
+    }
+    
+    /* Root frame, plus any include frames left over after an error */
+    for (int i = 0; i < ctx->frame_count; i++) {
+        vglsl_release_source(ctx, &ctx->frames[i].source);
+        VGLSL_FREE(ctx->frames[i].filename);
+        VGLSL_FREE(ctx->frames[i].directory);
+        VGLSL_FREE(ctx->frames[i].guard);
+    }
+    for (int i = 0; i < ctx->once_count; i++) {
+        VGLSL_FREE(ctx->once[i].path);
+        VGLSL_FREE(ctx->once[i].guard);
+    }
+    VGLSL_FREE(ctx->once);
+    for (int i = 0; i < ctx->file_capacity; i++) {
+        VGLSL_FREE(ctx->file_table[i].path);
+        VGLSL_FREE(ctx->file_table[i].canonical);
+    }
+    VGLSL_FREE(ctx->file_table);
+    if (ctx->owns_listings) vglsl_include_cache_destroy(ctx->listings);
+    vglsl_probe_release(ctx);
+    vglsl_prefetch_release(ctx);
+    
+    VGLSL_FREE(ctx->segments);
+    vglsl_free_storage(ctx->storage);
+    VGLSL_FREE(ctx->frames);
+    VGLSL_FREE(ctx->scratch);
+    vglsl_free_renames(ctx->renames, ctx->rename_count);
+    vglsl_free_stages(ctx->stages, ctx->stages ? ctx->stage_count : 0);
+    vglsl_free_variables(ctx->variables, ctx->variable_count);
+    VGLSL_FREE(ctx->reflect_stream.text);
+    for (int i = 0; i < ctx->stage_count; i++) {
+        VGLSL_FREE(ctx->stage_names[i]);
+    }
+    VGLSL_FREE(ctx->stage_names);
+    VGLSL_FREE(ctx->stage_marks);
+    
+    if (ctx->error_message) {
+        VGLSL_FREE(ctx->error_message);
+    }
+    
+    if (ctx->error_file) {
+        VGLSL_FREE(ctx->error_file);
+    }
+}
+
+static bool vglsl_export_define(const VglslDefine* define, void* user_data) {
+    VglslResult* result = (VglslResult*)user_data;
+    VglslMacro* macro = &result->macros[result->macro_count++];
+    memset(macro, 0, sizeof(*macro));
+    macro->name = vglsl_strdup(define->name);
+    macro->value = vglsl_strdup(define->value);
+    macro->is_function = define->is_function_macro;
+    if (define->param_count > 0) {
+        macro->params = (char**)VGLSL_MALLOC(define->param_count * sizeof(char*));
+        if (!macro->params) return false;
+        for (int i = 0; i < define->param_count; i++) {
+            macro->params[i] = vglsl_strdup(define->params[i]);
+            macro->param_count++;
+            if (!macro->params[i]) return false;
+        }
+    }
+    return macro->name && macro->value;
+}
+
+static int vglsl_compare_macros(const void* a, const void* b) {
+    return strcmp(((const VglslMacro*)a)->name, ((const VglslMacro*)b)->name);
+}
+
+/* Copy the define table into the result, sorted by name */
+static bool vglsl_export_defines(VglslContext* ctx, VglslResult* result) {
+    if (ctx->defines.count == 0) return true;
+    result->macros = (VglslMacro*)VGLSL_MALLOC(ctx->defines.count * sizeof(VglslMacro));
+    if (!result->macros) return false;
+    if (!vglsl_map_each(ctx->defines.root, vglsl_export_define, result)) return false;
+    qsort(result->macros, result->macro_count, sizeof(VglslMacro), vglsl_compare_macros);
+    return true;
+}
+
+static void vglsl_free_result_macros(VglslMacro* macros, int count) {
+    for (int i = 0; i < count; i++) {
+        VGLSL_FREE(macros[i].name);
+        VGLSL_FREE(macros[i].value);
+        for (int j = 0; j < macros[i].param_count; j++) {
+            VGLSL_FREE(macros[i].params[j]);
+        }
+        VGLSL_FREE(macros[i].params);
+    }
+    VGLSL_FREE(macros);
+}
+
+static bool vglsl_snapshot_capture(VglslContext* ctx, VglslSnapshot* snapshot);
+
+/* Main parsing function - takes ownership of the root source. With capture
+ * the state before the output passes is stored there as well; with files
+ * every included file is recorded. */
+static VglslResult vglsl_parse_capture(VglslSource* source, const char* filename, const VglslConfig* config,
+                                       VglslSnapshot* capture, VglslFileList* files) {
+    VglslResult result = {0};
+    VglslContext ctx = {0};
+    
+    /* Initialize context */
+    ctx.config = config;
+    ctx.files = files;
+    if (config->include_path_count > 0) {
+        VglslHash search;
+        vglsl_hash_init(&search);
+        for (int i = 0; i < config->include_path_count; i++) vglsl_hash_string(&search, config->include_paths[i]);
+        ctx.search_hash = vglsl_hash_digest(&search);
+    }
+#ifdef VGLSL_HAS_MMAP
+    if (config->include_cache) vglsl_include_cache_refresh(config->include_cache);
+#endif
+    if (config->base_defines) ctx.defines = config->base_defines->map;
+    if (config->snapshot) ctx.defines = config->snapshot->defines->map;
+    vglsl_hash_init(&ctx.hash);
+    if (vglsl_reflect_streams(config)) vglsl_reflect_start(&ctx);
+    ctx.output_capacity = 4096;
+    ctx.output = (char*)VGLSL_MALLOC(ctx.output_capacity);
+    if (!ctx.output) {
+        vglsl_source_close(source);
+        result.error_message = vglsl_strdup("Failed to allocate output buffer");
+        return result;
+    }
+    ctx.output[0] = '\0';
+    
+    if (config->output_segments) {
+        ctx.storage = (VglslStorage*)VGLSL_MALLOC(sizeof(VglslStorage));
+        if (!ctx.storage) {
+            vglsl_source_close(source);
+            vglsl_cleanup_context(&ctx);
+            result.error_message = vglsl_strdup("Failed to allocate output buffer");
+            return result;
+        }
+        memset(ctx.storage, 0, sizeof(VglslStorage));
+    }
+    
+    ctx.scratch = (char*)VGLSL_MALLOC(4 * VGLSL_MAX_LINE_LENGTH);
+    if (!ctx.scratch) {
+        vglsl_source_close(source);
+        vglsl_cleanup_context(&ctx);
+        result.error_message = vglsl_strdup("Failed to allocate line buffers");
+        return result;
+    }
+    ctx.line_buffer = ctx.scratch;
+    ctx.processed_line = ctx.scratch + VGLSL_MAX_LINE_LENGTH;
+    ctx.directive = ctx.scratch + 2 * VGLSL_MAX_LINE_LENGTH;
+    ctx.expanded_line = ctx.scratch + 3 * VGLSL_MAX_LINE_LENGTH;
+    
+    /* The snapshot prelude comes first */
+    if (config->snapshot && config->snapshot->prelude_length > 0) {
+        vglsl_emit(&ctx, config->snapshot->prelude, config->snapshot->prelude_length);
+    }
+    
+    /* Predefined macros */
+    for (int i = 0; i < config->define_count && !ctx.has_error; i++) {
+        vglsl_add_config_define(&ctx, config->defines[i]);
+    }
+    
+    /* The root source is the bottom frame of the include stack */
+    bool success = !ctx.has_error && vglsl_push_frame(&ctx, source, filename, NULL, 0);
+    if (success) {
+        vglsl_prefetch_scan(&ctx, &ctx.frames[0]);
+        success = vglsl_run(&ctx);
+    }
+    int line_num = ctx.frame_count > 0 ? ctx.frames[0].line_num - 1 : 0;
+    
+    /* Check for unclosed conditionals */
+    if (success && ctx.if_depth > 0) {
+        vglsl_set_error(&ctx, "Unclosed conditional directive", line_num, filename);
+        success = false;
+    }
+    
+    if (success && capture) success = vglsl_snapshot_capture(&ctx, capture);
+    
+    /* Output passes run on the complete text */
+    if (success && !ctx.has_error) {
+        success = vglsl_post_process(&ctx);
+    }
+    
+    /* Build result */
+    if (success && !ctx.has_error) {
+        result.success = true;
+        result.output_length = ctx.output_size;
+        result.output_hash = vglsl_hash_digest(&ctx.hash);
+        result.output_changed = (result.output_hash != config->previous_hash);
+        result.renames = ctx.renames;
+        result.rename_count = ctx.rename_count;
+        result.stages = ctx.stages;
+        result.stage_count = ctx.stages ? ctx.stage_count : 0;
+        ctx.renames = NULL; /* Transfer ownership */
+        ctx.rename_count = 0;
+        ctx.stages = NULL;
+        result.variables = ctx.variables;
+        result.variable_count = ctx.variable_count;
+        ctx.variables = NULL;
+        ctx.variable_count = 0;
+        if (config->export_defines && !vglsl_export_defines(&ctx, &result)) {
+            vglsl_free_result(&result);
+            result.error_message = vglsl_strdup("Failed to allocate define table");
+            vglsl_cleanup_context(&ctx);
+            return result;
+        }
+        if (ctx.storage) {
+            /* Pin the remaining root source before handing storage over */
+            for (int i = 0; i < ctx.frame_count; i++) {
+                vglsl_release_source(&ctx, &ctx.frames[i].source);
+            }
+            result.segments = ctx.segments;
+            result.segment_count = ctx.segment_count;
+            result.storage = ctx.storage;
+            ctx.segments = NULL; /* Transfer ownership */
+            ctx.storage = NULL;
+        } else {
+            result.output = ctx.output;
+            ctx.output = NULL; /* Transfer ownership */
+        }
+    } else {
+        result.success = false;
+        result.error_message = ctx.error_message;
+        result.error_line = ctx.error_line;
+        result.error_file = ctx.error_file;
+        ctx.error_message = NULL; /* Transfer ownership */
+        ctx.error_file = NULL;
+    }
+    
+    vglsl_cleanup_context(&ctx);
+    return result;
+}
+
+static VglslResult vglsl_parse_internal(VglslSource* source, const char* filename, const VglslConfig* config) {
+    return vglsl_parse_capture(source, filename, config, NULL, NULL);
+}
+
+/* Public API implementations */
+VglslResult vglsl_parse_file(const char* filename, const char* base_path) {
+    VglslConfig config = vglsl_default_config();
+    config.base_path = base_path;
+    return vglsl_parse_file_ex(filename, &config);
+}
+
+/* Parse a root file, recording the files read when files is given */
+static VglslResult vglsl_parse_file_tracked(const char* filename, const VglslConfig* config, VglslFileList* files) {
+    VglslResult result = {0};
+    if (files && !vglsl_file_list_add(files, filename, NULL)) {
+        result.error_message = vglsl_strdup("Failed to allocate file list");
+        return result;
+    }
+    
+    VglslSource source;
+    if (!vglsl_source_from_file(config, filename, &source)) {
+        char error_msg[512];
+        snprintf(error_msg, sizeof(error_msg), "Failed to read file: %s", filename);
+        result.error_message = vglsl_strdup(error_msg);
+        return result;
+    }
+    
+    return vglsl_parse_capture(&source, filename, config, NULL, files);
+}
+
+VglslResult vglsl_parse_file_ex(const char* filename, const VglslConfig* config) {
+    return vglsl_parse_file_tracked(filename, config, NULL);
+}
+
+VglslResult vglsl_parse_memory(const char* source, const char* filename) {
+    VglslConfig config = vglsl_default_config();
+    return vglsl_parse_memory_ex(source, filename, &config);
+}
+
+VglslResult vglsl_parse_memory_ex(const char* source, const char* filename, const VglslConfig* config) {
+    VglslSource memory = vglsl_source_from_memory(source, strlen(source));
+    return vglsl_parse_internal(&memory, filename, config);
+}
+
+VglslResult vglsl_parse_memory_n(const char* source, size_t length, const char* filename, const VglslConfig* config) {
+    VglslSource memory = vglsl_source_from_memory(source, length);
+    return vglsl_parse_internal(&memory, filename, config);
+}
+
+VglslResult vglsl_parse_memory_pieces(const char* const* strings, const int* lengths, int count,
+                                      const char* filename, const VglslConfig* config) {
+    VglslResult result = {0};
+    if (count <= 0) {
+        VglslSource empty = vglsl_source_from_memory("", 0);
+        return vglsl_parse_internal(&empty, filename, config);
+    }
+    
+    VglslSegment* pieces = (VglslSegment*)VGLSL_MALLOC(count * sizeof(VglslSegment));
+    if (!pieces) {
+        result.error_message = vglsl_strdup("Failed to allocate source pieces");
+        return result;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        pieces[i].data = strings[i] ? strings[i] : "";
+        pieces[i].length = (lengths && lengths[i] >= 0) ? (size_t)lengths[i] : strlen(pieces[i].data);
+    }
+    
+    VglslSource source = vglsl_source_from_memory(pieces[0].data, pieces[0].length);
+    source.pieces = pieces + 1;
+    source.piece_count = count - 1;
+    
+    result = vglsl_parse_internal(&source, filename, config);
+    VGLSL_FREE(pieces);
+    return result;
+}
+
+void vglsl_free_result(VglslResult* result) {
+    if (!result) return;
+    
+    if (result->output) {
+        VGLSL_FREE(result->output);
+        result->output = NULL;
+    }
+    
+    if (result->error_message) {
+        VGLSL_FREE(result->error_message);
+        result->error_message = NULL;
+    }
+    
+    if (result->error_file) {
+        VGLSL_FREE(result->error_file);
+        result->error_file = NULL;
+    }
+    
+    VGLSL_FREE(result->segments);
+    result->segments = NULL;
+    result->segment_count = 0;
+    vglsl_free_storage((VglslStorage*)result->storage);
+    result->storage = NULL;
+    result->output_length = 0;
+    result->output_hash = 0;
+    result->output_changed = false;
+    result->cache_hit = false;
+    vglsl_free_renames(result->renames, result->rename_count);
+    result->renames = NULL;
+    result->rename_count = 0;
+    vglsl_free_stages(result->stages, result->stage_count);
+    result->stages = NULL;
+    result->stage_count = 0;
+    vglsl_free_variables(result->variables, result->variable_count);
+    result->variables = NULL;
+    result->variable_count = 0;
+    vglsl_free_result_macros(result->macros, result->macro_count);
+    result->macros = NULL;
+    result->macro_count = 0;
+    
+    result->success = false;
+    result->error_line = 0;
+}
+
+/* Frozen define sets */
+static void vglsl_define_freeze(VglslDefine* define) {
+    if (define->frozen) {
+        define->refs++;
+    } else {
+        define->frozen = true;
+    }
+}
+
+/* Hand a parse-owned trie over to a define set. Nodes and defines already
+ * frozen gain the new parent's reference; the rest keep their count. */
+static void vglsl_node_freeze(VglslDefineNode* node) {
+    if (node->frozen) {
+        node->refs++;
+        return;
+    }
+    node->frozen = true;
+    for (int i = 0; i < node->count; i++) {
+        if (i < node->leaf_count) vglsl_define_freeze((VglslDefine*)node->items[i]);
+        else vglsl_node_freeze((VglslDefineNode*)node->items[i]);
+    }
+}
+
+static void vglsl_define_release_frozen(VglslDefine* define) {
+    if (--define->refs > 0) return;
+    define->frozen = false;
+    define->refs = 1;
+    vglsl_define_release(define);
+}
+
+static void vglsl_node_release_frozen(VglslDefineNode* node) {
+    if (!node || !node->frozen) {
+        vglsl_node_release(node);
+        return;
+    }
+    if (--node->refs > 0) return;
+    for (int i = 0; i < node->count; i++) {
+        if (i < node->leaf_count) vglsl_define_release_frozen((VglslDefine*)node->items[i]);
+        else vglsl_node_release_frozen((VglslDefineNode*)node->items[i]);
+    }
+    VGLSL_FREE(node);
+}
+
+/* Add the content hash of one define; summed, so order does not matter */
+static bool vglsl_sum_define_hash(const VglslDefine* define, void* user_data) {
+    VglslHash hash;
+    vglsl_hash_init(&hash);
+    vglsl_hash_update(&hash, define->name, strlen(define->name) + 1);
+    vglsl_hash_update(&hash, define->value, strlen(define->value) + 1);
+    for (int i = 0; i < define->param_count; i++) {
+        vglsl_hash_update(&hash, define->params[i], strlen(define->params[i]) + 1);
+    }
+    vglsl_hash_update(&hash, define->is_function_macro ? "(" : "", 1);
+    *(uint64_t*)user_data += vglsl_hash_digest(&hash);
+    return true;
+}
+
+/* Freeze map into a new set, or release it on failure */
+static VglslDefineSet* vglsl_define_set_finish(VglslDefineMap* map, bool ok) {
+    VglslDefineSet* set = ok ? (VglslDefineSet*)VGLSL_MALLOC(sizeof(VglslDefineSet)) : NULL;
+    if (!set) {
+        vglsl_node_release(map->root);
+        return NULL;
+    }
+    if (map->root) vglsl_node_freeze(map->root);
+    set->map = *map;
+    set->hash = 0;
+    vglsl_map_each(map->root, vglsl_sum_define_hash, &set->hash);
+    return set;
+}
+
+/* Apply "NAME" / "NAME=VALUE" entries to a map */
+static bool vglsl_map_set_entries(VglslDefineMap* map, const char* const* defines, int count) {
+    for (int i = 0; i < count; i++) {
+        const char* equals = strchr(defines[i], '=');
+        size_t name_len = equals ? (size_t)(equals - defines[i]) : strlen(defines[i]);
+        while (name_len > 0 && (defines[i][name_len - 1] == ' ' || defines[i][name_len - 1] == '\t')) name_len--;
+        if (name_len == 0) return false;
+        
+        VglslDefine* define = vglsl_define_create(defines[i], name_len, equals ? equals + 1 : "", NULL, 0, false);
+        if (!define || !vglsl_map_set(map, define)) return false;
+    }
+    return true;
+}
+
+VglslDefineSet* vglsl_define_set_create(const char* const* defines, int count) {
+    VglslDefineMap map = {0};
+    return vglsl_define_set_finish(&map, vglsl_map_set_entries(&map, defines, count));
+}
+
+VglslDefineSet* vglsl_define_set_fork(const VglslDefineSet* base, const char* const* defines, int count) {
+    VglslDefineMap map = {0};
+    if (base) map = base->map;
+    bool ok = vglsl_map_set_entries(&map, defines, count);
+    
+    /* Unchanged fork - share the base root outright */
+    if (ok && base && map.root == base->map.root) {
+        VglslDefineSet* set = (VglslDefineSet*)VGLSL_MALLOC(sizeof(VglslDefineSet));
+        if (set && map.root) map.root->refs++;
+        if (set) {
+            set->map = map;
+            set->hash = base->hash;
+        }
+        return set;
+    }
+    return vglsl_define_set_finish(&map, ok);
+}
+
+VglslDefineSet* vglsl_define_set_from_result(const VglslResult* result) {
+    if (!result) return NULL;
+    VglslDefineMap map = {0};
+    bool ok = true;
+    
+    for (int i = 0; i < result->macro_count && ok; i++) {
+        const VglslMacro* macro = &result->macros[i];
+        VglslDefine* define = vglsl_define_create(macro->name, strlen(macro->name), macro->value,
+                                                  macro->params, macro->param_count, macro->is_function);
+        ok = define && vglsl_map_set(&map, define);
+    }
+    return vglsl_define_set_finish(&map, ok);
+}
+
+int vglsl_define_set_count(const VglslDefineSet* set) {
+    return set ? set->map.count : 0;
+}
+
+void vglsl_define_set_destroy(VglslDefineSet* set) {
+    if (!set) return;
+    vglsl_node_release_frozen(set->map.root);
+    VGLSL_FREE(set);
+}
+
+const VglslMacro* vglsl_find_macro(const VglslResult* result, const char* name) {
+    if (!result || !name) return NULL;
+    for (int i = 0; i < result->macro_count; i++) {
+        if (strcmp(result->macros[i].name, name) == 0) return &result->macros[i];
+    }
+    return NULL;
+}
+
+/* Output store */
+#ifndef VGLSL_STORE_MAX_CHAIN
+#define VGLSL_STORE_MAX_CHAIN 8 /* Longest chain of delta references */
+#endif
+
+typedef struct VglslStoreEntry {
+    char* data;             /* Full text, or NULL for a delta entry */
+    unsigned char* delta;   /* Edit script against reference */
+    size_t delta_size;
+    int reference;          /* Handle the script applies to, -1 for full text */
+    int depth;              /* Delta references down to a full entry */
+    size_t length;
+    uint64_t hash;
+} VglslStoreEntry;
+
+struct VglslStore {
+    int flags;
+    VglslStoreEntry* entries;
+    int entry_count;
+    int entry_capacity;
+    
+    /* Open-addressed index of entry handles by hash (-1 = empty) */
+    int* index;
+    int index_capacity;
+};
+
+/* Growable byte buffer */
+typedef struct VglslBytes {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} VglslBytes;
+
+static bool vglsl_bytes_push(VglslBytes* bytes, const void* data, size_t size) {
+    if (bytes->size + size > bytes->capacity) {
+        size_t capacity = bytes->capacity ? bytes->capacity * 2 : 256;
+        while (capacity < bytes->size + size) capacity *= 2;
+        unsigned char* new_data = (unsigned char*)VGLSL_REALLOC(bytes->data, capacity);
+        if (!new_data) return false;
+        bytes->data = new_data;
+        bytes->capacity = capacity;
+    }
+    memcpy(bytes->data + bytes->size, data, size);
+    bytes->size += size;
+    return true;
+}
+
+static bool vglsl_bytes_push_varint(VglslBytes* bytes, uint64_t value) {
+    unsigned char buffer[10];
+    size_t size = 0;
+    while (value >= 0x80) {
+        buffer[size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[size++] = (unsigned char)value;
+    return vglsl_bytes_push(bytes, buffer, size);
+}
+
+static bool vglsl_read_varint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Edit script - a sequence of ops, each a varint (length << 1 | is_insert)
+ * followed by a varint reference offset (copy) or the inserted bytes. */
+typedef struct VglslDeltaWriter {
+    VglslBytes* out;
+    bool ok;
+    int pending;            /* 0 none, 1 copy, 2 insert */
+    size_t start;           /* Reference offset (copy) or target offset (insert) */
+    size_t length;
+    const char* target;
+} VglslDeltaWriter;
+
+static void vglsl_delta_flush(VglslDeltaWriter* writer) {
+    if (writer->pending == 1) {
+        writer->ok = writer->ok && vglsl_bytes_push_varint(writer->out, (uint64_t)writer->length << 1) &&
+                     vglsl_bytes_push_varint(writer->out, writer->start);
+    } else if (writer->pending == 2) {
+        writer->ok = writer->ok && vglsl_bytes_push_varint(writer->out, ((uint64_t)writer->length << 1) | 1) &&
+                     vglsl_bytes_push(writer->out, writer->target + writer->start, writer->length);
+    }
+    writer->pending = 0;
+}
+
+static void vglsl_delta_op(VglslDeltaWriter* writer, int kind, size_t start, size_t length) {
+    if (writer->pending == kind && writer->start + writer->length == start) {
+        writer->length += length;
+        return;
+    }
+    vglsl_delta_flush(writer);
+    writer->pending = kind;
+    writer->start = start;
+    writer->length = length;
+}
+
+/* Length of the line at text (newline included) */
+static size_t vglsl_line_span(const char* text, size_t remaining) {
+    const char* end = (const char*)memchr(text, '\n', remaining);
+    return end ? (size_t)(end - text) + 1 : remaining;
+}
+
+/* Line-granular delta of target against reference. Lines are matched
+ * through a hash index of the reference, preferring the line after the
+ * previous match so unchanged runs become single copies. */
+static bool vglsl_delta_encode(const char* reference, size_t reference_length,
+                               const char* target, size_t target_length, VglslBytes* out) {
+    int line_count = 0;
+    for (size_t pos = 0; pos < reference_length; pos += vglsl_line_span(reference + pos, reference_length - pos)) {
+        line_count++;
+    }
+    
+    size_t bucket_count = 16;
+    while (bucket_count < (size_t)line_count * 2) bucket_count *= 2;
+    
+    size_t* line_starts = (size_t*)VGLSL_MALLOC((line_count + 1) * sizeof(size_t));
+    uint64_t* line_hashes = (uint64_t*)VGLSL_MALLOC((line_count + 1) * sizeof(uint64_t));
+    int* next = (int*)VGLSL_MALLOC((line_count + 1) * sizeof(int));
+    int* buckets = (int*)VGLSL_MALLOC(bucket_count * sizeof(int));
+    bool ok = line_starts && line_hashes && next && buckets;
+    
+    if (ok) {
+        for (size_t i = 0; i < bucket_count; i++) buckets[i] = -1;
         
-        /* Check for function macro */
-        if (*name_end == '(') {
-            /* Function macro - not fully implemented in this example */
-            char* value_start = strchr(name_end, ')');
-            if (value_start) {
-                value_start++;
-                while (*value_start == ' ' || *value_start == '\t') value_start++;
-                return vglsl_add_define(ctx, name, value_start, NULL, 0);
+        size_t pos = 0;
+        for (int i = 0; i < line_count; i++) {
+            size_t span = vglsl_line_span(reference + pos, reference_length - pos);
+            line_starts[i] = pos;
+            line_hashes[i] = vglsl_hash(reference + pos, span);
+            pos += span;
+        }
+        line_starts[line_count] = reference_length;
+        
+        /* Insert in reverse so each chain starts at the first occurrence */
+        for (int i = line_count - 1; i >= 0; i--) {
+            size_t bucket = (size_t)line_hashes[i] & (bucket_count - 1);
+            next[i] = buckets[bucket];
+            buckets[bucket] = i;
+        }
+        
+        VglslDeltaWriter writer = {0};
+        writer.out = out;
+        writer.ok = true;
+        writer.target = target;
+        
+        int expected = -1;
+        for (size_t pos = 0; pos < target_length && writer.ok;) {
+            size_t span = vglsl_line_span(target + pos, target_length - pos);
+            int match = -1;
+            
+            if (expected >= 0 && expected < line_count &&
+                line_starts[expected + 1] - line_starts[expected] == span &&
+                memcmp(reference + line_starts[expected], target + pos, span) == 0) {
+                match = expected;
+            } else {
+                uint64_t hash = vglsl_hash(target + pos, span);
+                for (int i = buckets[(size_t)hash & (bucket_count - 1)]; i >= 0; i = next[i]) {
+                    if (line_hashes[i] == hash && line_starts[i + 1] - line_starts[i] == span &&
+                        memcmp(reference + line_starts[i], target + pos, span) == 0) {
+                        match = i;
+                        break;
+                    }
+                }
+            }
+            
+            if (match >= 0) {
+                vglsl_delta_op(&writer, 1, line_starts[match], span);
+                expected = match + 1;
+            } else {
+                vglsl_delta_op(&writer, 2, pos, span);
+                if (expected >= 0) expected++;
             }
+            pos += span;
+        }
+        vglsl_delta_flush(&writer);
+        ok = writer.ok;
+    }
+    
+    VGLSL_FREE(line_starts);
+    VGLSL_FREE(line_hashes);
+    VGLSL_FREE(next);
+    VGLSL_FREE(buckets);
+    return ok;
+}
+
+/* Apply an edit script; dst must hold the entry length */
+static bool vglsl_delta_apply(const char* reference, size_t reference_length,
+                              const unsigned char* script, size_t script_size,
+                              char* dst, size_t dst_length) {
+    const unsigned char* p = script;
+    const unsigned char* end = script + script_size;
+    size_t written = 0;
+    
+    while (p < end) {
+        uint64_t op;
+        if (!vglsl_read_varint(&p, end, &op)) return false;
+        size_t length = (size_t)(op >> 1);
+        if (length > dst_length - written) return false;
+        
+        if (op & 1) {
+            if (length > (size_t)(end - p)) return false;
+            memcpy(dst + written, p, length);
+            p += length;
         } else {
-            /* Simple macro */
-            char* value_start = name_end;
-            while (*value_start == ' ' || *value_start == '\t') value_start++;
-            return vglsl_add_define(ctx, name, value_start, NULL, 0);
+            uint64_t offset;
+            if (!vglsl_read_varint(&p, end, &offset)) return false;
+            if (offset > reference_length || length > reference_length - offset) return false;
+            memcpy(dst + written, reference + offset, length);
         }
-    } else if (vglsl_starts_with(directive, "undef")) {
-        char* name_start = directive + 5; /* Skip "undef" */
-        while (*name_start == ' ' || *name_start == '\t') name_start++;
-        vglsl_trim_whitespace(name_start);
-        vglsl_remove_define(ctx, name_start);
-        return true;
-    } else if (vglsl_starts_with(directive, "ifdef")) {
-        char* name_start = directive + 5; /* Skip "ifdef" */
-        while (*name_start == ' ' || *name_start == '\t') name_start++;
-        vglsl_trim_whitespace(name_start);
+        written += length;
+    }
+    return written == dst_length;
+}
+
+/* Text of an entry - the stored buffer, or a decoded copy flagged in *owned */
+static char* vglsl_store_materialize(const VglslStore* store, int handle, bool* owned) {
+    const VglslStoreEntry* entry = &store->entries[handle];
+    *owned = false;
+    if (entry->data) return entry->data;
+    
+    bool reference_owned;
+    char* reference = vglsl_store_materialize(store, entry->reference, &reference_owned);
+    if (!reference) return NULL;
+    
+    char* text = (char*)VGLSL_MALLOC(entry->length + 1);
+    if (text && vglsl_delta_apply(reference, store->entries[entry->reference].length,
+                                  entry->delta, entry->delta_size, text, entry->length)) {
+        text[entry->length] = '\0';
+        *owned = true;
+    } else {
+        VGLSL_FREE(text);
+        text = NULL;
+    }
+    
+    if (reference_owned) VGLSL_FREE(reference);
+    return text;
+}
+
+VglslStore* vglsl_store_create_ex(int flags) {
+    VglslStore* store = (VglslStore*)VGLSL_MALLOC(sizeof(VglslStore));
+    if (store) {
+        memset(store, 0, sizeof(VglslStore));
+        store->flags = flags;
+    }
+    return store;
+}
+
+VglslStore* vglsl_store_create(void) {
+    return vglsl_store_create_ex(0);
+}
+
+void vglsl_store_destroy(VglslStore* store) {
+    if (!store) return;
+    for (int i = 0; i < store->entry_count; i++) {
+        VGLSL_FREE(store->entries[i].data);
+        VGLSL_FREE(store->entries[i].delta);
+    }
+    VGLSL_FREE(store->entries);
+    VGLSL_FREE(store->index);
+    VGLSL_FREE(store);
+}
+
+/* Grow the hash index to twice its capacity */
+static bool vglsl_store_grow_index(VglslStore* store) {
+    int capacity = store->index_capacity ? store->index_capacity * 2 : 64;
+    int* index = (int*)VGLSL_MALLOC(capacity * sizeof(int));
+    if (!index) return false;
+    for (int i = 0; i < capacity; i++) index[i] = -1;
+    
+    for (int i = 0; i < store->entry_count; i++) {
+        size_t slot = (size_t)store->entries[i].hash & (capacity - 1);
+        while (index[slot] >= 0) slot = (slot + 1) & (capacity - 1);
+        index[slot] = i;
+    }
+    
+    VGLSL_FREE(store->index);
+    store->index = index;
+    store->index_capacity = capacity;
+    return true;
+}
+
+/* Add an entry slot and index it under hash */
+static VglslStoreEntry* vglsl_store_append(VglslStore* store, uint64_t hash) {
+    if ((store->entry_count + 1) * 2 > store->index_capacity && !vglsl_store_grow_index(store)) return NULL;
+    if (store->entry_count >= store->entry_capacity) {
+        int new_capacity = store->entry_capacity ? store->entry_capacity * 2 : 16;
+        VglslStoreEntry* entries = (VglslStoreEntry*)VGLSL_REALLOC(store->entries, new_capacity * sizeof(VglslStoreEntry));
+        if (!entries) return NULL;
+        store->entries = entries;
+        store->entry_capacity = new_capacity;
+    }
+    
+    int handle = store->entry_count++;
+    VglslStoreEntry* entry = &store->entries[handle];
+    memset(entry, 0, sizeof(*entry));
+    entry->hash = hash;
+    entry->reference = -1;
+    
+    size_t mask = (size_t)store->index_capacity - 1;
+    size_t slot = (size_t)hash & mask;
+    while (store->index[slot] >= 0) slot = (slot + 1) & mask;
+    store->index[slot] = handle;
+    return entry;
+}
+
+/* Encode text against a reference entry; keeps the smaller script in best */
+static void vglsl_store_try_delta(const VglslStore* store, int reference, const char* text, size_t length,
+                                  VglslBytes* best, int* best_reference) {
+    bool owned;
+    char* reference_text = vglsl_store_materialize(store, reference, &owned);
+    if (!reference_text) return;
+    
+    VglslBytes script = {0};
+    if (vglsl_delta_encode(reference_text, store->entries[reference].length, text, length, &script) &&
+        (*best_reference < 0 || script.size < best->size)) {
+        VGLSL_FREE(best->data);
+        *best = script;
+        *best_reference = reference;
+    } else {
+        VGLSL_FREE(script.data);
+    }
+    
+    if (owned) VGLSL_FREE(reference_text);
+}
+
+/* Find or add an output. With take_ownership the buffer is adopted on insert
+ * and freed on a duplicate; otherwise it is copied when new. */
+static int vglsl_store_insert(VglslStore* store, char* data, size_t length, uint64_t hash, bool take_ownership) {
+    /* Existing output with the same content */
+    if (store->index_capacity > 0) {
+        size_t mask = (size_t)store->index_capacity - 1;
+        for (size_t slot = (size_t)hash & mask; store->index[slot] >= 0; slot = (slot + 1) & mask) {
+            int handle = store->index[slot];
+            VglslStoreEntry* entry = &store->entries[handle];
+            if (entry->hash != hash || entry->length != length) continue;
+            
+            bool owned;
+            char* text = vglsl_store_materialize(store, handle, &owned);
+            bool same = text && memcmp(text, data, length) == 0;
+            if (owned) VGLSL_FREE(text);
+            if (same) {
+                if (take_ownership) VGLSL_FREE(data);
+                return handle;
+            }
+        }
+    }
+    
+    /* Delta mode - script against the base (first) entry or the previous one */
+    VglslBytes script = {0};
+    int reference = -1;
+    if ((store->flags & VGLSL_STORE_DELTA) && store->entry_count > 0) {
+        vglsl_store_try_delta(store, 0, data, length, &script, &reference);
         
-        if (ctx->if_depth >= 63) {
-            vglsl_set_error(ctx, "Too many nested conditionals", line_num, filename);
-            return false;
+        int sibling = store->entry_count - 1;
+        if (sibling > 0 && store->entries[sibling].depth < VGLSL_STORE_MAX_CHAIN) {
+            vglsl_store_try_delta(store, sibling, data, length, &script, &reference);
         }
         
-        ctx->if_depth++;
-        bool defined = (vglsl_find_define(ctx, name_start) != NULL);
-        ctx->if_stack[ctx->if_depth] = defined;
-        ctx->if_taken[ctx->if_depth] = defined;
-        return true;
-    } else if (vglsl_starts_with(directive, "ifndef")) {
-        char* name_start = directive + 6; /* Skip "ifndef" */
-        while (*name_start == ' ' || *name_start == '\t') name_start++;
-        vglsl_trim_whitespace(name_start);
+        /* Not worth it when the script is about as big as the text */
+        if (reference >= 0 && script.size >= length / 2) {
+            VGLSL_FREE(script.data);
+            script.data = NULL;
+            reference = -1;
+        }
+    }
+    
+    char* owned = NULL;
+    if (reference < 0) {
+        owned = data;
+        if (!take_ownership) {
+            owned = (char*)VGLSL_MALLOC(length + 1);
+            if (!owned) return -1;
+            memcpy(owned, data, length);
+            owned[length] = '\0';
+        }
+    }
+    
+    int depth = reference >= 0 ? store->entries[reference].depth + 1 : 0;
+    VglslStoreEntry* entry = vglsl_store_append(store, hash);
+    if (!entry) {
+        VGLSL_FREE(script.data);
+        if (owned != data) VGLSL_FREE(owned); /* Our copy */
+        if (take_ownership) VGLSL_FREE(data);
+        return -1;
+    }
+    
+    entry->length = length;
+    entry->data = owned;
+    entry->delta = script.data;
+    entry->delta_size = script.size;
+    entry->reference = reference;
+    entry->depth = depth;
+    
+    if (reference >= 0 && take_ownership) VGLSL_FREE(data);
+    return store->entry_count - 1;
+}
+
+/* Join a result's output into one new buffer */
+static char* vglsl_result_join(const VglslResult* result) {
+    char* text = (char*)VGLSL_MALLOC(result->output_length + 1);
+    if (!text) return NULL;
+    
+    if (result->output) {
+        memcpy(text, result->output, result->output_length);
+    } else {
+        size_t offset = 0;
+        for (int i = 0; i < result->segment_count; i++) {
+            memcpy(text + offset, result->segments[i].data, result->segments[i].length);
+            offset += result->segments[i].length;
+        }
+    }
+    text[result->output_length] = '\0';
+    return text;
+}
+
+int vglsl_store_add(VglslStore* store, const VglslResult* result) {
+    if (!store || !result || !result->success) return -1;
+    
+    if (result->output) {
+        return vglsl_store_insert(store, result->output, result->output_length, result->output_hash, false);
+    }
+    
+    char* text = vglsl_result_join(result);
+    if (!text) return -1;
+    return vglsl_store_insert(store, text, result->output_length, result->output_hash, true);
+}
+
+const char* vglsl_store_get(const VglslStore* store, int handle, size_t* length) {
+    if (!store || handle < 0 || handle >= store->entry_count) return NULL;
+    if (length) *length = store->entries[handle].length;
+    return store->entries[handle].data;
+}
+
+size_t vglsl_store_decode(const VglslStore* store, int handle, char* buffer, size_t capacity) {
+    if (!store || handle < 0 || handle >= store->entry_count) return 0;
+    const VglslStoreEntry* entry = &store->entries[handle];
+    if (!buffer || capacity <= entry->length) return entry->length;
+    
+    bool owned;
+    char* text = vglsl_store_materialize(store, handle, &owned);
+    if (!text) return 0;
+    memcpy(buffer, text, entry->length);
+    buffer[entry->length] = '\0';
+    if (owned) VGLSL_FREE(text);
+    return entry->length;
+}
+
+uint64_t vglsl_store_hash(const VglslStore* store, int handle) {
+    if (!store || handle < 0 || handle >= store->entry_count) return 0;
+    return store->entries[handle].hash;
+}
+
+int vglsl_store_count(const VglslStore* store) {
+    return store ? store->entry_count : 0;
+}
+
+size_t vglsl_store_bytes(const VglslStore* store) {
+    size_t bytes = 0;
+    for (int i = 0; store && i < store->entry_count; i++) {
+        bytes += store->entries[i].data ? store->entries[i].length : store->entries[i].delta_size;
+    }
+    return bytes;
+}
+
+/* Little-endian integer I/O for the store file */
+static bool vglsl_write_u64(FILE* file, uint64_t value) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = (unsigned char)(value >> (8 * i));
+    return fwrite(bytes, 1, 8, file) == 8;
+}
+
+static bool vglsl_read_u64(FILE* file, uint64_t* value) {
+    unsigned char bytes[8];
+    if (fread(bytes, 1, 8, file) != 8) return false;
+    *value = vglsl_read64(bytes);
+    return true;
+}
+
+#define VGLSL_STORE_MAGIC "VGLSLST1"
+
+/* File layout: magic, flags, entry count, then per entry hash, length,
+ * reference + 1 (0 = full text) and payload size followed by the payload */
+bool vglsl_store_save(const VglslStore* store, const char* path) {
+    if (!store || !path) return false;
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    
+    bool ok = fwrite(VGLSL_STORE_MAGIC, 1, 8, file) == 8 &&
+              vglsl_write_u64(file, (uint64_t)store->flags) &&
+              vglsl_write_u64(file, (uint64_t)store->entry_count);
+    
+    for (int i = 0; ok && i < store->entry_count; i++) {
+        const VglslStoreEntry* entry = &store->entries[i];
+        const void* payload = entry->data ? (const void*)entry->data : (const void*)entry->delta;
+        size_t payload_size = entry->data ? entry->length : entry->delta_size;
         
-        if (ctx->if_depth >= 63) {
-            vglsl_set_error(ctx, "Too many nested conditionals", line_num, filename);
-            return false;
+        ok = vglsl_write_u64(file, entry->hash) &&
+             vglsl_write_u64(file, entry->length) &&
+             vglsl_write_u64(file, (uint64_t)(entry->reference + 1)) &&
+             vglsl_write_u64(file, payload_size) &&
+             (payload_size == 0 || fwrite(payload, 1, payload_size, file) == payload_size);
+    }
+    
+    if (fclose(file) != 0) ok = false;
+    return ok;
+}
+
+VglslStore* vglsl_store_load(const char* path) {
+    if (!path) return NULL;
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    
+    /* Sizes read from the file are checked against what is left of it */
+    long file_size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    char magic[8];
+    uint64_t flags, count;
+    VglslStore* store = NULL;
+    bool ok = file_size >= 0 && fseek(file, 0, SEEK_SET) == 0 &&
+              fread(magic, 1, 8, file) == 8 && memcmp(magic, VGLSL_STORE_MAGIC, 8) == 0 &&
+              vglsl_read_u64(file, &flags) && vglsl_read_u64(file, &count) && count < 0x7FFFFFFF;
+    if (ok) {
+        store = vglsl_store_create_ex((int)flags);
+        ok = store != NULL;
+    }
+    
+    for (uint64_t i = 0; ok && i < count; i++) {
+        uint64_t hash, length, reference, payload_size;
+        ok = vglsl_read_u64(file, &hash) && vglsl_read_u64(file, &length) &&
+             vglsl_read_u64(file, &reference) && vglsl_read_u64(file, &payload_size) &&
+             reference <= i && (reference > 0 || payload_size == length);
+        if (!ok) break;
+        
+        /* A delta op takes at least one script byte and writes at most the
+         * reference or the rest of the script */
+        long position = ftell(file);
+        uint64_t remaining = position >= 0 ? (uint64_t)(file_size - position) : 0;
+        if (payload_size > remaining || length >= SIZE_MAX) {
+            ok = false;
+            break;
+        }
+        if (reference > 0) {
+            uint64_t per_op = store->entries[reference - 1].length + payload_size;
+            if (payload_size == 0 ? length != 0 : length / per_op > payload_size) {
+                ok = false;
+                break;
+            }
         }
         
-        ctx->if_depth++;
-        bool defined = (vglsl_find_define(ctx, name_start) != NULL);
-        ctx->if_stack[ctx->if_depth] = !defined;
-        ctx->if_taken[ctx->if_depth] = !defined;
-        return true;
-    } else if (strcmp(directive, "else") == 0) {
-        if (ctx->if_depth <= 0) {
-            vglsl_set_error(ctx, "#else without #ifdef/#ifndef", line_num, filename);
-            return false;
+        unsigned char* payload = (unsigned char*)VGLSL_MALLOC((size_t)payload_size + 1);
+        VglslStoreEntry* entry = payload ? vglsl_store_append(store, hash) : NULL;
+        if (!entry || (payload_size > 0 && fread(payload, 1, (size_t)payload_size, file) != payload_size)) {
+            if (entry) store->entry_count--; /* Index is dropped with the store */
+            VGLSL_FREE(payload);
+            ok = false;
+            break;
         }
-        ctx->if_stack[ctx->if_depth] = !ctx->if_taken[ctx->if_depth];
-        return true;
-    } else if (strcmp(directive, "endif") == 0) {
-        if (ctx->if_depth <= 0) {
-            vglsl_set_error(ctx, "#endif without #ifdef/#ifndef", line_num, filename);
+        
+        entry->length = (size_t)length;
+        entry->reference = (int)reference - 1;
+        if (entry->reference < 0) {
+            payload[length] = '\0';
+            entry->data = (char*)payload;
+        } else {
+            entry->delta = payload;
+            entry->delta_size = (size_t)payload_size;
+            entry->depth = store->entries[entry->reference].depth + 1;
+        }
+    }
+    
+    fclose(file);
+    if (!ok) {
+        vglsl_store_destroy(store);
+        return NULL;
+    }
+    return store;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Prelude snapshots                                                         */
+/* ------------------------------------------------------------------------- */
+
+/* Read a whole file, mapped where mmap is available */
+static void* vglsl_map_file(const char* path, size_t* size) {
+#ifdef VGLSL_HAS_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    void* data = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+        *size = (size_t)info.st_size;
+    }
+    close(fd);
+    return data;
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    char* data = NULL;
+    long length = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (char*)VGLSL_MALLOC((size_t)length);
+        if (data && fread(data, 1, (size_t)length, file) != (size_t)length) {
+            VGLSL_FREE(data);
+            data = NULL;
+        }
+        *size = (size_t)length;
+    }
+    fclose(file);
+    return data;
+#endif
+}
+
+static void vglsl_unmap_file(void* data, size_t size) {
+#ifdef VGLSL_HAS_MMAP
+    if (data) munmap(data, size);
+#else
+    (void)size;
+    VGLSL_FREE(data);
+#endif
+}
+
+static void vglsl_snapshot_digest(VglslSnapshot* snapshot) {
+    VglslHash hash;
+    vglsl_hash_init(&hash);
+    vglsl_hash_update(&hash, snapshot->prelude, snapshot->prelude_length);
+    vglsl_hash_update(&hash, &snapshot->defines->hash, sizeof(uint64_t));
+    for (int i = 0; i < snapshot->once_count; i++) {
+        const char* guard = snapshot->once[i].guard ? snapshot->once[i].guard : "";
+        vglsl_hash_update(&hash, snapshot->once[i].path, strlen(snapshot->once[i].path) + 1);
+        vglsl_hash_update(&hash, guard, strlen(guard) + 1);
+    }
+    snapshot->hash = vglsl_hash_digest(&hash);
+}
+
+/* Move the end state of a prelude parse into a snapshot */
+static bool vglsl_snapshot_capture(VglslContext* ctx, VglslSnapshot* snapshot) {
+    const VglslSnapshot* base = ctx->config->snapshot;
+    int base_count = base ? base->once_count : 0;
+    
+    snapshot->defines = vglsl_define_set_finish(&ctx->defines, true);
+    memset(&ctx->defines, 0, sizeof(ctx->defines));
+    char* prelude = (char*)VGLSL_MALLOC(ctx->output_size + 1);
+    snapshot->once = (VglslOnceEntry*)VGLSL_MALLOC((ctx->once_count + base_count + 1) * sizeof(VglslOnceEntry));
+    if (!snapshot->defines || !prelude || !snapshot->once) {
+        VGLSL_FREE(prelude);
+        vglsl_set_error(ctx, "Failed to allocate snapshot", 0, "");
+        return false;
+    }
+    memcpy(prelude, ctx->output, ctx->output_size);
+    prelude[ctx->output_size] = '\0';
+    snapshot->prelude = prelude;
+    snapshot->prelude_length = ctx->output_size;
+    
+    /* Entries of this parse, then those of the snapshot it started from */
+    memcpy(snapshot->once, ctx->once, ctx->once_count * sizeof(VglslOnceEntry));
+    snapshot->once_count = ctx->once_count;
+    ctx->once_count = 0; /* Transfer ownership */
+    
+    for (int i = 0; i < base_count; i++) {
+        bool shadowed = false;
+        for (int j = 0; j < snapshot->once_count && !shadowed; j++) {
+            shadowed = vglsl_same_file(snapshot->once[j].path, snapshot->once[j].id, base->once[i].path, base->once[i].id);
+        }
+        if (shadowed) continue;
+        
+        VglslOnceEntry* entry = &snapshot->once[snapshot->once_count];
+        entry->path = vglsl_strdup(base->once[i].path);
+        entry->id = base->once[i].id;
+        entry->guard = base->once[i].guard ? vglsl_strdup(base->once[i].guard) : NULL;
+        if (entry->path) snapshot->once_count++;
+        if (!entry->path || (base->once[i].guard && !entry->guard)) {
+            if (!entry->path) VGLSL_FREE(entry->guard);
+            vglsl_set_error(ctx, "Failed to allocate snapshot", 0, "");
             return false;
         }
-        ctx->if_depth--;
-        return true;
     }
+    vglsl_snapshot_digest(snapshot);
+    return true;
+}
+
+VglslResult vglsl_snapshot_create(const char* source, const char* filename, const VglslConfig* config,
+                                  VglslSnapshot** snapshot) {
+    VglslResult result = {0};
+    VglslConfig prelude = config ? *config : vglsl_default_config();
+    prelude.output_segments = false;
+    prelude.minify = false;
+    prelude.strip_unused = false;
+    prelude.fold_constants = false;
+    prelude.reflect = false;
+    prelude.export_defines = false;
+    
+    *snapshot = NULL;
+    VglslSnapshot* capture = (VglslSnapshot*)VGLSL_MALLOC(sizeof(VglslSnapshot));
+    if (!capture) {
+        result.error_message = vglsl_strdup("Failed to allocate snapshot");
+        return result;
+    }
+    memset(capture, 0, sizeof(VglslSnapshot));
+    
+    VglslSource memory = vglsl_source_from_memory(source, strlen(source));
+    result = vglsl_parse_capture(&memory, filename, &prelude, capture, NULL);
+    if (result.success) {
+        *snapshot = capture;
+    } else {
+        vglsl_snapshot_destroy(capture);
+    }
+    return result;
+}
+
+static bool vglsl_write_string(FILE* file, const char* text) {
+    size_t length = strlen(text) + 1;
+    return fwrite(text, 1, length, file) == length;
+}
+
+static bool vglsl_write_define(const VglslDefine* define, void* user_data) {
+    FILE* file = (FILE*)user_data;
+    bool ok = vglsl_write_u64(file, define->is_function_macro ? 1 : 0) &&
+              vglsl_write_u64(file, (uint64_t)define->param_count) &&
+              vglsl_write_string(file, define->name) && vglsl_write_string(file, define->value);
+    for (int i = 0; ok && i < define->param_count; i++) {
+        ok = vglsl_write_string(file, define->params[i]);
+    }
+    return ok;
+}
+
+#define VGLSL_SNAPSHOT_MAGIC "VGLSLPH1"
+
+/* File layout: magic, prelude length, define count and include count, then
+ * the prelude (NUL-terminated), each define as function flag, parameter
+ * count, name, value and parameters, and each include entry as guard flag,
+ * path and guard. Strings are NUL-terminated. */
+bool vglsl_snapshot_save(const VglslSnapshot* snapshot, const char* path) {
+    if (!snapshot || !path) return false;
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    
+    bool ok = fwrite(VGLSL_SNAPSHOT_MAGIC, 1, 8, file) == 8 &&
+              vglsl_write_u64(file, snapshot->prelude_length) &&
+              vglsl_write_u64(file, (uint64_t)snapshot->defines->map.count) &&
+              vglsl_write_u64(file, (uint64_t)snapshot->once_count) &&
+              fwrite(snapshot->prelude, 1, snapshot->prelude_length + 1, file) == snapshot->prelude_length + 1 &&
+              vglsl_map_each(snapshot->defines->map.root, vglsl_write_define, file);
+    
+    for (int i = 0; ok && i < snapshot->once_count; i++) {
+        const VglslOnceEntry* entry = &snapshot->once[i];
+        ok = vglsl_write_u64(file, entry->guard ? 1 : 0) && vglsl_write_string(file, entry->path) &&
+             (!entry->guard || vglsl_write_string(file, entry->guard));
+    }
+    
+    if (fclose(file) != 0) ok = false;
+    return ok;
+}
+
+/* Bounds-checked cursor over a loaded snapshot */
+typedef struct VglslReader {
+    const unsigned char* pos;
+    const unsigned char* end;
+} VglslReader;
+
+static bool vglsl_reader_u64(VglslReader* reader, uint64_t* value) {
+    if (reader->end - reader->pos < 8) return false;
+    *value = vglsl_read64(reader->pos);
+    reader->pos += 8;
+    return true;
+}
+
+static char* vglsl_reader_string(VglslReader* reader) {
+    const unsigned char* nul = (const unsigned char*)memchr(reader->pos, '\0', (size_t)(reader->end - reader->pos));
+    if (!nul) return NULL;
+    char* text = (char*)reader->pos;
+    reader->pos = nul + 1;
+    return text;
+}
+
+VglslSnapshot* vglsl_snapshot_load(const char* path) {
+    if (!path) return NULL;
+    size_t size = 0;
+    void* data = vglsl_map_file(path, &size);
+    if (!data) return NULL;
+    
+    VglslSnapshot* snapshot = (VglslSnapshot*)VGLSL_MALLOC(sizeof(VglslSnapshot));
+    if (!snapshot) {
+        vglsl_unmap_file(data, size);
+        return NULL;
+    }
+    memset(snapshot, 0, sizeof(VglslSnapshot));
+    snapshot->mapping = data;
+    snapshot->mapping_size = size;
+    
+    VglslReader reader = { (const unsigned char*)data, (const unsigned char*)data + size };
+    uint64_t prelude_length = 0, define_count = 0, once_count = 0;
+    bool ok = size >= 8 && memcmp(data, VGLSL_SNAPSHOT_MAGIC, 8) == 0;
+    if (ok) reader.pos += 8;
+    ok = ok && vglsl_reader_u64(&reader, &prelude_length) && vglsl_reader_u64(&reader, &define_count) &&
+         vglsl_reader_u64(&reader, &once_count) && prelude_length < (uint64_t)(reader.end - reader.pos) &&
+         reader.pos[prelude_length] == '\0';
+    if (ok) {
+        snapshot->prelude = (const char*)reader.pos;
+        snapshot->prelude_length = (size_t)prelude_length;
+        reader.pos += prelude_length + 1;
+    }
+    
+    /* Every entry takes at least one byte, which also bounds the counts */
+    VglslDefineMap map = {0};
+    ok = ok && define_count <= (uint64_t)(reader.end - reader.pos);
+    for (uint64_t i = 0; ok && i < define_count; i++) {
+        uint64_t is_function, param_count;
+        char* params[VGLSL_MAX_MACRO_PARAMS];
+        ok = vglsl_reader_u64(&reader, &is_function) && vglsl_reader_u64(&reader, &param_count) &&
+             param_count <= VGLSL_MAX_MACRO_PARAMS;
+        char* name = ok ? vglsl_reader_string(&reader) : NULL;
+        char* value = name ? vglsl_reader_string(&reader) : NULL;
+        ok = value != NULL;
+        for (uint64_t j = 0; ok && j < param_count; j++) {
+            params[j] = vglsl_reader_string(&reader);
+            ok = params[j] != NULL;
+        }
+        if (!ok) break;
+        
+        VglslDefine* define = vglsl_define_create(name, strlen(name), value, params, (int)param_count, is_function != 0);
+        ok = define && vglsl_map_set(&map, define);
+    }
+    snapshot->defines = vglsl_define_set_finish(&map, ok);
+    ok = snapshot->defines != NULL;
     
-    /* Unknown directive - pass through as-is */
-    if (!vglsl_append_output(ctx, line)) return false;
-    if (!vglsl_append_output(ctx, "\n")) return false;
-    return true;
+    ok = ok && once_count <= (uint64_t)(reader.end - reader.pos);
+    if (ok && once_count > 0) {
+        snapshot->once = (VglslOnceEntry*)VGLSL_MALLOC((size_t)once_count * sizeof(VglslOnceEntry));
+        ok = snapshot->once != NULL;
+    }
+    for (uint64_t i = 0; ok && i < once_count; i++) {
+        uint64_t has_guard;
+        VglslOnceEntry* entry = &snapshot->once[i];
+        ok = vglsl_reader_u64(&reader, &has_guard) && (entry->path = vglsl_reader_string(&reader)) != NULL;
+        entry->guard = ok && has_guard ? vglsl_reader_string(&reader) : NULL;
+        ok = ok && (!has_guard || entry->guard);
+        if (ok && !vglsl_file_id(entry->path, &entry->id)) memset(&entry->id, 0, sizeof(entry->id));
+        if (ok) snapshot->once_count++;
+    }
+    
+    if (!ok) {
+        vglsl_snapshot_destroy(snapshot);
+        return NULL;
+    }
+    vglsl_snapshot_digest(snapshot);
+    return snapshot;
 }
 
-/* Check if current context should output (not in false conditional) */
-static bool vglsl_should_output(VglslContext* ctx) {
-    for (int i = 1; i <= ctx->if_depth; i++) {
-        if (!ctx->if_stack[i]) return false;
+void vglsl_snapshot_destroy(VglslSnapshot* snapshot) {
+    if (!snapshot) return;
+    vglsl_define_set_destroy(snapshot->defines);
+    if (snapshot->mapping) {
+        /* Strings point into the file */
+        vglsl_unmap_file(snapshot->mapping, snapshot->mapping_size);
+    } else {
+        for (int i = 0; i < snapshot->once_count; i++) {
+            VGLSL_FREE(snapshot->once[i].path);
+            VGLSL_FREE(snapshot->once[i].guard);
+        }
+        VGLSL_FREE((char*)snapshot->prelude);
     }
-    return true;
+    VGLSL_FREE(snapshot->once);
+    VGLSL_FREE(snapshot);
 }
 
-/* Process a single line */
-static bool vglsl_process_line(VglslContext* ctx, const char* line, int line_num, const char* filename) {
-    if (ctx->has_error) return false;
-    
-    char processed_line[VGLSL_MAX_LINE_LENGTH];
-    strcpy(processed_line, line);
+/* ------------------------------------------------------------------------- */
+/* Shared output cache                                                       */
+/* ------------------------------------------------------------------------- */
+
+/* File layout: header, slot_count index slots, then records appended from
+ * the end of the index. A slot holds the file offset of a record, 0 while
+ * empty; slots are claimed with a compare-and-swap once the record is
+ * complete, so readers never see partial records and nothing takes a lock.
+ * Integers are native, the file is only shared on one machine.
+ *
+ * A full file is compacted: the most recently used valid records are copied
+ * to a new file, which is renamed over the old one, and the old one is
+ * marked retired. Processes move to the new file on their next lookup; the
+ * old mapping lives on while results point into it, so readers never wait
+ * for compaction. */
+typedef struct VglslCacheHeader {
+    char magic[8];
+    uint64_t state;              /* 0 new, 1 being initialized, 2 ready */
+    uint64_t capacity;           /* File size */
+    uint64_t slot_count;         /* Power of two */
+    uint64_t used;               /* End of the appended records */
+    uint64_t clock;              /* Ticks once per insert and hit */
+    uint64_t compacting;         /* Start time of a running compaction, 0 if none */
+    uint64_t retired;            /* Replaced by a compacted file */
+} VglslCacheHeader;
+
+/* Followed by file_count entries (stamp, path length, path padded to 8
+ * bytes), then the output and a NUL, padded to 8 bytes */
+typedef struct VglslCacheRecord {
+    uint64_t key;
+    uint64_t size;               /* Whole record */
+    uint64_t output_length;
+    uint64_t output_hash;
+    uint64_t file_count;
+    uint64_t last_used;          /* Header clock at the last insert or hit */
+} VglslCacheRecord;
+
+/* One mapped cache file, held by the handle while current and by every
+ * result pointing into it */
+struct VglslCacheMap {
+    unsigned char* base;
+    size_t size;
+    uint64_t refs;
+};
+
+struct VglslCache {
+    VglslCacheMap* map;          /* Current file */
+    char* path;
+};
+
+#define VGLSL_CACHE_MAGIC "VGLSLOC2"
+#define VGLSL_CACHE_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+#ifndef VGLSL_CACHE_COMPACT_TIMEOUT
+#define VGLSL_CACHE_COMPACT_TIMEOUT 60 /* Seconds before a stalled compaction is taken over */
+#endif
+
+#ifdef VGLSL_HAS_MMAP
+static uint64_t g_cache_compactions = 0; /* Tells apart the temp files of one process */
+
+static uint64_t vglsl_atomic_load(uint64_t* value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static void vglsl_atomic_store(uint64_t* value, uint64_t desired) {
+    __atomic_store_n(value, desired, __ATOMIC_RELEASE);
+}
+
+static bool vglsl_atomic_cas(uint64_t* value, uint64_t expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(value, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t vglsl_atomic_add(uint64_t* value, uint64_t amount) {
+    return __atomic_fetch_add(value, amount, __ATOMIC_ACQ_REL);
+}
+
+/* Map a cache file, creating it at capacity bytes if new. With exclusive
+ * the file must not exist yet, so no one else can have it mapped. */
+static VglslCacheMap* vglsl_cache_map_file(const char* path, size_t capacity, bool exclusive) {
+    int fd = open(path, O_RDWR | O_CREAT | (exclusive ? O_EXCL : 0), 0644);
+    if (fd < 0) return NULL;
     
-    /* Remove comments if requested */
-    if (ctx->config->remove_comments) {
-        vglsl_remove_comments(processed_line);
+    /* A new file is grown to capacity; racing creators write the same zeros */
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok && info.st_size == 0) {
+        ok = lseek(fd, (off_t)capacity - 1, SEEK_SET) >= 0 && write(fd, "", 1) == 1 && fstat(fd, &info) == 0;
     }
+    ok = ok && (size_t)info.st_size >= sizeof(VglslCacheHeader);
+    void* data = ok ? mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    VglslCacheMap* map = (VglslCacheMap*)VGLSL_MALLOC(sizeof(VglslCacheMap));
+    if (!map) {
+        munmap(data, (size_t)info.st_size);
+        return NULL;
+    }
+    map->base = (unsigned char*)data;
+    map->size = (size_t)info.st_size;
+    map->refs = 1;
     
-    vglsl_trim_whitespace(processed_line);
-    
-    /* Handle preprocessor directives */
-    if (processed_line[0] == '#') {
-        return vglsl_process_directive(ctx, processed_line, line_num, filename);
+    /* First opener lays out the header; the others wait for it */
+    VglslCacheHeader* header = (VglslCacheHeader*)data;
+    if (vglsl_atomic_cas(&header->state, 0, 1)) {
+        uint64_t slots = 64;
+        while (slots * 2 <= map->size / 4096) slots *= 2;
+        memcpy(header->magic, VGLSL_CACHE_MAGIC, 8);
+        header->capacity = map->size;
+        header->slot_count = slots;
+        header->used = sizeof(VglslCacheHeader) + slots * sizeof(uint64_t);
+        vglsl_atomic_store(&header->state, 2);
+    }
+    for (long spins = 0; vglsl_atomic_load(&header->state) != 2; spins++) {
+        if (spins > 100000000L) break;
     }
     
-    /* Skip line if in false conditional */
-    if (!vglsl_should_output(ctx)) {
-        return true;
+    if (vglsl_atomic_load(&header->state) != 2 || memcmp(header->magic, VGLSL_CACHE_MAGIC, 8) != 0 ||
+        header->capacity != map->size ||
+        sizeof(VglslCacheHeader) + header->slot_count * sizeof(uint64_t) > map->size) {
+        vglsl_cache_map_release(map);
+        return NULL;
     }
+    return map;
+}
+
+/* Move to the compacted file once the current one is retired */
+static void vglsl_cache_refresh(VglslCache* cache) {
+    VglslCacheHeader* header = (VglslCacheHeader*)cache->map->base;
+    if (!vglsl_atomic_load(&header->retired)) return;
     
-    /* Expand macros */
-    char expanded_line[VGLSL_MAX_LINE_LENGTH];
-    if (!vglsl_expand_macros(ctx, processed_line, expanded_line, sizeof(expanded_line))) {
-        vglsl_set_error(ctx, "Macro expansion failed", line_num, filename);
-        return false;
+    VglslCacheMap* fresh = vglsl_cache_map_file(cache->path, cache->map->size, false);
+    if (!fresh) return;
+    vglsl_cache_map_release(cache->map);
+    cache->map = fresh;
+}
+#endif /* VGLSL_HAS_MMAP */
+
+/* Drop one reference; results may be freed on any thread */
+static void vglsl_cache_map_release(VglslCacheMap* map) {
+#ifdef VGLSL_HAS_MMAP
+    if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    munmap(map->base, map->size);
+#endif
+    VGLSL_FREE(map);
+}
+
+VglslCache* vglsl_cache_open(const char* path, size_t capacity) {
+#ifdef VGLSL_HAS_MMAP
+    if (!path || capacity < 64 * 1024) return NULL;
+    VglslCache* cache = (VglslCache*)VGLSL_MALLOC(sizeof(VglslCache));
+    if (!cache) return NULL;
+    memset(cache, 0, sizeof(VglslCache));
+    cache->path = vglsl_strdup(path);
+    cache->map = cache->path ? vglsl_cache_map_file(path, capacity, false) : NULL;
+    if (!cache->map) {
+        VGLSL_FREE(cache->path);
+        VGLSL_FREE(cache);
+        return NULL;
+    }
+    return cache;
+#else
+    (void)path;
+    (void)capacity;
+    return NULL;
+#endif
+}
+
+void vglsl_cache_close(VglslCache* cache) {
+    if (!cache) return;
+    vglsl_cache_map_release(cache->map);
+    VGLSL_FREE(cache->path);
+    VGLSL_FREE(cache);
+}
+
+#ifdef VGLSL_HAS_MMAP
+/* Mounted virtual paths, depth first in segment order */
+static void vglsl_hash_virtual_node(VglslHash* hash, const VglslVirtualNode* node) {
+    for (int i = 0; i < node->child_count; i++) {
+        const VglslVirtualNode* child = node->children[i];
+        uint8_t mounted = child->real_path != NULL;
+        vglsl_hash_string(hash, child->segment);
+        vglsl_hash_update(hash, &mounted, 1);
+        if (mounted) vglsl_hash_string(hash, child->real_path);
+        vglsl_hash_virtual_node(hash, child);
+        vglsl_hash_update(hash, "/", 1);
+    }
+}
+
+/* Everything besides file contents that decides the output. The root is
+ * keyed by its normalized path, so spellings of it share an entry, except
+ * with #line directives, which carry the spelling into the output. */
+static uint64_t vglsl_cache_key(const char* filename, const VglslConfig* config) {
+    VglslHash hash;
+    vglsl_hash_init(&hash);
+    char root[1024];
+    if (!config->preserve_lines && strlen(filename) + 2 <= sizeof(root)) {
+        vglsl_normalize_path(filename, root);
+        vglsl_hash_string(&hash, root);
+    } else {
+        vglsl_hash_string(&hash, filename);
+    }
+    vglsl_hash_string(&hash, config->base_path);
+    for (int i = 0; i < config->include_path_count; i++) {
+        vglsl_hash_string(&hash, config->include_paths[i]);
     }
     
-    /* Add to output */
-    if (!vglsl_append_output(ctx, expanded_line)) return false;
-    if (!vglsl_append_output(ctx, "\n")) return false;
+    unsigned char flags[] = {
+        config->preserve_lines, config->remove_comments, config->output_segments, config->canonicalize_output,
+        config->minify, config->strip_unused, config->fold_constants
+    };
+    int64_t limits[] = { config->max_include_depth, config->max_output_size };
+    uint64_t layers[] = {
+        config->base_defines ? config->base_defines->hash : 0,
+        config->snapshot ? config->snapshot->hash : 0
+    };
+    vglsl_hash_update(&hash, flags, sizeof(flags));
+    vglsl_hash_update(&hash, limits, sizeof(limits));
+    vglsl_hash_update(&hash, layers, sizeof(layers));
     
-    return true;
+    for (int i = 0; i < config->define_count; i++) {
+        vglsl_hash_string(&hash, config->defines[i]);
+    }
+    vglsl_hash_virtual_node(&hash, &g_virtual_root);
+    
+    /* 0 marks an empty slot */
+    uint64_t key = vglsl_hash_digest(&hash);
+    return key ? key : 1;
 }
 
-/* Clean up context */
-static void vglsl_cleanup_context(VglslContext* ctx) {
-    for (int i = 0; i < ctx->define_count; i++) {
-        VGLSL_FREE(ctx->defines[i].name);
-        VGLSL_FREE(ctx->defines[i].value);
-        if (ctx->defines[i].params) {
-            for (int j = 0; j < ctx->defines[i].param_count; j++) {
-                VGLSL_FREE(ctx->defines[i].params[j]);
-            }
-            VGLSL_FREE(ctx->defines[i].params);
+/* Whether every file a record was built from is unchanged */
+static bool vglsl_cache_record_valid(const VglslCacheRecord* record) {
+    const unsigned char* pos = (const unsigned char*)(record + 1);
+    const unsigned char* end = (const unsigned char*)record + record->size;
+    for (uint64_t i = 0; i < record->file_count; i++) {
+        VglslFileStamp stored, current;
+        uint64_t path_length;
+        if ((size_t)(end - pos) < sizeof(VglslFileStamp) + 8) return false;
+        memcpy(&stored, pos, sizeof(VglslFileStamp));
+        memcpy(&path_length, pos + sizeof(VglslFileStamp), 8);
+        pos += sizeof(VglslFileStamp) + 8;
+        if (path_length >= (uint64_t)(end - pos) || (uint64_t)(end - pos) < VGLSL_CACHE_ALIGN(path_length + 1) ||
+            pos[path_length] != '\0') {
+            return false;
         }
+        
+        /* A missing file or directory stamps as zero */
+        if (!vglsl_stat_file((const char*)pos, &current)) memset(&current, 0, sizeof(current));
+        if (memcmp(&stored, &current, sizeof(VglslFileStamp)) != 0) return false;
+        pos += VGLSL_CACHE_ALIGN(path_length + 1);
+    }
+    return (uint64_t)(end - pos) > record->output_length && pos[record->output_length] == '\0';
+}
+
+static VglslCacheRecord* vglsl_cache_record(const VglslCacheMap* map, uint64_t offset) {
+    const VglslCacheHeader* header = (const VglslCacheHeader*)map->base;
+    uint64_t data_start = sizeof(VglslCacheHeader) + header->slot_count * sizeof(uint64_t);
+    if (offset < data_start || offset > map->size - sizeof(VglslCacheRecord)) return NULL;
+    VglslCacheRecord* record = (VglslCacheRecord*)(map->base + offset);
+    return record->size <= map->size - offset ? record : NULL;
+}
+
+/* Output of a record, which ends the record */
+static const char* vglsl_cache_output(const VglslCacheRecord* record) {
+    return (const char*)record + record->size - VGLSL_CACHE_ALIGN(record->output_length + 1);
+}
+
+/* Record for key; with validate only one whose files are unchanged */
+static VglslCacheRecord* vglsl_cache_lookup(const VglslCacheMap* map, uint64_t key, bool validate) {
+    VglslCacheHeader* header = (VglslCacheHeader*)map->base;
+    uint64_t* slots = (uint64_t*)(header + 1);
+    uint64_t mask = header->slot_count - 1;
+    
+    /* Records are never removed, so the first empty slot ends the probe */
+    for (uint64_t i = 0; i <= mask; i++) {
+        uint64_t offset = vglsl_atomic_load(&slots[(key + i) & mask]);
+        if (offset == 0) break;
+        VglslCacheRecord* record = vglsl_cache_record(map, offset);
+        if (record && record->key == key && (!validate || vglsl_cache_record_valid(record))) return record;
+    }
+    return NULL;
+}
+
+/* Claim size bytes for a record; 0 when the file is full */
+static uint64_t vglsl_cache_reserve(const VglslCacheMap* map, uint64_t size) {
+    VglslCacheHeader* header = (VglslCacheHeader*)map->base;
+    if (vglsl_atomic_load(&header->retired)) return 0;
+    uint64_t offset = vglsl_atomic_add(&header->used, size);
+    return offset <= map->size && size <= map->size - offset ? offset : 0;
+}
+
+/* Make a complete record visible - the CAS releases its bytes */
+static bool vglsl_cache_publish(const VglslCacheMap* map, uint64_t key, uint64_t offset) {
+    VglslCacheHeader* header = (VglslCacheHeader*)map->base;
+    uint64_t* slots = (uint64_t*)(header + 1);
+    uint64_t mask = header->slot_count - 1;
+    for (uint64_t i = 0; i <= mask; i++) {
+        if (vglsl_atomic_cas(&slots[(key + i) & mask], 0, offset)) return true;
+    }
+    return false;
+}
+
+static int vglsl_compare_last_used(const void* a, const void* b) {
+    uint64_t x = (*(const VglslCacheRecord* const*)a)->last_used;
+    uint64_t y = (*(const VglslCacheRecord* const*)b)->last_used;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Copy the most recently used valid records, up to half the capacity, to a
+ * new file and rename it over the current one. One process compacts at a
+ * time; the others keep reading and skip inserting until it is done. */
+static bool vglsl_cache_compact_map(VglslCache* cache) {
+    VglslCacheMap* map = cache->map;
+    VglslCacheHeader* header = (VglslCacheHeader*)map->base;
+    uint64_t now = (uint64_t)time(NULL);
+    uint64_t started = vglsl_atomic_load(&header->compacting);
+    uint64_t mine = now ? now : 1;
+    if (vglsl_atomic_load(&header->retired) ||
+        (started != 0 && now - started < VGLSL_CACHE_COMPACT_TIMEOUT) ||
+        !vglsl_atomic_cas(&header->compacting, started, mine)) {
+        return false;
     }
     
-    if (ctx->output) {
-        VGLSL_FREE(ctx->output);
+    /* Live records, most recently used first */
+    uint64_t* slots = (uint64_t*)(header + 1);
+    VglslCacheRecord** live = (VglslCacheRecord**)VGLSL_MALLOC(header->slot_count * sizeof(VglslCacheRecord*));
+    size_t temp_size = strlen(cache->path) + 64;
+    char* temp_path = (char*)VGLSL_MALLOC(temp_size);
+    bool ok = live && temp_path;
+    
+    size_t live_count = 0;
+    for (uint64_t i = 0; ok && i < header->slot_count; i++) {
+        VglslCacheRecord* record = vglsl_cache_record(map, vglsl_atomic_load(&slots[i]));
+        if (record && vglsl_cache_record_valid(record)) live[live_count++] = record;
     }
+    if (ok) qsort(live, live_count, sizeof(VglslCacheRecord*), vglsl_compare_last_used);
     
-    if (ctx->error_message) {
-        VGLSL_FREE(ctx->error_message);
+    VglslCacheMap* fresh = NULL;
+    if (ok) {
+        /* Each compactor writes its own file, since a slow one may still
+         * have its file mapped when another takes over. A leftover of a
+         * dead process with the same pid is removed first. */
+        snprintf(temp_path, temp_size, "%s.compact.%ld.%llu", cache->path, (long)getpid(),
+                 (unsigned long long)vglsl_atomic_add(&g_cache_compactions, 1));
+        remove(temp_path);
+        fresh = vglsl_cache_map_file(temp_path, map->size, true);
+        ok = fresh != NULL;
     }
     
-    if (ctx->error_file) {
-        VGLSL_FREE(ctx->error_file);
+    if (ok) {
+        VglslCacheHeader* fresh_header = (VglslCacheHeader*)fresh->base;
+        uint64_t budget = fresh_header->used + (fresh->size - fresh_header->used) / 2;
+        fresh_header->clock = vglsl_atomic_load(&header->clock);
+        
+        for (size_t i = 0; i < live_count; i++) {
+            /* Concurrent inserts can leave one key twice; keep the newer */
+            if (fresh_header->used + live[i]->size > budget) continue;
+            if (vglsl_cache_lookup(fresh, live[i]->key, false)) continue;
+            uint64_t offset = vglsl_cache_reserve(fresh, live[i]->size);
+            memcpy(fresh->base + offset, live[i], (size_t)live[i]->size);
+            vglsl_cache_publish(fresh, live[i]->key, offset);
+        }
+        
+        /* Leave the file to whoever took the compaction over meanwhile */
+        ok = vglsl_atomic_load(&header->compacting) == mine && rename(temp_path, cache->path) == 0;
+        if (!ok) {
+            vglsl_cache_map_release(fresh);
+            remove(temp_path);
+        }
     }
+    
+    if (ok) {
+        vglsl_atomic_store(&header->retired, 1);
+        vglsl_cache_map_release(map);
+        cache->map = fresh;
+    } else {
+        vglsl_atomic_cas(&header->compacting, mine, 0);
+    }
+    VGLSL_FREE(live);
+    VGLSL_FREE(temp_path);
+    return ok;
 }
 
-/* Main parsing function */
-static VglslResult vglsl_parse_internal(const char* source, const char* filename, const VglslConfig* config) {
-    VglslResult result = {0};
-    VglslContext ctx = {0};
+/* Append the output of a parse, compacting the file once if it is full.
+ * A record that still does not fit is left uncached. */
+static void vglsl_cache_insert(VglslCache* cache, uint64_t key, const VglslResult* result, const VglslFileList* files) {
+    uint64_t size = sizeof(VglslCacheRecord) + VGLSL_CACHE_ALIGN(result->output_length + 1);
+    for (int i = 0; i < files->count; i++) {
+        size += sizeof(VglslFileStamp) + 8 + VGLSL_CACHE_ALIGN(strlen(files->paths[i]) + 1);
+    }
     
-    /* Initialize context */
-    ctx.config = config;
-    ctx.output_capacity = 4096;
-    ctx.output = (char*)VGLSL_MALLOC(ctx.output_capacity);
-    if (!ctx.output) {
-        result.error_message = vglsl_strdup("Failed to allocate output buffer");
-        return result;
+    uint64_t offset = vglsl_cache_reserve(cache->map, size);
+    if (offset == 0) {
+        if (!vglsl_cache_compact_map(cache)) return;
+        offset = vglsl_cache_reserve(cache->map, size);
+        if (offset == 0) return;
     }
-    ctx.output[0] = '\0';
     
-    /* Process source line by line */
-    const char* line_start = source;
-    int line_num = 1;
-    bool success = true;
+    VglslCacheHeader* header = (VglslCacheHeader*)cache->map->base;
+    unsigned char* pos = cache->map->base + offset;
+    VglslCacheRecord* record = (VglslCacheRecord*)pos;
+    record->key = key;
+    record->size = size;
+    record->output_length = result->output_length;
+    record->output_hash = result->output_hash;
+    record->file_count = (uint64_t)files->count;
+    record->last_used = vglsl_atomic_add(&header->clock, 1) + 1;
+    pos += sizeof(VglslCacheRecord);
     
-    while (*line_start && success && !ctx.has_error) {
-        const char* line_end = strchr(line_start, '\n');
-        size_t line_length;
-        
-        if (line_end) {
-            line_length = line_end - line_start;
-        } else {
-            line_length = strlen(line_start);
+    for (int i = 0; i < files->count; i++) {
+        uint64_t path_length = strlen(files->paths[i]);
+        memcpy(pos, &files->stamps[i], sizeof(VglslFileStamp));
+        memcpy(pos + sizeof(VglslFileStamp), &path_length, 8);
+        pos += sizeof(VglslFileStamp) + 8;
+        memcpy(pos, files->paths[i], path_length + 1);
+        pos += VGLSL_CACHE_ALIGN(path_length + 1);
+    }
+    
+    if (result->segments) {
+        for (int i = 0; i < result->segment_count; i++) {
+            memcpy(pos, result->segments[i].data, result->segments[i].length);
+            pos += result->segments[i].length;
         }
+    } else {
+        memcpy(pos, result->output, result->output_length);
+        pos += result->output_length;
+    }
+    *pos = '\0';
+    
+    vglsl_cache_publish(cache->map, key, offset);
+}
+
+static VglslResult vglsl_parse_cached(VglslCache* cache, const char* filename, const VglslConfig* config) {
+    VglslResult result = {0};
+    vglsl_cache_refresh(cache);
+    uint64_t key = vglsl_cache_key(filename, config);
+    VglslCacheRecord* record = vglsl_cache_lookup(cache->map, key, true);
+    if (record) {
+        VglslCacheHeader* header = (VglslCacheHeader*)cache->map->base;
+        __atomic_store_n(&record->last_used, vglsl_atomic_add(&header->clock, 1) + 1, __ATOMIC_RELAXED);
         
-        char line_buffer[VGLSL_MAX_LINE_LENGTH];
-        if (line_length < sizeof(line_buffer)) {
-            memcpy(line_buffer, line_start, line_length);
-            line_buffer[line_length] = '\0';
-            
-            success = vglsl_process_line(&ctx, line_buffer, line_num, filename);
+        const char* output = vglsl_cache_output(record);
+        if (config->output_segments) {
+            /* The result keeps the mapping alive across compactions */
+            VglslStorage* storage = (VglslStorage*)VGLSL_MALLOC(sizeof(VglslStorage));
+            result.segments = (VglslSegment*)VGLSL_MALLOC(sizeof(VglslSegment));
+            if (storage && result.segments) {
+                memset(storage, 0, sizeof(VglslStorage));
+                storage->mapping = cache->map;
+                vglsl_atomic_add(&cache->map->refs, 1);
+                result.storage = storage;
+                result.segments[0].data = output;
+                result.segments[0].length = (size_t)record->output_length;
+                result.segment_count = 1;
+            } else {
+                VGLSL_FREE(storage);
+                VGLSL_FREE(result.segments);
+                result.segments = NULL;
+            }
         } else {
-            vglsl_set_error(&ctx, "Line too long", line_num, filename);
-            success = false;
+            result.output = (char*)VGLSL_MALLOC((size_t)record->output_length + 1);
+            if (result.output) memcpy(result.output, output, (size_t)record->output_length + 1);
         }
         
-        if (line_end) {
-            line_start = line_end + 1;
-        } else {
-            break;
+        if (result.segments || result.output) {
+            result.success = true;
+            result.cache_hit = true;
+            result.output_length = (size_t)record->output_length;
+            result.output_hash = record->output_hash;
+            result.output_changed = (result.output_hash != config->previous_hash);
+            return result;
         }
-        line_num++;
+        result.error_message = vglsl_strdup("Failed to allocate output buffer");
+        return result;
     }
     
-    /* Check for unclosed conditionals */
-    if (success && ctx.if_depth > 0) {
-        vglsl_set_error(&ctx, "Unclosed conditional directive", line_num, filename);
-        success = false;
+    VglslFileList files = {0};
+    result = vglsl_parse_file_tracked(filename, config, &files);
+    if (result.success && result.stage_count == 0 && !files.unstable) {
+        vglsl_cache_insert(cache, key, &result, &files);
     }
+    vglsl_file_list_free(&files);
+    return result;
+}
+#endif /* VGLSL_HAS_MMAP */
+
+VglslResult vglsl_parse_file_cached(VglslCache* cache, const char* filename, const VglslConfig* config) {
+#ifdef VGLSL_HAS_MMAP
+    if (cache && !config->load_file && !config->reflect && !config->minify && !config->export_defines) {
+        return vglsl_parse_cached(cache, filename, config);
+    }
+#endif
+    (void)cache;
+    return vglsl_parse_file_ex(filename, config);
+}
+
+bool vglsl_cache_compact(VglslCache* cache) {
+#ifdef VGLSL_HAS_MMAP
+    if (!cache) return false;
+    vglsl_cache_refresh(cache);
+    return vglsl_cache_compact_map(cache);
+#else
+    (void)cache;
+    return false;
+#endif
+}
+
+/* Variant parsing over an already loaded root source */
+static VglslResult vglsl_parse_variants_source(const char* source, size_t length, const char* filename,
+                                               const VglslConfig* config, const VglslVariant* variants,
+                                               int variant_count, VglslStore* store, int* handles) {
+    VglslResult result = {0};
+    for (int i = 0; i < variant_count; i++) handles[i] = -1;
     
-    /* Build result */
-    if (success && !ctx.has_error) {
-        result.success = true;
-        result.output = ctx.output;
-        ctx.output = NULL; /* Transfer ownership */
-    } else {
-        result.success = false;
-        result.error_message = ctx.error_message;
-        result.error_line = ctx.error_line;
-        result.error_file = ctx.error_file;
-        ctx.error_message = NULL; /* Transfer ownership */
-        ctx.error_file = NULL;
+    /* Config defines first, then the variant's own */
+    int max_variant_defines = 0;
+    for (int i = 0; i < variant_count; i++) {
+        if (variants[i].define_count > max_variant_defines) max_variant_defines = variants[i].define_count;
     }
     
-    vglsl_cleanup_context(&ctx);
+    const char** defines = (const char**)VGLSL_MALLOC((config->define_count + max_variant_defines + 1) * sizeof(const char*));
+    if (!defines) {
+        result.error_message = vglsl_strdup("Failed to allocate variant defines");
+        return result;
+    }
+    for (int i = 0; i < config->define_count; i++) defines[i] = config->defines[i];
+    
+    VglslConfig variant_config = *config;
+    variant_config.defines = defines;
+    variant_config.output_segments = false; /* The store keeps one buffer per output */
+    
+    for (int i = 0; i < variant_count; i++) {
+        for (int j = 0; j < variants[i].define_count; j++) {
+            defines[config->define_count + j] = variants[i].defines[j];
+        }
+        variant_config.define_count = config->define_count + variants[i].define_count;
+        
+        VglslSource memory = vglsl_source_from_memory(source, length);
+        VglslResult variant = vglsl_parse_internal(&memory, filename, &variant_config);
+        if (!variant.success) {
+            VGLSL_FREE(defines);
+            return variant;
+        }
+        
+        /* Hand the output buffer to the store instead of copying it */
+        handles[i] = vglsl_store_insert(store, variant.output, variant.output_length, variant.output_hash, true);
+        variant.output = NULL;
+        vglsl_free_result(&variant);
+        
+        if (handles[i] < 0) {
+            VGLSL_FREE(defines);
+            result.error_message = vglsl_strdup("Failed to store variant output");
+            return result;
+        }
+    }
+    
+    VGLSL_FREE(defines);
+    result.success = true;
     return result;
 }
 
-/* Public API implementations */
-VglslResult vglsl_parse_file(const char* filename, const char* base_path) {
-    VglslConfig config = vglsl_default_config();
-    config.base_path = base_path;
-    return vglsl_parse_file_ex(filename, &config);
+VglslResult vglsl_parse_variants(const char* source, const char* filename, const VglslConfig* config,
+                                 const VglslVariant* variants, int variant_count,
+                                 VglslStore* store, int* handles) {
+    return vglsl_parse_variants_source(source, strlen(source), filename, config, variants, variant_count, store, handles);
 }
 
-VglslResult vglsl_parse_file_ex(const char* filename, const VglslConfig* config) {
+VglslResult vglsl_parse_file_variants(const char* filename, const VglslConfig* config,
+                                      const VglslVariant* variants, int variant_count,
+                                      VglslStore* store, int* handles) {
     VglslResult result = {0};
     
-    char* source = vglsl_read_file(filename);
-    if (!source) {
+    /* Read the root once for all variants */
+    VglslSource source;
+    if (!vglsl_source_from_file(config, filename, &source)) {
         char error_msg[512];
         snprintf(error_msg, sizeof(error_msg), "Failed to read file: %s", filename);
         result.error_message = vglsl_strdup(error_msg);
+        for (int i = 0; i < variant_count; i++) handles[i] = -1;
         return result;
     }
     
-    result = vglsl_parse_internal(source, filename, config);
-    VGLSL_FREE(source);
-    
+    result = vglsl_parse_variants_source(source.data, source.size, filename, config, variants, variant_count, store, handles);
+    vglsl_source_close(&source);
     return result;
 }
 
-VglslResult vglsl_parse_memory(const char* source, const char* filename) {
-    VglslConfig config = vglsl_default_config();
-    return vglsl_parse_memory_ex(source, filename, &config);
+/* Virtual include path management functions */
+
+/* Child slot of a segment in a node: its index if present, else where it
+ * would be inserted, negated minus one */
+static int vglsl_virtual_find(const VglslVirtualNode* node, const char* segment, size_t length) {
+    int low = 0, high = node->child_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        const VglslVirtualNode* child = node->children[mid];
+        size_t common = child->length < length ? child->length : length;
+        int order = memcmp(child->segment, segment, common);
+        if (order == 0) order = child->length < length ? -1 : child->length > length;
+        if (order == 0) return mid;
+        if (order < 0) low = mid + 1;
+        else high = mid - 1;
+    }
+    return -low - 1;
 }
 
-VglslResult vglsl_parse_memory_ex(const char* source, const char* filename, const VglslConfig* config) {
-    return vglsl_parse_internal(source, filename, config);
+/* Next segment of a virtual name, skipping empty ones; NULL at the end */
+static const char* vglsl_virtual_segment(const char* name, size_t* length) {
+    while (*name == '/') name++;
+    if (!*name) return NULL;
+    *length = strcspn(name, "/");
+    return name;
 }
 
-void vglsl_free_result(VglslResult* result) {
-    if (!result) return;
-    
-    if (result->output) {
-        VGLSL_FREE(result->output);
-        result->output = NULL;
-    }
-    
-    if (result->error_message) {
-        VGLSL_FREE(result->error_message);
-        result->error_message = NULL;
-    }
-    
-    if (result->error_file) {
-        VGLSL_FREE(result->error_file);
-        result->error_file = NULL;
+static void vglsl_virtual_free(VglslVirtualNode* node) {
+    for (int i = 0; i < node->child_count; i++) {
+        vglsl_virtual_free(node->children[i]);
+        VGLSL_FREE(node->children[i]);
     }
-    
-    result->success = false;
-    result->error_line = 0;
+    VGLSL_FREE(node->children);
+    VGLSL_FREE(node->segment);
+    VGLSL_FREE(node->real_path);
+    memset(node, 0, sizeof(*node));
 }
 
-/* Virtual include path management functions */
 void vglsl_add_virtual_include_path(const char* virtual_name, const char* real_path) {
-    if (!virtual_name || !real_path || g_virtual_path_count >= VGLSL_MAX_VIRTUAL_PATHS) {
+    if (!virtual_name || !real_path) {
         return;
     }
     
-    /* Check if virtual name already exists and update it */
-    for (int i = 0; i < g_virtual_path_count; i++) {
-        if (strcmp(g_virtual_paths[i].virtual_name, virtual_name) == 0) {
-            VGLSL_FREE(g_virtual_paths[i].real_path);
-            g_virtual_paths[i].real_path = vglsl_strdup(real_path);
+    char* copy = vglsl_strdup(real_path);
+    if (!copy) return;
+    
+    /* Walk down the segments, adding the missing ones */
+    VglslVirtualNode* node = &g_virtual_root;
+    size_t length;
+    for (const char* segment = vglsl_virtual_segment(virtual_name, &length); segment;
+         segment = vglsl_virtual_segment(segment + length, &length)) {
+        int index = vglsl_virtual_find(node, segment, length);
+        if (index >= 0) {
+            node = node->children[index];
+            continue;
+        }
+        
+        index = -index - 1;
+        if (node->child_count >= node->child_capacity) {
+            int new_capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+            VglslVirtualNode** children = (VglslVirtualNode**)VGLSL_REALLOC(node->children, new_capacity * sizeof(VglslVirtualNode*));
+            if (!children) {
+                VGLSL_FREE(copy);
+                return;
+            }
+            node->children = children;
+            node->child_capacity = new_capacity;
+        }
+        
+        VglslVirtualNode* child = (VglslVirtualNode*)VGLSL_MALLOC(sizeof(VglslVirtualNode));
+        char* name = (char*)VGLSL_MALLOC(length + 1);
+        if (!child || !name) {
+            VGLSL_FREE(child);
+            VGLSL_FREE(name);
+            VGLSL_FREE(copy);
             return;
         }
+        memset(child, 0, sizeof(*child));
+        memcpy(name, segment, length);
+        name[length] = '\0';
+        child->segment = name;
+        child->length = length;
+        
+        memmove(&node->children[index + 1], &node->children[index], (node->child_count - index) * sizeof(VglslVirtualNode*));
+        node->children[index] = child;
+        node->child_count++;
+        node = child;
+    }
+    
+    if (node == &g_virtual_root) {
+        VGLSL_FREE(copy);
+        return;
+    }
+    VGLSL_FREE(node->real_path);
+    node->real_path = copy;
+    g_virtual_generation++;
+}
+
+/* Unmount name below node; true when node is left with nothing to keep */
+static bool vglsl_virtual_remove(VglslVirtualNode* node, const char* name) {
+    size_t length;
+    const char* segment = vglsl_virtual_segment(name, &length);
+    if (!segment) {
+        if (!node->real_path) return false;
+        VGLSL_FREE(node->real_path);
+        node->real_path = NULL;
+        g_virtual_generation++;
+        return node->child_count == 0;
     }
     
-    /* Add new virtual path */
-    g_virtual_paths[g_virtual_path_count].virtual_name = vglsl_strdup(virtual_name);
-    g_virtual_paths[g_virtual_path_count].real_path = vglsl_strdup(real_path);
-    g_virtual_path_count++;
+    int index = vglsl_virtual_find(node, segment, length);
+    if (index < 0 || !vglsl_virtual_remove(node->children[index], segment + length)) return false;
+    
+    /* Prune the emptied child */
+    vglsl_virtual_free(node->children[index]);
+    VGLSL_FREE(node->children[index]);
+    memmove(&node->children[index], &node->children[index + 1], (node->child_count - index - 1) * sizeof(VglslVirtualNode*));
+    node->child_count--;
+    return node->child_count == 0 && !node->real_path;
 }
 
 void vglsl_remove_virtual_include_path(const char* virtual_name) {
     if (!virtual_name) return;
-    
-    for (int i = 0; i < g_virtual_path_count; i++) {
-        if (strcmp(g_virtual_paths[i].virtual_name, virtual_name) == 0) {
-            VGLSL_FREE(g_virtual_paths[i].virtual_name);
-            VGLSL_FREE(g_virtual_paths[i].real_path);
-            
-            /* Shift remaining entries down */
-            for (int j = i; j < g_virtual_path_count - 1; j++) {
-                g_virtual_paths[j] = g_virtual_paths[j + 1];
-            }
-            g_virtual_path_count--;
-            return;
-        }
-    }
+    vglsl_virtual_remove(&g_virtual_root, virtual_name);
 }
 
 void vglsl_clear_virtual_include_paths(void) {
-    for (int i = 0; i < g_virtual_path_count; i++) {
-        VGLSL_FREE(g_virtual_paths[i].virtual_name);
-        VGLSL_FREE(g_virtual_paths[i].real_path);
-    }
-    g_virtual_path_count = 0;
+    vglsl_virtual_free(&g_virtual_root);
+    g_virtual_generation++;
 }
 
-/* Resolve virtual include path */
-static const char* vglsl_resolve_virtual_path(const char* include_path) {
-    if (!include_path) return NULL;
-    
-    /* Find the first slash to separate virtual folder from relative path */
-    const char* slash = strchr(include_path, '/');
-    if (!slash) return NULL;
+/* Resolve virtual include path - the longest mounted prefix of whole
+ * segments, followed by more of the path. Writes the real path to buffer
+ * (NUL-terminated when it fits) and returns its length, 0 if no mount
+ * matches. */
+static size_t vglsl_resolve_virtual_path(const char* include_path, char* buffer, size_t capacity) {
+    if (!include_path) return 0;
     
-    size_t virtual_name_len = slash - include_path;
-    
-    /* Check if this matches any virtual path */
-    for (int i = 0; i < g_virtual_path_count; i++) {
-        if (strlen(g_virtual_paths[i].virtual_name) == virtual_name_len &&
-            strncmp(g_virtual_paths[i].virtual_name, include_path, virtual_name_len) == 0) {
-            
-            /* Build full path: real_path + remaining_path */
-            static char resolved_path[1024];
-            snprintf(resolved_path, sizeof(resolved_path), "%s%s", 
-                    g_virtual_paths[i].real_path, slash);
-            return resolved_path;
+    const VglslVirtualNode* node = &g_virtual_root;
+    const VglslVirtualNode* mount = NULL;
+    const char* rest = NULL;
+    const char* pos = include_path;
+    while (*pos) {
+        size_t length = strcspn(pos, "/");
+        if (pos[length] != '/') break; /* The file name itself */
+        
+        int index = vglsl_virtual_find(node, pos, length);
+        if (index < 0) break;
+        node = node->children[index];
+        pos += length;
+        if (node->real_path) {
+            mount = node;
+            rest = pos;
         }
+        while (*pos == '/') pos++;
     }
+    if (!mount) return 0;
     
-    return NULL;
+    /* Build full path: real_path + remaining_path */
+    size_t real_length = strlen(mount->real_path);
+    size_t rest_length = strlen(rest);
+    size_t total = real_length + rest_length;
+    if (total < capacity) {
+        memcpy(buffer, mount->real_path, real_length);
+        memcpy(buffer + real_length, rest, rest_length + 1);
+    }
+    return total;
 }
 
 #endif /* VGLSL_IMPLEMENTATION */